@@ -2,6 +2,8 @@
 #include "commands.hpp"
 #include "storage.hpp"
 #include "rdb.hpp"
+#include "aof.hpp"
+#include "event_loop.hpp"
 
 #include <iostream>
 #include <string>
@@ -9,273 +11,159 @@
 #include <cstring>
 #include <algorithm>
 #include <thread>
+#include <climits>
+#include <cstdint>
 
 #include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <poll.h>
-#include <netdb.h>
 
-static std::string dispatch(const std::string& cmd, int fd) {
-    if (!cmd.empty() && cmd[0] != '*') {
-        if (cmd.find("PING") != std::string::npos) return "+PONG\r\n";
-        if (cmd.find("INCR") != std::string::npos) return "-ERR Use RESP format for INCR\r\n";
-        if (cmd.find("MULTI") != std::string::npos) return "+OK\r\n";
-        if (cmd.find("EXEC") != std::string::npos) return "-ERR EXEC without MULTI\r\n";
-        return "-ERR unknown command\r\n";
-    }
-
-    {
-        std::lock_guard<std::mutex> lock(transaction_mutex);
-        auto it = client_transactions.find(fd);
-        if (it != client_transactions.end() && it->second.in_transaction) {
-         
-            if (cmd.find("MULTI") != std::string::npos) {
-                return "-ERR MULTI calls can not be nested\r\n";
-            }
-            
-            auto parts = parse_resp_array(cmd.c_str());
-            if (parts.empty()) return "-ERR Protocol error\r\n";
-            std::string op = to_lower(parts[0]);
-            
-            if (op != "exec" && op != "discard") {
-                it->second.queued_commands.push_back(cmd);
-                return "+QUEUED\r\n";
-            }
+// Parses a byte count with an optional kb/mb/gb suffix, as used by Redis configuration.
+static bool parse_memory(const std::string& text, size_t& out) {
+    std::string lower = to_lower(text);
+    size_t unit = 1;
+    for (const auto& [suffix, scale] : { std::pair<const char*, size_t>{"gb", 1UL << 30}, {"mb", 1UL << 20}, {"kb", 1UL << 10}, {"b", 1} }) {
+        size_t len = strlen(suffix);
+        if (lower.size() > len && lower.compare(lower.size() - len, len, suffix) == 0) {
+            lower.resize(lower.size() - len);
+            unit = scale;
+            break;
         }
     }
-    auto parts = parse_resp_array(cmd.c_str());
-    if (parts.empty()) return "-ERR Protocol error\r\n";
-    std::string op = to_lower(parts[0]);
-
-    if (op == "ping") {
-        return "+PONG\r\n";
-    } else if (op == "echo") {
-        if (parts.size() != 2) return "-ERR wrong number of arguments for 'echo'\r\n";
-        const auto& message = parts[1];
-        return "$" + std::to_string(message.size()) + "\r\n" + message + "\r\n";
-    } else if (op == "set") {
-        return handle_set(cmd.c_str());
-    } else if (op == "get") {
-        return handle_get(cmd.c_str());
-    } else if (op == "incr") {
-        return handle_INCR(cmd.c_str());
-    } else if (op == "multi") {
-        return handle_MULTI(cmd.c_str(), fd);
-    } else if (op == "exec") {
-        return handle_EXEC(cmd.c_str(), fd);
-    } else if (op == "rpush") {
-        return handle_RPUSH(cmd.c_str());
-    } else if (op == "lpush") {
-        return handle_LPUSH(cmd.c_str());
-    } else if (op == "lpop") {
-        return handle_LPOP(cmd.c_str());
-    } else if (op == "lrange") {
-        return handle_LRANGE(cmd.c_str());
-    } else if (op == "llen") {
-        return handle_LLEN(cmd.c_str());
-    } else if (op == "blpop") {
-        return handle_BLPOP(cmd.c_str(), fd); 
-    } else if (op == "type") {
-        return handle_TYPE(cmd.c_str());
-    } else if (op == "xadd") {
-        return handle_XADD(cmd.c_str());
-    } else if(op == "xrange") {
-        return handle_XRANGE(cmd.c_str());
-    } else if(op == "xread") {
-        return handle_XREAD(cmd.c_str(), fd); 
-    } else if (op == "save") {
-        return handle_SAVE(cmd.c_str());
-    } else if (op == "bgsave") {
-        return handle_BGSAVE(cmd.c_str());
-    } else {
-        return "-ERR Invalid Unknown Command\r\n";
-    }
+    long long value = 0;
+    if (!parse_int64(lower, value) || value < 0 || static_cast<size_t>(value) > SIZE_MAX / unit) return false;
+    out = static_cast<size_t>(value) * unit;
+    return true;
 }
 
-void blpop_timeout_monitor() {
-    while (true) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        TimePoint now = Clock::now();
-
-        std::vector<int> timed_out_clients;
-
-        {
-            std::lock_guard<std::mutex> lk(blocked_mutex);
-            for (const auto& [fd, info] : blocked_clients_info) {
-                if (info.expiry <= now) {
-                    timed_out_clients.push_back(fd);
-                }
+static bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--event-loop" && i + 1 < argc) {
+            std::string backend = to_lower(argv[++i]);
+            if (backend == "epoll") {
+                event_loop_backend = EventLoopBackend::Epoll;
+            } else if (backend == "poll") {
+                event_loop_backend = EventLoopBackend::Poll;
+            } else {
+                std::cerr << "Unknown event loop backend: " << backend << "\n";
+                return false;
             }
-        }
-
-        for (int fd : timed_out_clients) {
-            std::string list_name;
-            {
-                std::scoped_lock lk(blocked_mutex, storage_mutex);
-                auto it_info = blocked_clients_info.find(fd);
-                if (it_info == blocked_clients_info.end()) continue;
-                list_name = it_info->second.list_name;
-
-                
-                auto& q = blocked_clients[list_name];
-                std::queue<int> new_queue;
-                while (!q.empty()) {
-                    int front = q.front();
-                    q.pop();
-                    if (front != fd) new_queue.push(front);
-                }
-                q.swap(new_queue);
-
-                blocked_clients_info.erase(fd);
-                client_blocked_on_list.erase(fd);
-                blocked_fds.erase(fd);
+        } else if (arg == "--io-threads" && i + 1 < argc) {
+            try {
+                io_threads = std::stoi(argv[++i]);
+            } catch (...) {
+                io_threads = -1;
             }
-
-            std::string response = "*-1\r\n";
-            send_response(fd, response);
+            if (io_threads < 1) {
+                std::cerr << "Invalid --io-threads value\n";
+                return false;
+            }
+        } else if (arg == "--client-output-buffer-limit" && i + 3 < argc) {
+            OutputBufferLimits limits{};
+            long long seconds = 0;
+            if (!parse_memory(argv[i + 1], limits.hard_bytes) || !parse_memory(argv[i + 2], limits.soft_bytes) ||
+                !parse_int64(argv[i + 3], seconds) || seconds < 0 || seconds > INT_MAX) {
+                std::cerr << "Invalid --client-output-buffer-limit value\n";
+                return false;
+            }
+            limits.soft_seconds = static_cast<int>(seconds);
+            client_output_buffer_limits = limits;
+            i += 3;
+        } else if (arg == "--list-max-listpack-size" && i + 1 < argc) {
+            long long size = 0;
+            if (!parse_int64(argv[++i], size) || size < -5 || size == 0 || size > INT_MAX) {
+                std::cerr << "Invalid --list-max-listpack-size value\n";
+                return false;
+            }
+            list_max_listpack_size = static_cast<int>(size);
+        } else if (arg == "--stream-node-max-bytes" && i + 1 < argc) {
+            if (!parse_memory(argv[++i], stream_node_max_bytes)) {
+                std::cerr << "Invalid --stream-node-max-bytes value\n";
+                return false;
+            }
+        } else if (arg == "--stream-node-max-entries" && i + 1 < argc) {
+            long long entries = 0;
+            if (!parse_int64(argv[++i], entries) || entries < 0) {
+                std::cerr << "Invalid --stream-node-max-entries value\n";
+                return false;
+            }
+            stream_node_max_entries = static_cast<size_t>(entries);
+        } else if (arg == "--appendonly" && i + 1 < argc) {
+            std::string value = to_lower(argv[++i]);
+            if (value != "yes" && value != "no") {
+                std::cerr << "Invalid --appendonly value\n";
+                return false;
+            }
+            aof_enabled = value == "yes";
+        } else if (arg == "--appendfilename" && i + 1 < argc) {
+            aof_filename = argv[++i];
+        } else if (arg == "--appendfsync" && i + 1 < argc) {
+            std::string policy = to_lower(argv[++i]);
+            if (policy == "always") {
+                aof_fsync = AofFsync::Always;
+            } else if (policy == "everysec") {
+                aof_fsync = AofFsync::Everysec;
+            } else if (policy == "no") {
+                aof_fsync = AofFsync::No;
+            } else {
+                std::cerr << "Invalid --appendfsync value\n";
+                return false;
+            }
+        } else if (arg == "--auto-aof-rewrite-percentage" && i + 1 < argc) {
+            long long percentage = 0;
+            if (!parse_int64(argv[++i], percentage) || percentage < 0 || percentage > INT_MAX) {
+                std::cerr << "Invalid --auto-aof-rewrite-percentage value\n";
+                return false;
+            }
+            aof_rewrite_percentage = static_cast<int>(percentage);
+        } else if (arg == "--auto-aof-rewrite-min-size" && i + 1 < argc) {
+            if (!parse_memory(argv[++i], aof_rewrite_min_size)) {
+                std::cerr << "Invalid --auto-aof-rewrite-min-size value\n";
+                return false;
+            }
+        } else {
+            std::cerr << "Unknown option: " << arg << "\n";
+            return false;
         }
     }
+    return true;
 }
 
-void stream_block_timeout_monitor() {
-    while (true) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        TimePoint now = Clock::now();
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        std::cerr << "Usage: " << argv[0] << " [--event-loop epoll|poll] [--io-threads N]"
+                  << " [--client-output-buffer-limit <hard> <soft> <soft-seconds>]"
+                  << " [--list-max-listpack-size N]"
+                  << " [--stream-node-max-bytes <bytes>] [--stream-node-max-entries N]"
+                  << " [--appendonly yes|no] [--appendfilename <file>] [--appendfsync always|everysec|no]"
+                  << " [--auto-aof-rewrite-percentage N] [--auto-aof-rewrite-min-size <bytes>]\n";
+        return 1;
+    }
 
-        std::vector<int> timed_out_clients;
+    update_lru_clock();
 
-        {
-            std::scoped_lock lk(blocked_mutex, streams_mutex);
-            for (auto& [stream_key, clients] : blocked_stream_clients) {
-                for (auto it = clients.begin(); it != clients.end();) {
-                    if (it->expiry == TimePoint::max()) {
-                        ++it;
-                        continue;
-                    }
-                    
-                    if (it->expiry <= now) {
-                        timed_out_clients.push_back(it->fd);
-                        blocked_stream_fds.erase(it->fd);
-                        it = clients.erase(it);
-                    } else {
-                        ++it;
-                    }
-                }
-            }
+    // With the AOF on, its file holds the most recent dataset whenever it exists.
+    if (aof_enabled && access(aof_filename.c_str(), F_OK) == 0) {
+        std::cout << "Loading data from AOF file: " << aof_filename << std::endl;
+        if (!aof_load(aof_filename)) {
+            std::cerr << "AOF load failed" << std::endl;
+            return 1;
         }
-
-        for (int fd : timed_out_clients) {
-            std::string response = "*-1\r\n";
-            send_response(fd, response);
-        }
-    }
-}
-
-int main() {
-    if (rdb_enabled) {
+    } else if (rdb_enabled && access(rdb_filename.c_str(), F_OK) == 0) {
+        // A corrupt snapshot stops the server rather than being served, or saved over
         std::cout << "Loading data from RDB file: " << rdb_filename << std::endl;
-        if (rdb_load(rdb_filename)) {
-            std::cout << "RDB load completed" << std::endl;
-        } else {
-            std::cerr << "RDB load failed or file not found" << std::endl;
+        if (!rdb_load(rdb_filename)) {
+            std::cerr << "RDB load failed" << std::endl;
+            return 1;
         }
+        std::cout << "RDB load completed" << std::endl;
     }
 
-    std::thread(expiry_monitor).detach();
-    std::thread(blpop_timeout_monitor).detach();
-    std::thread(stream_block_timeout_monitor).detach();
+    if (aof_enabled && !aof_open()) return 1;
+    std::thread(aof_cron).detach();
+
     std::thread(rdb_background_saver).detach(); 
     std::cout << std::unitbuf;
     std::cerr << std::unitbuf;
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        std::cerr << "Failed to create server socket\n";
-        return 1;
-    }
-
-    int reuse = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-        std::cerr << "setsockopt failed\n";
-        return 1;
-    }
-
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(6379);
-
-    if (bind(server_fd, (sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
-        std::cerr << "Failed to bind to port 6379\n";
-        return 1;
-    }
-    if (listen(server_fd, 64) != 0) {
-        std::cerr << "listen failed\n";
-        return 1;
-    }
-
-    std::vector<pollfd> poll_fds;
-    poll_fds.push_back({ server_fd, POLLIN, 0 });
-
-    while (true) {
-        int rc = poll(poll_fds.data(), poll_fds.size(), -1);
-        if (rc < 0) {
-            std::cerr << "Poll failed\n";
-            break;
-        }
-
-        if (poll_fds[0].revents & POLLIN) {
-            sockaddr_in client_addr{};
-            socklen_t client_len = sizeof(client_addr);
-            int client_fd = accept(server_fd, (sockaddr*)&client_addr, &client_len);
-            if (client_fd >= 0) {
-                std::cout << "New client connected: FD " << client_fd << std::endl;
-                poll_fds.push_back({ client_fd, POLLIN, 0 }); 
-            }
-        }
-
-        for (size_t i = 1; i < poll_fds.size();) {
-            int fd = poll_fds[i].fd;
-
-            {
-                std::lock_guard<std::mutex> lk(blocked_mutex);
-                if (blocked_stream_fds.find(fd) != blocked_stream_fds.end()) {
-                    ++i;
-                    continue;
-                }
-            }
-
-            if (poll_fds[i].revents & POLLIN) {
-                char buffer[4096];
-                ssize_t n = recv(fd, buffer, sizeof(buffer) - 1, 0);
-                if (n <= 0) {
-                    std::cout << "Client disconnected: FD " << fd << std::endl;
-                    close(fd);
-                    remove_blocked_client_fd(fd);
-                    remove_blocked_stream_client_fd(fd);
-                    remove_client_transaction(fd);;
-                    poll_fds.erase(poll_fds.begin() + i);
-                    continue;
-                }
-                buffer[n] = '\0';
-                std::string cmd(buffer);
-        
-                std::string res = dispatch(cmd, fd);
-                if (!res.empty()) {
-                    send_response(fd, res);
-                }
-            }
-            ++i;
-        }
-        
-        
-    }
-
-    for (auto &pfd : poll_fds) close(pfd.fd);
-    close(server_fd);
-    
-    return 0;
+    return run_reactors(6379);
 }
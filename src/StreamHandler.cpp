@@ -1,37 +1,19 @@
 #include "StreamHandler.hpp"
 
-bool parse_entry_id(const std::string& id, uint64_t& ms_time, uint64_t& seq_num, bool& seq_wildcard, bool& full_wildcard) {
-    static std::regex id_regex(R"(^(\d+)-(\*|\d+)$)");
-    seq_wildcard = false;
-    full_wildcard = false;
-
-    if (id == "*") {
-        full_wildcard = true;
-        ms_time = seq_num = UINT64_MAX; 
-        return true;
-    }
-
-    std::smatch match;
-    if (!std::regex_match(id, match, id_regex)) return false;
+#include <charconv>
 
-    try {
-        ms_time = std::stoull(match[1].str());
-        if (match[2] == "*") {
-            seq_wildcard = true;
-            seq_num = UINT64_MAX;
-        } else {
-            seq_num = std::stoull(match[2].str());
-        }
-    } catch (...) {
-        return false;
+bool parse_entry_id(std::string_view text, StreamID& id, bool& seq_wildcard, bool& full_wildcard) {
+    seq_wildcard = false;
+    full_wildcard = text == "*";
+    if (full_wildcard) return true;
+
+    size_t dash = text.find('-');
+    if (dash == std::string_view::npos) return false;
+    if (text.substr(dash + 1) == "*") {
+        seq_wildcard = true;
+        return parse_stream_id(text.substr(0, dash), id);
     }
-    return true;
-}
-
-bool is_id_greater(uint64_t new_ms, uint64_t new_seq, uint64_t last_ms, uint64_t last_seq) {
-    if (new_ms > last_ms) return true;
-    if (new_ms == last_ms && new_seq > last_seq) return true;
-    return false;
+    return parse_stream_id(text, id);
 }
 
 
@@ -40,55 +22,41 @@ uint64_t current_unix_time_ms() {
     return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
 }
 
-std::string encode_xrange_response(const std::vector<std::pair<std::string, StreamEntry>>& entries) {
-    std::string resp = "*" + std::to_string(entries.size()) + "\r\n";
-    for (const auto& [entry_id, kvs] : entries) {
-        resp += "*2\r\n";                   
-        resp += resp_bulk_string(entry_id);  
+static void append_bulk_string(std::string& out, std::string_view s) {
+    char header[24];
+    char* end = std::to_chars(header + 1, header + sizeof(header), s.size()).ptr;
+    header[0] = '$';
+    *end++ = '\r';
+    *end++ = '\n';
+    out.append(header, static_cast<size_t>(end - header));
+    out.append(s.data(), s.size());
+    out += "\r\n";
+}
 
-        std::vector<std::string> kv_list;
-        for (const auto& [k, v] : kvs) {
-            kv_list.push_back(k);
-            kv_list.push_back(v);
-        }
-        resp += resp_array(kv_list); 
-    }
-    return resp;
+void append_stream_entry(std::string& out, const StreamIterator& it) {
+    char id[STREAM_ID_MAX_LEN];
+    out += "*2\r\n";
+    append_bulk_string(out, std::string_view(id, format_stream_id(it.id(), id)));
+    out += "*" + std::to_string(it.field_count() * 2) + "\r\n";
+    it.for_each_field([&](std::string_view field, std::string_view value) {
+        append_bulk_string(out, field);
+        append_bulk_string(out, value);
+    });
 }
 
-bool parse_range_id(const std::string& id, uint64_t& ms_time, uint64_t& seq_num) {
-    if (id == "-") {
-        ms_time = 0;
-        seq_num = 0;
+bool parse_range_id(std::string_view text, StreamID& id, uint64_t missing_seq) {
+    if (text == "-") {
+        id = StreamID{0, 0};
         return true;
     }
-    if (id == "+") {
-        ms_time = UINT64_MAX;
-        seq_num = UINT64_MAX;
+    if (text == "+") {
+        id = StreamID{UINT64_MAX, UINT64_MAX};
         return true;
     }
-    if (id == "$") {
-        
-        ms_time = UINT64_MAX - 1; 
-        seq_num = UINT64_MAX - 1;
+    if (text == "$") {
+        // Resolved by XREAD to the stream's last ID.
+        id = StreamID{UINT64_MAX - 1, UINT64_MAX - 1};
         return true;
     }
-    static std::regex re(R"(^(\d+)(?:-(\d+))?$)");
-    std::smatch match;
-    if (!std::regex_match(id, match, re)) return false;
-    try {
-        ms_time = std::stoull(match[1].str());
-        if (match[2].matched) {
-            seq_num = std::stoull(match[2].str());
-        } else {
-            seq_num = 0;
-        }
-    } catch (...) {
-        return false;
-    }
-    return true;
+    return parse_stream_id(text, id, missing_seq);
 }
-
-bool id_less_equal(uint64_t a_ms, uint64_t a_seq, uint64_t b_ms, uint64_t b_seq) {
-    return (a_ms < b_ms) || (a_ms == b_ms && a_seq <= b_seq);
-}
\ No newline at end of file
@@ -1,15 +1,19 @@
 #pragma once
-#include <regex>
 #include <stdexcept>
 #include <cstdint>
 #include <chrono>
+#include <string_view>
 #include "storage.hpp"
 #include "parser.hpp"
 using namespace std;
 
-bool parse_entry_id(const std::string& id, uint64_t& ms_time, uint64_t& seq_num, bool& seq_wildcard, bool& full_wildcard);
-bool is_id_greater(uint64_t new_ms, uint64_t new_seq, uint64_t last_ms, uint64_t last_seq);
+// An XADD ID: "*", "ms-*" or "ms-seq". The wildcard parts are left for the caller to fill
+// in from the stream's last ID.
+bool parse_entry_id(std::string_view text, StreamID& id, bool& seq_wildcard, bool& full_wildcard);
 uint64_t current_unix_time_ms();
-bool parse_range_id(const std::string& id, uint64_t& ms_time, uint64_t& seq_num);
-bool id_less_equal(uint64_t a_ms, uint64_t a_seq, uint64_t b_ms, uint64_t b_seq);
-std::string encode_xrange_response(const std::vector<std::pair<std::string, StreamEntry>>& entries);
\ No newline at end of file
+// A range bound: "-", "+", "$", "ms-seq", or "ms" alone taking missing_seq as its sequence
+// number (0 for a start, UINT64_MAX for an end).
+bool parse_range_id(std::string_view text, StreamID& id, uint64_t missing_seq = 0);
+// Appends the entry the iterator is at as a reply element: its ID and its fields and
+// values as one flat array.
+void append_stream_entry(std::string& out, const StreamIterator& it);
@@ -0,0 +1,548 @@
+#include "aof.hpp"
+#include "commands.hpp"
+#include "storage.hpp"
+#include "StreamHandler.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+bool aof_enabled = false;
+std::string aof_filename = "appendonly.aof";
+AofFsync aof_fsync = AofFsync::Everysec;
+int aof_rewrite_percentage = 100;
+size_t aof_rewrite_min_size = 64UL * 1024 * 1024;
+bool aof_loading = false;
+
+AofStats aof_stats;
+
+// Elements per RPUSH when a rewrite writes out a list, as in Redis.
+static const size_t AOF_REWRITE_ITEMS_PER_CMD = 64;
+static const size_t AOF_READ_CHUNK = 4 * 1024 * 1024;
+static const size_t AOF_WRITE_CHUNK = 1024 * 1024;
+
+// Logging is on once aof_open() has succeeded; until then aof_append() does nothing,
+// which also keeps the replay from logging the commands it replays.
+static std::atomic<bool> aof_on{false};
+
+// Commands are logged to aof_buf under aof_mutex, which is only held to append or to take
+// the buffer. flush_mutex serializes writing the buffer out and guards the file
+// descriptor; it is taken before aof_mutex.
+static std::mutex aof_mutex;
+static std::string aof_buf;
+static std::string rewrite_buf;                 // commands logged since a rewrite's fork
+static bool rewrite_buffering = false;
+static std::atomic<uint64_t> aof_appended{0};   // bytes ever logged, counting those in aof_buf
+static std::mutex flush_mutex;
+static int aof_fd = -1;
+static std::string flushing;                    // the batch being written, under flush_mutex
+static std::atomic<uint64_t> aof_written{0};    // bytes of the log handed to write()
+static std::atomic<uint64_t> aof_synced{0};     // bytes of the log known to be on disk
+static pid_t rewrite_child = -1;
+
+static thread_local std::string* transaction_log = nullptr;
+
+static void append_multibulk_header(std::string& out, size_t count) {
+    char buf[24];
+    buf[0] = '*';
+    char* end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, count).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+    out.append(buf, static_cast<size_t>(end - buf));
+}
+
+static void append_bulk(std::string& out, std::string_view s) {
+    char buf[24];
+    buf[0] = '$';
+    char* end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, s.size()).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+    out.append(buf, static_cast<size_t>(end - buf));
+    out.append(s.data(), s.size());
+    out += "\r\n";
+}
+
+static void append_command(std::string& out, const std::string_view* args, size_t count) {
+    append_multibulk_header(out, count);
+    for (size_t i = 0; i < count; ++i) append_bulk(out, args[i]);
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Takes logged commands in under aof_mutex.
+static void log_raw(const std::string& commands) {
+    std::lock_guard<std::mutex> lk(aof_mutex);
+    aof_buf += commands;
+    if (rewrite_buffering) rewrite_buf += commands;
+    aof_appended.fetch_add(commands.size(), std::memory_order_release);
+}
+
+void aof_append(const std::string_view* args, size_t count) {
+    if (!aof_on.load(std::memory_order_acquire)) return;
+    if (transaction_log) {
+        append_command(*transaction_log, args, count);
+        return;
+    }
+    static thread_local std::string encoded;
+    encoded.clear();
+    append_command(encoded, args, count);
+    log_raw(encoded);
+}
+
+void aof_append(std::initializer_list<std::string_view> args) {
+    aof_append(args.begin(), args.size());
+}
+
+void aof_begin_transaction() {
+    static thread_local std::string commands;
+    commands.clear();
+    transaction_log = &commands;
+}
+
+void aof_end_transaction() {
+    std::string* commands = transaction_log;
+    transaction_log = nullptr;
+    if (!commands || commands->empty()) return;
+    static const std::string_view multi[] = {"MULTI"};
+    static const std::string_view exec[] = {"EXEC"};
+    std::string wrapped;
+    wrapped.reserve(commands->size() + 32);
+    append_command(wrapped, multi, 1);
+    wrapped += *commands;
+    append_command(wrapped, exec, 1);
+    log_raw(wrapped);
+}
+
+// Writes out everything logged so far; needs flush_mutex. A failed write is undone and
+// its commands are kept for the next attempt, except with appendfsync always, where a
+// client may already have been promised them and the server has to stop.
+static bool write_pending() {
+    uint64_t end;
+    {
+        std::lock_guard<std::mutex> lk(aof_mutex);
+        if (aof_buf.empty()) return true;
+        flushing.swap(aof_buf);
+        end = aof_appended.load(std::memory_order_relaxed);
+    }
+    if (!write_all(aof_fd, flushing.data(), flushing.size())) {
+        int err = errno;
+        if (aof_fsync == AofFsync::Always) {
+            std::cerr << "Can't recover from AOF write error when the AOF fsync policy is 'always': "
+                      << strerror(err) << ". Exiting..." << std::endl;
+            _exit(1);
+        }
+        std::cerr << "Error writing to the AOF file: " << strerror(err) << std::endl;
+        if (ftruncate(aof_fd, static_cast<off_t>(aof_stats.current_size.load())) != 0) {
+            std::cerr << "Could not remove the partial write from the AOF file" << std::endl;
+        }
+        aof_stats.last_write_ok.store(false, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lk(aof_mutex);
+        aof_buf.insert(0, flushing);
+        flushing.clear();
+        return false;
+    }
+    aof_stats.current_size.fetch_add(flushing.size(), std::memory_order_relaxed);
+    aof_stats.last_write_ok.store(true, std::memory_order_relaxed);
+    flushing.clear();
+    aof_written.store(end, std::memory_order_release);
+    return true;
+}
+
+void aof_flush() {
+    if (!aof_on.load(std::memory_order_acquire)) return;
+    std::atomic<uint64_t>& done = aof_fsync == AofFsync::Always ? aof_synced : aof_written;
+    uint64_t target = aof_appended.load(std::memory_order_acquire);
+    if (done.load(std::memory_order_acquire) >= target) return;
+
+    std::lock_guard<std::mutex> lk(flush_mutex);
+    // Whoever held the lock meanwhile has likely written this thread's commands as well.
+    if (done.load(std::memory_order_acquire) >= target) return;
+    if (!write_pending() || aof_fsync != AofFsync::Always) return;
+    uint64_t written = aof_written.load(std::memory_order_acquire);
+    if (fdatasync(aof_fd) != 0) {
+        std::cerr << "Can't recover from AOF fsync error when the AOF fsync policy is 'always': "
+                  << strerror(errno) << ". Exiting..." << std::endl;
+        _exit(1);
+    }
+    aof_stats.fsyncs.fetch_add(1, std::memory_order_relaxed);
+    aof_synced.store(written, std::memory_order_release);
+}
+
+// The commands that rebuild the dataset as it is; the caller keeps it from changing.
+static bool write_dataset(const std::string& filename) {
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open " << filename << " for the AOF rewrite: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::string out;
+    bool ok = true;
+    auto flush_if_full = [&]() {
+        if (out.size() < AOF_WRITE_CHUNK) return;
+        ok = ok && write_all(fd, out.data(), out.size());
+        out.clear();
+    };
+    TimePoint now = Clock::now();
+    uint64_t now_unix_ms = current_unix_time_ms();
+
+    for (const Shard& shard : shards) {
+        for (const DictEntry& entry : shard.keys) {
+            const RedisObject& value = entry.value;
+            std::string_view key = entry.key();
+            TimePoint expiry = get_expiry(shard, entry);
+            if (expiry != TimePoint::min() && now >= expiry) continue;
+
+            if (value.type == OBJ_STRING) {
+                IntBuffer buf;
+                if (expiry == TimePoint::min()) {
+                    std::string_view args[] = {"SET", key, value.string_value(buf)};
+                    append_command(out, args, 3);
+                } else {
+                    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(expiry - now).count();
+                    std::string at = std::to_string(now_unix_ms + static_cast<uint64_t>(left));
+                    std::string_view args[] = {"SET", key, value.string_value(buf), "PXAT", at};
+                    append_command(out, args, 5);
+                }
+            } else if (value.type == OBJ_LIST) {
+                size_t length = list_length(value);
+                for (size_t start = 0; start < length; start += AOF_REWRITE_ITEMS_PER_CMD) {
+                    size_t n = std::min(AOF_REWRITE_ITEMS_PER_CMD, length - start);
+                    append_multibulk_header(out, n + 2);
+                    append_bulk(out, "RPUSH");
+                    append_bulk(out, key);
+                    list_for_range(value, start, n, [&out](std::string_view element) { append_bulk(out, element); });
+                    flush_if_full();
+                }
+            } else if (value.type == OBJ_STREAM) {
+                const Stream& stream = value.stream();
+                char id[STREAM_ID_MAX_LEN];
+                if (stream.empty()) {
+                    // Adding an entry and trimming it away leaves an empty stream that
+                    // still remembers its last ID.
+                    std::string_view args[] = {"XADD", key, "MAXLEN", "0",
+                                               std::string_view(id, format_stream_id(stream.last_id(), id)), "", ""};
+                    append_command(out, args, 7);
+                }
+                for (StreamIterator it(stream, StreamID{}); it.valid(); it.next()) {
+                    append_multibulk_header(out, 3 + it.field_count() * 2);
+                    append_bulk(out, "XADD");
+                    append_bulk(out, key);
+                    append_bulk(out, std::string_view(id, format_stream_id(it.id(), id)));
+                    it.for_each_field([&out](std::string_view field, std::string_view value) {
+                        append_bulk(out, field);
+                        append_bulk(out, value);
+                    });
+                    flush_if_full();
+                }
+            }
+            flush_if_full();
+        }
+    }
+
+    ok = ok && write_all(fd, out.data(), out.size()) && fsync(fd) == 0;
+    if (close(fd) != 0) ok = false;
+    if (!ok) std::cerr << "Failed to write " << filename << ": " << strerror(errno) << std::endl;
+    return ok;
+}
+
+static uint64_t file_size(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+bool aof_open() {
+    if (access(aof_filename.c_str(), F_OK) != 0) {
+        std::string temp = aof_filename + ".tmp";
+        if (!write_dataset(temp) || rename(temp.c_str(), aof_filename.c_str()) != 0) {
+            std::cerr << "Failed to create the AOF file " << aof_filename << std::endl;
+            unlink(temp.c_str());
+            return false;
+        }
+        sync_parent_dir(aof_filename);
+    }
+    int fd = open(aof_filename.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to open the AOF file " << aof_filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    aof_fd = fd;
+    aof_stats.current_size.store(file_size(fd));
+    aof_stats.base_size.store(file_size(fd));
+    aof_on.store(true, std::memory_order_release);
+    return true;
+}
+
+// Runs one logged command, or queues it while a logged transaction is open.
+static bool replay_command(const CommandArgs& args, std::vector<std::vector<std::string>>& transaction,
+                           bool& in_transaction) {
+    if (equals_ignore_case(args[0], "multi")) {
+        in_transaction = true;
+        return true;
+    }
+    if (equals_ignore_case(args[0], "exec")) {
+        CommandArgs queued;
+        for (const auto& command : transaction) {
+            queued.clear();
+            for (const auto& arg : command) queued.push_back(arg);
+            lookup_command(queued[0])->handler(queued, -1);
+        }
+        transaction.clear();
+        in_transaction = false;
+        return true;
+    }
+    const RedisCommand* cmd = lookup_command(args[0]);
+    if (!cmd) {
+        std::cerr << "Unknown command '" << args[0] << "' in the AOF file" << std::endl;
+        return false;
+    }
+    if (in_transaction) {
+        transaction.emplace_back(args.begin(), args.end());
+    } else {
+        cmd->handler(args, -1);
+    }
+    return true;
+}
+
+// Reads the file in large chunks and hands each command straight to its handler, without
+// the per-client bookkeeping, statistics and timing that dispatch() adds for commands
+// from the network.
+bool aof_load(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to open the AOF file " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::vector<char> buf(AOF_READ_CHUNK);
+    size_t start = 0;                   // first byte of the command being parsed
+    size_t len = 0;
+    uint64_t buf_offset = 0;            // file offset of buf[0]
+    uint64_t complete_offset = 0;       // end of the last command that can be kept
+    RespParser parser;
+    CommandArgs args;
+    std::vector<std::vector<std::string>> transaction;
+    bool in_transaction = false;
+    bool eof = false;
+    bool ok = true;
+    size_t commands = 0;
+
+    aof_loading = true;
+    while (ok) {
+        ParseStatus st = start < len ? parser.parse(buf.data() + start, len - start) : ParseStatus::Incomplete;
+        if (st == ParseStatus::Complete) {
+            parser.fill_args(buf.data() + start, args);
+            start += parser.command_length();
+            parser.reset();
+            if (args.empty()) continue;
+            ok = replay_command(args, transaction, in_transaction);
+            ++commands;
+            if (!in_transaction) complete_offset = buf_offset + start;
+            continue;
+        }
+        if (st == ParseStatus::Error) {
+            std::cerr << "Bad file format reading the append only file at offset " << buf_offset + start << ": "
+                      << parser.error << std::endl;
+            ok = false;
+            break;
+        }
+        if (eof) break;
+
+        // The parser resumes where it stopped, with offsets relative to the command's
+        // start, so the partial command can move to the front of the buffer.
+        memmove(buf.data(), buf.data() + start, len - start);
+        buf_offset += start;
+        len -= start;
+        start = 0;
+        size_t want = std::max(AOF_READ_CHUNK, parser.pending_bulk_bytes(len));
+        if (buf.size() - len < want) buf.resize(len + want);
+        ssize_t n = read(fd, buf.data() + len, buf.size() - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            std::cerr << "Error reading the AOF file: " << strerror(errno) << std::endl;
+            ok = false;
+        } else if (n == 0) {
+            eof = true;
+        } else {
+            len += static_cast<size_t>(n);
+        }
+    }
+    aof_loading = false;
+
+    uint64_t size = buf_offset + len;
+    if (ok && complete_offset < size) {
+        std::cerr << "AOF ends with an incomplete " << (in_transaction ? "transaction" : "command")
+                  << "; truncating it from " << size << " to " << complete_offset << " bytes" << std::endl;
+        if (ftruncate(fd, static_cast<off_t>(complete_offset)) != 0) {
+            std::cerr << "Failed to truncate the AOF file: " << strerror(errno) << std::endl;
+            ok = false;
+        }
+    }
+    close(fd);
+    if (ok) std::cout << "AOF loaded: " << commands << " commands" << std::endl;
+    return ok;
+}
+
+static std::string rewrite_temp_name(pid_t pid) {
+    return aof_filename + ".rewrite-" + std::to_string(pid) + ".tmp";
+}
+
+// Holding every shard across fork() means no command is half logged: whatever the child's
+// snapshot holds was logged before rewrite_buf started taking commands, and everything
+// after goes to both aof_buf and rewrite_buf.
+BgsaveStatus aof_rewrite_background() {
+    if (aof_stats.rewrite_in_progress.exchange(true)) return BgsaveStatus::InProgress;
+
+    pid_t pid;
+    {
+        ShardLock lock(ALL_SHARDS, LockMode::Read);
+        {
+            std::lock_guard<std::mutex> lk(aof_mutex);
+            rewrite_buf.clear();
+            rewrite_buffering = aof_on.load();
+        }
+        pid = fork();
+        if (pid == 0) _exit(write_dataset(rewrite_temp_name(getpid())) ? 0 : 1);
+    }
+    if (pid < 0) {
+        std::cerr << "Can't rewrite append only file in background: fork: " << strerror(errno) << std::endl;
+        {
+            std::lock_guard<std::mutex> lk(aof_mutex);
+            rewrite_buffering = false;
+            rewrite_buf.clear();
+        }
+        aof_stats.last_rewrite_ok.store(false, std::memory_order_relaxed);
+        aof_stats.rewrite_in_progress.store(false);
+        return BgsaveStatus::ForkFailed;
+    }
+    std::lock_guard<std::mutex> lk(flush_mutex);
+    rewrite_child = pid;
+    return BgsaveStatus::Started;
+}
+
+// Appends what was logged during the rewrite to the child's file and puts it in place of
+// the old one. Logging stops meanwhile, so this takes as long as writing rewrite_buf.
+static bool install_rewrite(const std::string& temp) {
+    std::lock_guard<std::mutex> flush_lock(flush_mutex);
+    std::lock_guard<std::mutex> lk(aof_mutex);
+    int fd = open(temp.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    bool ok = fd >= 0 && write_all(fd, rewrite_buf.data(), rewrite_buf.size()) && fsync(fd) == 0 &&
+              rename(temp.c_str(), aof_filename.c_str()) == 0;
+    rewrite_buffering = false;
+    std::string().swap(rewrite_buf);
+    if (!ok) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    // The new file holds every command logged so far, the unwritten ones included.
+    if (aof_on.load()) {
+        if (aof_fd >= 0) close(aof_fd);
+        aof_fd = fd;
+        aof_buf.clear();
+        uint64_t appended = aof_appended.load();
+        aof_written.store(appended);
+        aof_synced.store(appended);
+    } else {
+        close(fd);
+    }
+    return true;
+}
+
+static void reap_rewrite_child() {
+    pid_t pid;
+    {
+        std::lock_guard<std::mutex> lk(flush_mutex);
+        pid = rewrite_child;
+    }
+    if (pid <= 0) return;
+    int status = 0;
+    if (waitpid(pid, &status, WNOHANG) != pid) return;
+
+    std::string temp = rewrite_temp_name(pid);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && install_rewrite(temp);
+    if (ok) {
+        // Outside the locks: logging has moved to the new file already.
+        sync_parent_dir(aof_filename);
+        std::cout << "Background AOF rewrite finished successfully" << std::endl;
+        struct stat st;
+        uint64_t size = stat(aof_filename.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+        aof_stats.current_size.store(size);
+        aof_stats.base_size.store(size);
+    } else {
+        std::cerr << "Background AOF rewrite failed" << std::endl;
+        unlink(temp.c_str());
+        std::lock_guard<std::mutex> lk(aof_mutex);
+        rewrite_buffering = false;
+        std::string().swap(rewrite_buf);
+    }
+    {
+        std::lock_guard<std::mutex> lk(flush_mutex);
+        rewrite_child = -1;
+    }
+    aof_stats.last_rewrite_ok.store(ok, std::memory_order_relaxed);
+    aof_stats.rewrite_in_progress.store(false);
+}
+
+// Only this thread replaces the file descriptor, so it can sync it without holding
+// flush_mutex and without stalling the threads that write to it.
+static void sync_written() {
+    int fd;
+    uint64_t written;
+    {
+        std::lock_guard<std::mutex> lk(flush_mutex);
+        fd = aof_fd;
+        written = aof_written.load();
+    }
+    if (fd < 0 || aof_synced.load() >= written) return;
+    if (fdatasync(fd) != 0) {
+        std::cerr << "AOF fsync failed: " << strerror(errno) << std::endl;
+        return;
+    }
+    aof_stats.fsyncs.fetch_add(1, std::memory_order_relaxed);
+    uint64_t synced = aof_synced.load();
+    while (synced < written && !aof_synced.compare_exchange_weak(synced, written)) {
+    }
+}
+
+void aof_cron() {
+    auto last_sync = Clock::now();
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        reap_rewrite_child();
+        if (!aof_on.load(std::memory_order_acquire)) continue;
+
+        // Commands no reply waits on, such as the DELs of expired keys, are written here.
+        aof_flush();
+        if (aof_fsync == AofFsync::Everysec && Clock::now() - last_sync >= std::chrono::seconds(1)) {
+            sync_written();
+            last_sync = Clock::now();
+        }
+
+        uint64_t size = aof_stats.current_size.load();
+        uint64_t base = aof_stats.base_size.load();
+        if (aof_rewrite_percentage > 0 && !aof_stats.rewrite_in_progress.load() && size >= aof_rewrite_min_size &&
+            size > base + base * static_cast<uint64_t>(aof_rewrite_percentage) / 100) {
+            std::cout << "Starting automatic rewriting of AOF on " << (base ? (size - base) * 100 / base : 0)
+                      << "% growth" << std::endl;
+            aof_rewrite_background();
+        }
+    }
+}
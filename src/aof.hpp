@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include "rdb.hpp"
+
+// Append-only file: every change to the dataset is logged as the command that makes it,
+// in RESP, and replaying the file at startup rebuilds the dataset. Commands are logged in
+// their deterministic form (XADD with the ID it chose, SET with an absolute expiry time,
+// the pops that served BLPOP clients, DEL for keys that expired), so replaying them gives
+// the same result at any later time.
+
+enum class AofFsync { Always, Everysec, No };
+
+extern bool aof_enabled;
+extern std::string aof_filename;
+extern AofFsync aof_fsync;
+// The file is rewritten in the background once it has grown by this percentage since the
+// last rewrite and is at least aof_rewrite_min_size bytes; 0 disables automatic rewrites.
+extern int aof_rewrite_percentage;
+extern size_t aof_rewrite_min_size;
+// Set while the file is replayed, when keys must not expire: a command in the log ran
+// before the key expired, however late it is replayed.
+extern bool aof_loading;
+
+// Reported by INFO persistence.
+struct AofStats {
+    std::atomic<bool> rewrite_in_progress{false};
+    std::atomic<bool> last_rewrite_ok{true};
+    std::atomic<bool> last_write_ok{true};
+    std::atomic<uint64_t> current_size{0};
+    std::atomic<uint64_t> base_size{0};             // size right after the last rewrite
+    std::atomic<uint64_t> fsyncs{0};
+};
+
+extern AofStats aof_stats;
+
+// Replays the file into the empty dataset, before any client connects. A command cut off
+// at the end of the file, as left by a crash in the middle of a write, is dropped and the
+// file is truncated to the last complete command. Returns false if the file cannot be
+// read or holds anything but commands.
+bool aof_load(const std::string& filename);
+// Starts logging to aof_filename, first writing the dataset to it if it does not exist.
+bool aof_open();
+
+// Logs a command. Callers hold the write locks of the keys it changes, so the commands on
+// a key reach the log in the order they ran.
+void aof_append(const std::string_view* args, size_t count);
+void aof_append(std::initializer_list<std::string_view> args);
+// Between these, the calling thread's commands are collected and then logged together
+// inside MULTI/EXEC, so a replay applies a transaction whole or not at all.
+void aof_begin_transaction();
+void aof_end_transaction();
+
+// Writes the commands logged so far to the file, and with appendfsync always also syncs
+// them. Called before any reply leaves the server, so a client never sees the reply to a
+// command the log could still lose. All commands logged by every thread since the last
+// flush go out in one write and one fdatasync, whichever thread gets there first.
+void aof_flush();
+
+// Forks a child that writes the dataset as the shortest list of commands that rebuilds
+// it; the commands logged meanwhile are kept aside and appended once it is done, and the
+// result replaces the file.
+BgsaveStatus aof_rewrite_background();
+
+// Runs forever on its own thread: writes out the log when nothing else has, syncs it once
+// a second with appendfsync everysec, finishes background rewrites and starts automatic
+// ones.
+void aof_cron();
@@ -22,7 +22,7 @@ private:
     
 public:
     RedisClient(const std::string& host = "127.0.0.1", int port = 6379) 
-        : host(host), port(port), connected(false), sockfd(-1) {}
+        : sockfd(-1), host(host), port(port), connected(false) {}
     
     ~RedisClient() {
         disconnect();
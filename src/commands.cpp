@@ -1,136 +1,148 @@
 #include "commands.hpp"
+#include "aof.hpp"
 #include "parser.hpp"
 #include "storage.hpp"
 #include "StreamHandler.hpp"
 
 #include <algorithm>
+#include <climits>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <iostream>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <unordered_set>
 
-static bool is_expired(const ValueWithExpiry& v) {
-    return v.expiry != TimePoint::min() && Clock::now() >= v.expiry;
-}
+static std::string call_command(const RedisCommand& cmd, const CommandArgs& args, int client_fd);
+static ShardMask command_shard_mask(const RedisCommand& cmd, const CommandArgs& args);
 
-bool send_response(int fd, const std::string& response) {
-    ssize_t n = send(fd, response.c_str(), response.size(), 0);
-    return n == static_cast<ssize_t>(response.size());
-}
+static const char* const WRONGTYPE_ERR = "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
 
-std::string handle_set(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() < 3) return "-ERR Invalid SET Command\r\n";
-    if (to_lower(parts[0]) != "set") return "-ERR Invalid SET Command\r\n";
+// Set by dispatch() while it runs a CMD_BLOCKING command for a client, the only time the
+// client can be parked. Anywhere else, such as in EXEC or an AOF replay, a blocking
+// command with nothing to serve replies as if it had timed out at once, as in Redis.
+static thread_local bool may_block = false;
 
-    std::string key = parts[1];
-    std::string value = parts[2];
-    TimePoint expiry = TimePoint::min();
+std::string handle_set(const CommandArgs& args, int) {
+    if (args.size() < 3) return "-ERR Invalid SET Command\r\n";
 
-    if (parts.size() == 5) {
-        if (to_lower(parts[3]) != "px") return "-ERR Syntax error\r\n";
-        try {
-            int ms = std::stoi(parts[4]);
-            expiry = Clock::now() + std::chrono::milliseconds(ms);
-        } catch (...) {
-            return "-ERR Invalid PX value\r\n";
+    std::string_view key = args[1];
+    TimePoint expiry = TimePoint::min();
+    uint64_t expire_at_ms = 0;      // the expiry as a Unix time, which is how it is logged
+
+    if (args.size() == 5) {
+        bool absolute = equals_ignore_case(args[3], "pxat");
+        if (!absolute && !equals_ignore_case(args[3], "px")) return "-ERR Syntax error\r\n";
+        long long ms = 0;
+        if (!parse_int64(args[4], ms)) return absolute ? "-ERR Invalid PXAT value\r\n" : "-ERR Invalid PX value\r\n";
+        // A PXAT in the past is accepted and leaves the key already expired
+        long long now_ms = static_cast<long long>(current_unix_time_ms());
+        long long left = absolute ? ms - now_ms : ms;
+        if (ms <= 0 || !expiry_after(Clock::now(), left, expiry)) {
+            return "-ERR invalid expire time in 'set' command\r\n";
         }
-    } else if (parts.size() != 3) {
+        expire_at_ms = static_cast<uint64_t>(now_ms + left);
+    } else if (args.size() != 3) {
         return "-ERR Syntax error\r\n";
     }
 
     {
-        std::lock_guard<std::mutex> lock(storage_mutex);
-        redis_storage[key] = { value, expiry };
+        Shard& shard = shard_for(key);
+        ShardLock lock(shard, LockMode::Write);
+        RedisObject* obj = lookup_key_write(shard, key);
+        if (obj && obj->type == OBJ_STRING) {
+            obj->set_string(args[2]);
+            if (obj->expires) remove_expiry(shard, key);
+        } else {
+            set_key(shard, key, create_string_object(args[2]));
+        }
+        if (expiry != TimePoint::min()) {
+            set_expiry(shard, key, expiry);
+            std::string at = std::to_string(expire_at_ms);
+            aof_append({"SET", key, args[2], "PXAT", at});
+        } else {
+            aof_append({"SET", key, args[2]});
+        }
     }
     return "+OK\r\n";
 }
 
-std::string handle_get(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 2) return "-ERR Invalid GET command\r\n";
-    if (to_lower(parts[0]) != "get") return "-ERR Invalid GET command\r\n";
+std::string handle_get(const CommandArgs& args, int) {
+    if (args.size() != 2) return "-ERR Invalid GET command\r\n";
 
-    std::string key = parts[1];
-    ValueWithExpiry v;
+    std::string_view key = args[1];
+    Shard& shard = shard_for(key);
 
-    {
-        std::lock_guard<std::mutex> lock(storage_mutex);
-        auto it = redis_storage.find(key);
-        if (it == redis_storage.end()) return "$-1\r\n";
-        v = it->second;
-        if (is_expired(v)) {
-            redis_storage.erase(key);
-            return "$-1\r\n";
-        }
-    }
-
-    return "$" + std::to_string(v.value.size()) + "\r\n" + v.value + "\r\n";
+    ShardLock lock(shard, LockMode::Read);
+    RedisObject* obj = lookup_key_read(shard, key);
+    if (!obj) return "$-1\r\n";
+    if (obj->type != OBJ_STRING) return WRONGTYPE_ERR;
+    IntBuffer buf;
+    return resp_bulk_string(obj->string_value(buf));
 }
 
-std::string handle_INCR(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 2) return "-ERR wrong number of arguments for 'incr' command\r\n";
-    if (to_lower(parts[0]) != "incr") return "-ERR Invalid INCR Command\r\n";
+std::string handle_INCR(const CommandArgs& args, int) {
+    if (args.size() != 2) return "-ERR wrong number of arguments for 'incr' command\r\n";
 
-    std::string key = parts[1];
-    int64_t value = 0;
-    bool key_exists = false;
+    std::string_view key = args[1];
+    long long value = 0;
 
     {
-        std::lock_guard<std::mutex> lock(storage_mutex);
-        auto it = redis_storage.find(key);
+        Shard& shard = shard_for(key);
+        ShardLock lock(shard, LockMode::Write);
+        RedisObject* obj = lookup_key_write(shard, key);
         
-        if (it != redis_storage.end()) {
-            key_exists = true;
-            
-            const std::string& str_val = it->second.value;
-            try {
-                value = std::stoll(str_val);
-            } catch (...) {
+        if (obj) {
+            if (obj->type != OBJ_STRING) return WRONGTYPE_ERR;
+            if (!obj->get_int(value) || value == LLONG_MAX) {
                 return "-ERR value is not an integer or out of range\r\n";
             }
         }
         
         value++;
         
-        redis_storage[key] = {std::to_string(value), TimePoint::min()};
+        if (obj) {
+            obj->set_int(value);
+        } else {
+            set_key(shard, key, create_int_object(value));
+        }
+        aof_append(args.data(), args.size());
     }
 
     return ":" + std::to_string(value) + "\r\n";
 }
 
-std::string handle_MULTI(const char* resp, int client_fd) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 1) return "-ERR wrong number of arguments for 'multi' command\r\n";
-    if (to_lower(parts[0]) != "multi") return "-ERR Invalid MULTI Command\r\n";
-
-    {
-        std::lock_guard<std::mutex> lock(transaction_mutex);
-        client_transactions[client_fd] = {true, {}};
+std::string handle_DEL(const CommandArgs& args, int) {
+    if (args.size() < 2) return "-ERR wrong number of arguments for 'del' command\r\n";
+
+    ShardMask mask = 0;
+    for (size_t i = 1; i < args.size(); ++i) mask |= shard_bit(args[i]);
+    ShardLock lock(mask, LockMode::Write);
+    std::vector<std::string_view> deleted = {"DEL"};
+    for (size_t i = 1; i < args.size(); ++i) {
+        std::string_view key = args[i];
+        Shard& shard = shard_for(key);
+        if (lookup_key_write(shard, key) && delete_key(shard, key)) deleted.push_back(args[i]);
     }
-
-    return "+OK\r\n";
+    if (deleted.size() > 1) aof_append(deleted.data(), deleted.size());
+    return ":" + std::to_string(deleted.size() - 1) + "\r\n";
 }
 
-std::string handle_EXEC(const char* resp, int client_fd) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 1) return "-ERR wrong number of arguments for 'exec' command\r\n";
-    if (to_lower(parts[0]) != "exec") return "-ERR Invalid EXEC Command\r\n";
+std::string handle_MULTI(const CommandArgs& args, int client_fd) {
+    if (args.size() != 1) return "-ERR wrong number of arguments for 'multi' command\r\n";
 
-    TransactionState transaction;
-    bool has_transaction = false;
+    client_transaction(client_fd).in_transaction = true;
+    return "+OK\r\n";
+}
 
-    {
-        std::lock_guard<std::mutex> lock(transaction_mutex);
-        auto it = client_transactions.find(client_fd);
-        if (it != client_transactions.end()) {
-            transaction = it->second;
-            has_transaction = true;
-            client_transactions.erase(it); 
-        }
-    }
+std::string handle_EXEC(const CommandArgs& args, int client_fd) {
+    if (args.size() != 1) return "-ERR wrong number of arguments for 'exec' command\r\n";
 
-    if (!has_transaction) {
+    TransactionState& state = client_transaction(client_fd);
+    TransactionState transaction = std::move(state);
+    state = {};
+    if (!transaction.in_transaction) {
         return "-ERR EXEC without MULTI\r\n";
     }
 
@@ -138,50 +150,26 @@ std::string handle_EXEC(const char* resp, int client_fd) {
         return "*0\r\n";
     }
 
+    std::vector<CommandArgs> queued_args(transaction.queued_commands.size());
+    std::vector<const RedisCommand*> queued_cmds;
+    ShardMask mask = 0;
+    for (size_t i = 0; i < transaction.queued_commands.size(); ++i) {
+        for (const auto& arg : transaction.queued_commands[i]) queued_args[i].push_back(arg);
+        const RedisCommand* cmd = lookup_command(queued_args[i][0]);
+        if (!cmd) return "-ERR Protocol error\r\n";
+        queued_cmds.push_back(cmd);
+        mask |= command_shard_mask(*cmd, queued_args[i]);
+    }
+
+    // Every shard the transaction touches is write-locked up front, in shard order, so
+    // the queued commands run atomically with respect to other clients.
+    ShardLock lock(mask, LockMode::Write);
     std::vector<std::string> responses;
-    for (const auto& cmd : transaction.queued_commands) {
-        std::string response;
-        auto parts = parse_resp_array(cmd.c_str());
-        if (parts.empty()) return "-ERR Protocol error\r\n";
-        std::string op = to_lower(parts[0]);
-
-        if (op == "ping") {
-            response =  "+PONG\r\n";
-        } else if (op == "echo") {
-            if (parts.size() != 2) return "-ERR wrong number of arguments for 'echo'\r\n";
-            const auto& message = parts[1];
-            response = "$" + std::to_string(message.size()) + "\r\n" + message + "\r\n";
-        } else if (op == "set") {
-            response = handle_set(cmd.c_str());
-        } else if (op == "get") {
-            response = handle_get(cmd.c_str());
-        } else if (op == "incr") {
-            response = handle_INCR(cmd.c_str());
-        } else if (op == "rpush") {
-            response = handle_RPUSH(cmd.c_str());
-        } else if (op == "lpush") {
-            response = handle_LPUSH(cmd.c_str());
-        } else if (op == "lpop") {
-            response = handle_LPOP(cmd.c_str());
-        } else if (op == "lrange") {
-            response = handle_LRANGE(cmd.c_str());
-        } else if (op == "llen") {
-            response = handle_LLEN(cmd.c_str());
-        } else if (op == "blpop") {
-            response = handle_BLPOP(cmd.c_str(), client_fd); 
-        } else if (op == "type") {
-            response = handle_TYPE(cmd.c_str());
-        } else if (op == "xadd") {
-            response = handle_XADD(cmd.c_str());
-        } else if(op == "xrange") {
-            response = handle_XRANGE(cmd.c_str());
-        } else if(op == "xread") {
-            response = handle_XREAD(cmd.c_str(), client_fd); 
-        } else {
-            response = "-ERR Invalid Unknown Command\r\n";
-        }
-        responses.push_back(response);
+    aof_begin_transaction();
+    for (size_t i = 0; i < queued_cmds.size(); ++i) {
+        responses.push_back(call_command(*queued_cmds[i], queued_args[i], client_fd));
     }
+    aof_end_transaction();
 
     std::string result = "*" + std::to_string(responses.size()) + "\r\n";
     for (const auto& response : responses) {
@@ -191,142 +179,204 @@ std::string handle_EXEC(const char* resp, int client_fd) {
     return result;
 }
 
-std::string handle_LPUSH(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() < 3) return "-ERR Invalid LPUSH Command\r\n";
-    if (to_lower(parts[0]) != "lpush") return "-ERR Invalid LPUSH Command\r\n";
-    const std::string listName = parts[1];
-
-    std::lock_guard<std::mutex> lk(storage_mutex);
-    auto& lst = lists[listName];
-    for (size_t i = 2; i < parts.size(); ++i) {
-        lst.insert(lst.begin(), parts[i]);
-    }
-    return ":" + std::to_string(lst.size()) + "\r\n";
+static std::string pop_reply(std::string_view key, std::string_view element) {
+    std::string resp = "*2\r\n";
+    resp += resp_bulk_string(key);
+    resp += resp_bulk_string(element);
+    return resp;
 }
 
-std::string handle_RPUSH(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() < 3) return "-ERR Invalid RPUSH Command\r\n";
-    if (to_lower(parts[0]) != "rpush") return "-ERR Invalid RPUSH Command\r\n";
-    const std::string listName = parts[1];
-
-    std::unique_lock<std::mutex> lock(storage_mutex);
-    auto& lst = lists[listName];
-
-    
-    for (size_t i = 2; i < parts.size(); ++i) {
-        lst.push_back(parts[i]);
-    }
+// One stream's part of an XREAD reply: its key and the entries with IDs above after, or
+// an empty string when there are none.
+static std::string xread_stream_reply(const std::string& key, const Stream& stream, StreamID after) {
+    if (stream.last_id() <= after) return "";
+    StreamIterator it(stream, after);
+    if (it.valid() && it.id() == after) it.next();
+    std::string entries;
+    size_t count = 0;
+    for (; it.valid(); it.next(), ++count) append_stream_entry(entries, it);
+    if (count == 0) return "";
+    return "*2\r\n" + resp_bulk_string(key) + "*" + std::to_string(count) + "\r\n" + entries;
+}
 
-    int size_before_unblock = static_cast<int>(lst.size());
+// Keys pushed to while clients were blocked on them, collected by the reactor thread that
+// ran the push. A producer only notes the key; the waiters are served once the reactor is
+// done with the events of this loop iteration, so the producer's reply costs the same
+// however many consumers wait on the key and however slow their connections are.
+static thread_local std::vector<std::string> ready_keys;
+static thread_local std::unordered_set<std::string> ready_key_set;
 
-    lock.unlock();
+// Needs blocked_mutex, under which the caller found clients waiting on key.
+static void signal_key_as_ready(const std::string& key) {
+    if (ready_key_set.insert(key).second) ready_keys.push_back(key);
+}
 
-    while (true) {
-        int client_fd = -1;
-        {
-            std::scoped_lock lk(storage_mutex, blocked_mutex);
-            auto it = blocked_clients.find(listName);
-            if (it == blocked_clients.end() || it->second.empty()) break;
-            client_fd = it->second.front();
-            it->second.pop();
+// Hands elements of the list at key to the clients blocked on it, longest waiting first,
+// in one pass. Each reply is handed over in the same critical section that unblocks its
+// client, so the client's reactor cannot resume it before the reply has reached its
+// mailbox.
+static void serve_list_waiters(Shard& shard, const std::string& key, RedisObject& list) {
+    std::lock_guard<std::mutex> lk(blocked_mutex);
+    while (list_length(list) > 0) {
+        BlockedClient* waiter = first_list_waiter(key);
+        if (!waiter) break;
+        int fd = waiter->fd;
+        uint64_t id = waiter->connection_id;
+        ListEnd where = waiter->where;
+        std::string element = list_pop(list, where);
+        // Logged before the reply is handed over: the client's reactor may send it at once.
+        aof_append({where == ListEnd::Head ? "LPOP" : "RPOP", key});
+        if (!send_response(fd, id, pop_reply(key, element))) {
+            // The client went away after being picked; put the element back.
+            list_push(list, element, where);
+            aof_append({where == ListEnd::Head ? "LPUSH" : "RPUSH", key, element});
         }
+        unblock_client(fd);
+    }
+    if (list_length(list) == 0) delete_key(shard, key);
+}
 
-        std::string popped;
-        {
-            std::lock_guard<std::mutex> lock(storage_mutex);
-            auto itList = lists.find(listName);
-            if (itList == lists.end() || itList->second.empty()) break;
-            popped = itList->second.front();
-            itList->second.erase(itList->second.begin());
+// Sends every XREAD client blocked on key the entries past the ID it has read up to.
+// Those are the clients at the front of the stream's waiter index, up to the first that
+// has read the newest entry; clients that have read up to the same ID get the same reply.
+static void serve_stream_waiters(const std::string& key, const Stream& stream) {
+    if (stream.empty()) return;
+    StreamID newest = stream.last_id();
+
+    std::lock_guard<std::mutex> lk(blocked_mutex);
+    auto it = stream_waiters.find(key);
+    if (it == stream_waiters.end()) return;
+    std::vector<int> served;
+    std::string reply;
+    const StreamID* reply_after = nullptr;
+    for (auto w = it->second.begin(); w != it->second.end() && w->first < newest; ++w) {
+        if (!reply_after || *reply_after != w->first) {
+            reply = "*1\r\n" + xread_stream_reply(key, stream, w->first);
+            reply_after = &w->first;
         }
+        send_response(w->second->fd, w->second->connection_id, reply);
+        served.push_back(w->second->fd);
+    }
+    // Leaving the index only once the scan is done keeps the iterator valid; a client
+    // reading several streams leaves the others' indexes as well.
+    for (int fd : served) unblock_client(fd);
+}
 
-        std::string response = "*2\r\n";
-        response += "$" + std::to_string(listName.size()) + "\r\n" + listName + "\r\n";
-        response += "$" + std::to_string(popped.size()) + "\r\n" + popped + "\r\n";
-
-        ssize_t sent = send(client_fd, response.c_str(), response.size(), 0);
-        if (sent != static_cast<ssize_t>(response.size())) {
-            std::cerr << "Failed to send unblock response to client fd " << client_fd << "\n";
-            close(client_fd);
-            remove_blocked_client_fd(client_fd);
-            continue;
-        }
+bool has_ready_keys() {
+    return !ready_keys.empty();
+}
 
-        {
-            std::scoped_lock lk(blocked_mutex, storage_mutex);
-            client_blocked_on_list.erase(client_fd);
-            blocked_fds.erase(client_fd);
+void handle_clients_blocked_on_keys() {
+    if (ready_keys.empty()) return;
+    std::vector<std::string> keys;
+    keys.swap(ready_keys);
+    ready_key_set.clear();
+    for (const std::string& key : keys) {
+        Shard& shard = shard_for(key);
+        ShardLock lock(shard, LockMode::Write);
+        RedisObject* obj = lookup_key_write(shard, key);
+        if (!obj) continue;
+        if (obj->type == OBJ_LIST) {
+            serve_list_waiters(shard, key, *obj);
+        } else if (obj->type == OBJ_STREAM) {
+            serve_stream_waiters(key, obj->stream());
         }
     }
+}
+
+static std::string push_command(const CommandArgs& args, ListEnd where) {
+    std::string_view key = args[1];
 
-    return ":" + std::to_string(size_before_unblock) + "\r\n";
+    Shard& shard = shard_for(key);
+    ShardLock lock(shard, LockMode::Write);
+    RedisObject* obj = lookup_key_write(shard, key);
+    if (obj && obj->type != OBJ_LIST) return WRONGTYPE_ERR;
+    if (!obj) obj = &set_key(shard, key, create_list_object());
+    for (size_t i = 2; i < args.size(); ++i) {
+        list_push(*obj, args[i], where);
+    }
+    aof_append(args.data(), args.size());
+    {
+        // The key is only copied, for the lookup, when some client waits at all
+        std::lock_guard<std::mutex> lk(blocked_mutex);
+        if (!list_waiters.empty() && list_waiters.count(std::string(key))) signal_key_as_ready(std::string(key));
+    }
+    return ":" + std::to_string(list_length(*obj)) + "\r\n";
 }
 
+std::string handle_LPUSH(const CommandArgs& args, int) {
+    if (args.size() < 3) return "-ERR Invalid LPUSH Command\r\n";
+    return push_command(args, ListEnd::Head);
+}
 
-std::string handle_LPOP(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() < 2) return "-ERR Invalid LPOP Command\r\n";
-    if (to_lower(parts[0]) != "lpop") return "-ERR Invalid LPOP Command\r\n";
+std::string handle_RPUSH(const CommandArgs& args, int) {
+    if (args.size() < 3) return "-ERR Invalid RPUSH Command\r\n";
+    return push_command(args, ListEnd::Tail);
+}
 
-    const std::string& key = parts[1];
-    bool hasCount = parts.size() == 3;
+// LPOP and RPOP.
+static std::string pop_command(const CommandArgs& args, ListEnd where) {
+    std::string_view key = args[1];
+    bool hasCount = args.size() == 3;
     int count = 1;
 
-    std::lock_guard<std::mutex> lk(storage_mutex);
-    auto it = lists.find(key);
-    if (it == lists.end() || it->second.empty()) {
-        return hasCount ? "*0\r\n" : "$-1\r\n";
-    }
+    Shard& shard = shard_for(key);
+    ShardLock lk(shard, LockMode::Write);
+    RedisObject* obj = lookup_key_write(shard, key);
+    if (!obj) return hasCount ? "*0\r\n" : "$-1\r\n";
+    if (obj->type != OBJ_LIST) return WRONGTYPE_ERR;
 
+    std::string res;
     if (hasCount) {
-        try {
-            count = std::stoi(parts[2]);
-            if (count < 0) return "-ERR value is not an integer or out of range\r\n";
-        } catch (...) {
-            return "-ERR Invalid Argument\r\n";
-        }
-        int n = static_cast<int>(it->second.size());
+        long long requested = 0;
+        if (!parse_int64(args[2], requested)) return "-ERR Invalid Argument\r\n";
+        if (requested < 0) return "-ERR value is not an integer or out of range\r\n";
+        count = static_cast<int>(std::min<long long>(requested, INT32_MAX));
+        int n = static_cast<int>(list_length(*obj));
         if (count > n) count = n;
 
-        std::string res = "*" + std::to_string(count) + "\r\n";
+        res = "*" + std::to_string(count) + "\r\n";
+        if (count > 0) aof_append(args.data(), args.size());
         while (count--) {
-            std::string elem = it->second.front();
-            it->second.erase(it->second.begin());
+            std::string elem = list_pop(*obj, where);
             res += "$" + std::to_string(elem.size()) + "\r\n" + elem + "\r\n";
         }
-        return res;
     } else {
-        std::string elem = it->second.front();
-        it->second.erase(it->second.begin());
-        return "$" + std::to_string(elem.size()) + "\r\n" + elem + "\r\n";
+        std::string elem = list_pop(*obj, where);
+        res = "$" + std::to_string(elem.size()) + "\r\n" + elem + "\r\n";
+        aof_append(args.data(), args.size());
     }
+    if (list_length(*obj) == 0) delete_key(shard, key);
+    return res;
 }
 
-std::string handle_LRANGE(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 4) return "-ERR Invalid LRANGE Command\r\n";
-    if (to_lower(parts[0]) != "lrange") return "-ERR Invalid LRANGE Command\r\n";
+std::string handle_LPOP(const CommandArgs& args, int) {
+    if (args.size() < 2 || args.size() > 3) return "-ERR Invalid LPOP Command\r\n";
+    return pop_command(args, ListEnd::Head);
+}
 
-    const std::string &listName = parts[1];
+std::string handle_RPOP(const CommandArgs& args, int) {
+    if (args.size() < 2 || args.size() > 3) return "-ERR Invalid RPOP Command\r\n";
+    return pop_command(args, ListEnd::Tail);
+}
 
-    std::vector<std::string> snapshot;
-    {
-        std::lock_guard<std::mutex> lk(storage_mutex);
-        auto it = lists.find(listName);
-        if (it == lists.end()) return "*0\r\n";
-        snapshot = it->second;
-    }
-    int n = static_cast<int>(snapshot.size());
-    int start, end;
-    try {
-        start = std::stoi(parts[2]);
-        end   = std::stoi(parts[3]);
-    } catch (...) {
+std::string handle_LRANGE(const CommandArgs& args, int) {
+    if (args.size() != 4) return "-ERR Invalid LRANGE Command\r\n";
+
+    std::string_view listName = args[1];
+    long long start, end;
+    if (!parse_int64(args[2], start) || !parse_int64(args[3], end)) {
         return "-ERR Invalid LRANGE indices\r\n";
     }
 
+    // Only the requested range is read, under the read lock, straight into the reply.
+    Shard& shard = shard_for(listName);
+    ShardLock lk(shard, LockMode::Read);
+    RedisObject* obj = lookup_key_read(shard, listName);
+    if (!obj) return "*0\r\n";
+    if (obj->type != OBJ_LIST) return WRONGTYPE_ERR;
+
+    long long n = static_cast<long long>(list_length(*obj));
     if (start < 0) start = n + start;
     if (end   < 0) end   = n + end;
     if (start < 0) start = 0;
@@ -334,464 +384,689 @@ std::string handle_LRANGE(const char* resp) {
     if (start > end || start >= n) return "*0\r\n";
 
     std::string res = "*" + std::to_string(end - start + 1) + "\r\n";
-    for (int i = start; i <= end; i++) {
-        const std::string& e = snapshot[i];
-        res += "$" + std::to_string(e.size()) + "\r\n" + e + "\r\n";
-    }
+    list_for_range(*obj, static_cast<size_t>(start), static_cast<size_t>(end - start + 1), [&res](std::string_view e) {
+        res += "$" + std::to_string(e.size()) + "\r\n";
+        res += e;
+        res += "\r\n";
+    });
     return res;
 }
 
 
-std::string handle_LLEN(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 2) return "-ERR Invalid LLEN Command\r\n";
-    if (to_lower(parts[0]) != "llen") return "-ERR Invalid LLEN Command\r\n";
+std::string handle_LLEN(const CommandArgs& args, int) {
+    if (args.size() != 2) return "-ERR Invalid LLEN Command\r\n";
 
-    std::lock_guard<std::mutex> lk(storage_mutex);
-    auto it = lists.find(parts[1]);
-    if (it == lists.end()) return ":0\r\n";
-    return ":" + std::to_string(it->second.size()) + "\r\n";
+    std::string_view key = args[1];
+    Shard& shard = shard_for(key);
+    ShardLock lk(shard, LockMode::Read);
+    RedisObject* obj = lookup_key_read(shard, key);
+    if (!obj) return ":0\r\n";
+    if (obj->type != OBJ_LIST) return WRONGTYPE_ERR;
+    return ":" + std::to_string(list_length(*obj)) + "\r\n";
 }
 
 
-std::string handle_BLPOP(const char* resp, int client_fd) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 3) return "-ERR Invalid BLPOP Arguments\r\n";
-    if (to_lower(parts[0]) != "blpop") return "-ERR Invalid BLPOP Command\r\n";
-
-    const std::string list_name = parts[1];
+// The deadline of a blocking command told to wait timeout_ms, 0 meaning forever. Returns
+// false if it lies past what the clock can represent.
+static bool block_deadline(long long timeout_ms, TimePoint& deadline) {
+    if (timeout_ms == 0) {
+        deadline = TimePoint::max();
+        return true;
+    }
+    return expiry_after(Clock::now(), timeout_ms, deadline);
+}
 
+// BLPOP and BRPOP: pops from the first of the keys that holds a list, or blocks on all of
+// them until one gets an element or the timeout passes.
+static std::string blocking_pop(const CommandArgs& args, int client_fd, ListEnd where) {
     double timeout_seconds = 0.0;
-    try {
-        timeout_seconds = std::stod(parts[2]);
-    } catch (...) {
-        return "-ERR Invalid Timeout Argument\r\n";
+    if (!parse_double(args.back(), timeout_seconds) || std::isnan(timeout_seconds) || timeout_seconds < 0.0) {
+        return "-ERR timeout is not a float or out of range\r\n";
     }
-    if (timeout_seconds < 0.0) return "-ERR Invalid Timeout Argument\r\n";
-
-    {
-        std::lock_guard<std::mutex> lk(storage_mutex);
-        auto it = lists.find(list_name);
-        if (it != lists.end() && !it->second.empty()) {
-            
-            std::string popped = it->second.front();
-            it->second.erase(it->second.begin());
-            std::string resp = "*2\r\n";
-            resp += "$" + std::to_string(list_name.size()) + "\r\n" + list_name + "\r\n";
-            resp += "$" + std::to_string(popped.size()) + "\r\n" + popped + "\r\n";
-            return resp;
-        }
+    // Whole milliseconds, rounded up as in Redis so that a tiny timeout does not mean forever
+    double timeout_ms = std::ceil(timeout_seconds * 1000.0);
+    TimePoint deadline;
+    if (!(timeout_ms < static_cast<double>(LLONG_MAX)) || !block_deadline(static_cast<long long>(timeout_ms), deadline)) {
+        return "-ERR timeout is out of range\r\n";
     }
-
-    
-    if (timeout_seconds == 0.0) {
-        
-        std::lock_guard<std::mutex> lk(blocked_mutex);
-        blocked_clients[list_name].push(client_fd);
-        client_blocked_on_list[client_fd] = list_name;
-        blocked_fds.insert(client_fd);
-        return "";
-    }
-
-    
-    TimePoint expiry = Clock::now() + std::chrono::milliseconds(static_cast<int>(timeout_seconds * 1000));
-    {
-        std::scoped_lock lk(blocked_mutex, storage_mutex);
-        blocked_clients[list_name].push(client_fd);
-        client_blocked_on_list[client_fd] = list_name;
-        blocked_fds.insert(client_fd);
-        blocked_clients_info[client_fd] = {client_fd, list_name, expiry};
+    std::vector<std::string> keys(args.begin() + 1, args.end() - 1);
+
+    // Registering as blocked under the shard locks means a concurrent push either sees
+    // this client or pushed before the emptiness check.
+    ShardMask mask = 0;
+    for (const auto& key : keys) mask |= shard_bit(key);
+    ShardLock lock(mask, LockMode::Write);
+    for (const auto& key : keys) {
+        Shard& shard = shard_for(key);
+        RedisObject* obj = lookup_key_write(shard, key);
+        if (!obj) continue;
+        if (obj->type != OBJ_LIST) return WRONGTYPE_ERR;
+        std::string popped = list_pop(*obj, where);
+        if (list_length(*obj) == 0) delete_key(shard, key);
+        aof_append({where == ListEnd::Head ? "LPOP" : "RPOP", key});
+        return pop_reply(key, popped);
     }
 
+    if (!may_block) return "*-1\r\n";
+    std::lock_guard<std::mutex> lk(blocked_mutex);
+    if (!block_list_client(client_fd, connection_id(client_fd), keys, where, deadline)) return "*-1\r\n";
     return "";
 }
 
-std::string handle_TYPE(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 2) return "-ERR wrong number of arguments for 'type'\r\n";
-    if (to_lower(parts[0]) != "type") return "-ERR Invalid TYPE Command\r\n";
+std::string handle_BLPOP(const CommandArgs& args, int client_fd) {
+    if (args.size() < 3) return "-ERR wrong number of arguments for 'blpop' command\r\n";
+    return blocking_pop(args, client_fd, ListEnd::Head);
+}
 
-    std::string key = parts[1];
+std::string handle_BRPOP(const CommandArgs& args, int client_fd) {
+    if (args.size() < 3) return "-ERR wrong number of arguments for 'brpop' command\r\n";
+    return blocking_pop(args, client_fd, ListEnd::Tail);
+}
 
-    {
-        std::lock_guard<std::mutex> lock(storage_mutex);
-        if (redis_storage.find(key) != redis_storage.end()) {
-            return "+string\r\n";
-        }
-    }
+// Fired by the client's reactor once its BLPOP or XREAD BLOCK deadline has passed. A
+// client served in the meantime is no longer blocked and is left alone.
+void timeout_blocked_client(int fd) {
+    std::lock_guard<std::mutex> lk(blocked_mutex);
+    auto it = blocked_clients.find(fd);
+    if (it == blocked_clients.end()) return;
+    send_response(fd, it->second->connection_id, "*-1\r\n");
+    unblock_client(fd);
+}
 
-    {
-        std::lock_guard<std::mutex> lock(streams_mutex);
-        if (streams.find(key) != streams.end()) {
-            return "+stream\r\n";
-        }
+std::string handle_TYPE(const CommandArgs& args, int) {
+    if (args.size() != 2) return "-ERR wrong number of arguments for 'type'\r\n";
+
+    std::string_view key = args[1];
+    Shard& shard = shard_for(key);
+    ShardLock lock(shard, LockMode::Read);
+    RedisObject* obj = lookup_key_read(shard, key);
+    if (!obj) return "+none\r\n";
+    return "+" + std::string(object_type_name(obj->type)) + "\r\n";
+}
+
+// MAXLEN|MINID [=|~] threshold [LIMIT count], shared by XADD and XTRIM.
+struct StreamTrim {
+    bool by_min_id = false;
+    bool approximate = false;
+    size_t max_len = 0;
+    StreamID min_id;
+    size_t limit = 0;
+};
+
+// Reads the trim options at args[pos], if any, leaving pos past them. Returns an error
+// reply, or "" on success.
+static std::string parse_stream_trim(const CommandArgs& args, size_t& pos, StreamTrim& trim, bool& present) {
+    present = pos < args.size() &&
+              (equals_ignore_case(args[pos], "maxlen") || equals_ignore_case(args[pos], "minid"));
+    if (!present) return "";
+    trim.by_min_id = equals_ignore_case(args[pos++], "minid");
+    if (pos < args.size() && (args[pos] == "~" || args[pos] == "=")) trim.approximate = args[pos++] == "~";
+    if (pos >= args.size()) return "-ERR syntax error\r\n";
+    if (trim.by_min_id) {
+        if (!parse_stream_id(args[pos++], trim.min_id)) return "-ERR Invalid stream ID specified as stream command argument\r\n";
+    } else {
+        long long max_len = 0;
+        if (!parse_int64(args[pos++], max_len) || max_len < 0) return "-ERR The MAXLEN argument must be >= 0.\r\n";
+        trim.max_len = static_cast<size_t>(max_len);
+    }
+    // As in Redis, an approximate trim evicts at most 100 blocks' worth of entries per
+    // call unless told otherwise, so one command never stalls on a huge backlog.
+    trim.limit = trim.approximate ? 100 * stream_node_max_entries : 0;
+    if (pos + 1 < args.size() && equals_ignore_case(args[pos], "limit")) {
+        long long limit = 0;
+        if (!parse_int64(args[pos + 1], limit) || limit < 0) return "-ERR The LIMIT argument must be >= 0.\r\n";
+        if (!trim.approximate) return "-ERR syntax error, LIMIT cannot be used without the special ~ option\r\n";
+        trim.limit = static_cast<size_t>(limit);
+        pos += 2;
     }
+    return "";
+}
 
-    return "+none\r\n";
+static size_t trim_stream(Stream& stream, const StreamTrim& trim) {
+    return trim.by_min_id ? stream.trim_min_id(trim.min_id, trim.approximate, trim.limit)
+                          : stream.trim_max_len(trim.max_len, trim.approximate, trim.limit);
 }
 
-std::string handle_XADD(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() < 4) return "-ERR Invalid XADD Command\r\n";
-    if (to_lower(parts[0]) != "xadd") return "-ERR Invalid XADD Command\r\n";
+// How much of a stream an approximate trim or a MINID keeps depends on its blocks, which a
+// replay need not lay out the same way, so trims are logged as the length they left.
+static void log_stream_length(std::string_view key, const Stream& stream) {
+    std::string length = std::to_string(stream.size());
+    aof_append({"XTRIM", key, "MAXLEN", length});
+}
+
+std::string handle_XADD(const CommandArgs& args, int) {
+    if (args.size() < 4) return "-ERR Invalid XADD Command\r\n";
 
-    std::string stream_key = parts[1];
-    std::string entry_id = parts[2];
+    std::string_view stream_key = args[1];
+    size_t pos = 2;
+    bool no_mkstream = false;
+    if (equals_ignore_case(args[pos], "nomkstream")) {
+        no_mkstream = true;
+        ++pos;
+    }
+    StreamTrim trim;
+    bool trimming = false;
+    std::string error = parse_stream_trim(args, pos, trim, trimming);
+    if (!error.empty()) return error;
 
-    if ((parts.size() - 3) % 2 != 0)
+    if (pos + 3 > args.size() || (args.size() - pos - 1) % 2 != 0)
         return "-ERR Invalid field-value pairs\r\n";
 
-    uint64_t ms_part = 0;
-    uint64_t seq_part = 0;
+    StreamID requested;
     bool seq_wildcard = false;
     bool full_wildcard = false;
-
-    if (!parse_entry_id(entry_id, ms_part, seq_part, seq_wildcard, full_wildcard)) {
+    if (!parse_entry_id(args[pos], requested, seq_wildcard, full_wildcard)) {
         return "-ERR Invalid entry ID format\r\n";
     }
 
-    std::string new_entry_id;
-    StreamEntry new_entry;
-
-    {
-        std::lock_guard<std::mutex> lock(streams_mutex);
-        auto& stream = streams[stream_key];
-
-        if (full_wildcard) {
-            uint64_t now_ms = current_unix_time_ms();
-
-            uint64_t last_seq_for_ms = 0;
-            bool found = false;
-            for (auto it = stream.rbegin(); it != stream.rend(); ++it) {
-                uint64_t entry_ms, entry_seq;
-                bool dummy_sw, dummy_fw;
-                if (!parse_entry_id(it->first, entry_ms, entry_seq, dummy_sw, dummy_fw)) continue;
-                if (entry_ms == now_ms) {
-                    last_seq_for_ms = entry_seq;
-                    found = true;
-                    break;
-                }
-                if (entry_ms < now_ms) break;
-            }
-            seq_part = found ? last_seq_for_ms + 1 : 0;
-            ms_part = now_ms;
-            new_entry_id = std::to_string(ms_part) + "-" + std::to_string(seq_part);
-        } else if (seq_wildcard) {
-            uint64_t last_seq_for_ms = 0;
-            bool found = false;
-            for (auto it = stream.rbegin(); it != stream.rend(); ++it) {
-                uint64_t entry_ms, entry_seq;
-                bool dummy_sw, dummy_fw;
-                if (!parse_entry_id(it->first, entry_ms, entry_seq, dummy_sw, dummy_fw)) continue;
-                if (entry_ms == ms_part) {
-                    last_seq_for_ms = entry_seq;
-                    found = true;
-                    break;
-                }
-                if (entry_ms < ms_part) break;
-            }
-            if (!found) {
-                seq_part = (ms_part == 0) ? 1 : 0;
-            } else {
-                seq_part = last_seq_for_ms + 1;
-            }
-            new_entry_id = std::to_string(ms_part) + "-" + std::to_string(seq_part);
+    Shard& shard = shard_for(stream_key);
+    ShardLock lock(shard, LockMode::Write);
+    // The key is only created once the new entry is known to be valid.
+    RedisObject* obj = lookup_key_write(shard, stream_key);
+    if (obj && obj->type != OBJ_STREAM) return WRONGTYPE_ERR;
+    StreamID last = obj ? obj->stream().last_id() : StreamID{};
+
+    StreamID id = requested;
+    if (full_wildcard) {
+        uint64_t now_ms = current_unix_time_ms();
+        if (now_ms > last.ms) {
+            id = StreamID{now_ms, 0};
+        } else if (last.seq != UINT64_MAX) {
+            id = StreamID{last.ms, last.seq + 1};
         } else {
-            new_entry_id = entry_id;
+            return "-ERR The stream has exhausted the last possible ID, unable to add more items\r\n";
         }
-
-        uint64_t new_ms, new_seq;
-        bool dummy_sw, dummy_fw;
-        if (!parse_entry_id(new_entry_id, new_ms, new_seq, dummy_sw, dummy_fw))
-            return "-ERR Invalid entry ID format\r\n";
-
-        if (new_ms == 0 && new_seq == 0)
-            return "-ERR The ID specified in XADD must be greater than 0-0\r\n";
-
-        if (!stream.empty()) {
-            const std::string& last_id = stream.back().first;
-            uint64_t last_ms, last_seq;
-            if (!parse_entry_id(last_id, last_ms, last_seq, dummy_sw, dummy_fw)) {
-                last_ms = 0; last_seq = 0;
-            }
-            if (!is_id_greater(new_ms, new_seq, last_ms, last_seq))
-                return "-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n";
+    } else if (seq_wildcard) {
+        if (id.ms == last.ms && obj) {
+            if (last.seq == UINT64_MAX) return "-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n";
+            id.seq = last.seq + 1;
+        } else {
+            id.seq = id.ms == 0 ? 1 : 0;
         }
+    }
 
-        for (size_t i = 3; i < parts.size(); i += 2) {
-            new_entry[parts[i]] = parts[i + 1];
-        }
-        stream.emplace_back(new_entry_id, new_entry);
+    if (id == StreamID{})
+        return "-ERR The ID specified in XADD must be greater than 0-0\r\n";
+    if (id <= last)
+        return "-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n";
+
+    if (!obj) {
+        if (no_mkstream) return "$-1\r\n";
+        obj = &set_key(shard, stream_key, create_stream_object());
+    }
+    obj->stream().append(id, args.data() + pos + 1, args.size() - pos - 1);
+    size_t trimmed = trimming ? trim_stream(obj->stream(), trim) : 0;
+
+    // Logged with the ID it got, and any trim as the exact length it left.
+    char text[STREAM_ID_MAX_LEN];
+    std::string_view id_text(text, format_stream_id(id, text));
+    if (aof_enabled) {
+        std::vector<std::string_view> logged = {"XADD", stream_key, id_text};
+        logged.insert(logged.end(), args.begin() + pos + 1, args.end());
+        aof_append(logged.data(), logged.size());
+        if (trimmed > 0) log_stream_length(stream_key, obj->stream());
     }
 
-    std::vector<int> clients_to_unblock;
     {
-        std::scoped_lock lk(blocked_mutex, streams_mutex);
-        auto it = blocked_stream_clients.find(stream_key);
-        if (it != blocked_stream_clients.end()) {
-            auto& clients = it->second;
-            for (auto client_it = clients.begin(); client_it != clients.end();) {
-                if (Clock::now() > client_it->expiry) {
-                    blocked_stream_fds.erase(client_it->fd);
-                    client_it = clients.erase(client_it);
-                    continue;
-                }
-                
-                uint64_t client_ms, client_seq;
-                if (parse_range_id(client_it->last_id, client_ms, client_seq)) {
-                    uint64_t new_ms, new_seq;
-                    bool dummy_sw, dummy_fw;
-                    if (parse_entry_id(new_entry_id, new_ms, new_seq, dummy_sw, dummy_fw)) {
-                        if (is_id_greater(new_ms, new_seq, client_ms, client_seq)) {
-                            clients_to_unblock.push_back(client_it->fd);
-                            blocked_stream_fds.erase(client_it->fd);
-                            client_it = clients.erase(client_it);
-                            continue;
-                        }
-                    }
-                }
-                ++client_it;
-            }
+        std::lock_guard<std::mutex> lk(blocked_mutex);
+        if (!stream_waiters.empty() && stream_waiters.count(std::string(stream_key))) {
+            signal_key_as_ready(std::string(stream_key));
         }
     }
-    
-    for (int fd : clients_to_unblock) {
-        std::string response = "*1\r\n*2\r\n";
-        response += resp_bulk_string(stream_key);
-        response += "*1\r\n*2\r\n";
-        response += resp_bulk_string(new_entry_id);
-        
-        std::vector<std::string> kv_list;
-        for (const auto& [k, v] : new_entry) {
-            kv_list.push_back(k);
-            kv_list.push_back(v);
-        }
-        response += resp_array(kv_list);
-        
-        send_response(fd, response);
-    }
-    
-    return "$" + std::to_string(new_entry_id.size()) + "\r\n" + new_entry_id + "\r\n";
-}
 
-std::string handle_XRANGE(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() < 4) return "-ERR Invalid XRANGE Command\r\n";
-    if (to_lower(parts[0]) != "xrange") return "-ERR Invalid XRANGE Command\r\n";
+    return resp_bulk_string(id_text);
+}
 
-    std::string stream_key = parts[1];
-    std::string start_id = parts[2];
-    std::string end_id = parts[3];
+std::string handle_XTRIM(const CommandArgs& args, int) {
+    size_t pos = 2;
+    StreamTrim trim;
+    bool trimming = false;
+    std::string error = parse_stream_trim(args, pos, trim, trimming);
+    if (!error.empty()) return error;
+    if (!trimming || pos != args.size()) return "-ERR syntax error\r\n";
+
+    std::string_view stream_key = args[1];
+    Shard& shard = shard_for(stream_key);
+    ShardLock lock(shard, LockMode::Write);
+    RedisObject* obj = lookup_key_write(shard, stream_key);
+    if (!obj) return ":0\r\n";
+    if (obj->type != OBJ_STREAM) return WRONGTYPE_ERR;
+    size_t trimmed = trim_stream(obj->stream(), trim);
+    if (trimmed > 0) log_stream_length(stream_key, obj->stream());
+    return ":" + std::to_string(trimmed) + "\r\n";
+}
 
-    uint64_t start_ms, start_seq, end_ms, end_seq;
-    if (!parse_range_id(start_id, start_ms, start_seq)) return "-ERR Invalid start ID\r\n";
-    if (!parse_range_id(end_id, end_ms, end_seq)) return "-ERR Invalid end ID\r\n";
+// Seeks straight to the block holding the start ID and stops at the first entry past end.
+std::string handle_XRANGE(const CommandArgs& args, int) {
+    if (args.size() < 4) return "-ERR Invalid XRANGE Command\r\n";
 
-    std::vector<std::pair<std::string, StreamEntry>> result_entries;
+    std::string_view stream_key = args[1];
 
-    {
-        std::lock_guard<std::mutex> lock(streams_mutex);
-        auto it = streams.find(stream_key);
-        if (it == streams.end()) {
-            return "*0\r\n";
-        }
-        const Stream& stream = it->second;
+    StreamID start, end;
+    if (!parse_range_id(args[2], start)) return "-ERR Invalid start ID\r\n";
+    if (!parse_range_id(args[3], end, UINT64_MAX)) return "-ERR Invalid end ID\r\n";
 
-        for (const auto& [entry_id, entry_kv] : stream) {
-            uint64_t entry_ms, entry_seq;
-            if (!parse_range_id(entry_id, entry_ms, entry_seq)) continue;
+    Shard& shard = shard_for(stream_key);
+    ShardLock lock(shard, LockMode::Read);
+    RedisObject* obj = lookup_key_read(shard, stream_key);
+    if (!obj) return "*0\r\n";
+    if (obj->type != OBJ_STREAM) return WRONGTYPE_ERR;
 
-            if (id_less_equal(start_ms, start_seq, entry_ms, entry_seq) &&
-                id_less_equal(entry_ms, entry_seq, end_ms, end_seq)) {
-                result_entries.push_back({entry_id, entry_kv});
-            }
-            if (!id_less_equal(entry_ms, entry_seq, end_ms, end_seq)) break;
-        }
+    std::string entries;
+    size_t count = 0;
+    for (StreamIterator it(obj->stream(), start); it.valid() && it.id() <= end; it.next(), ++count) {
+        append_stream_entry(entries, it);
     }
-
-    return encode_xrange_response(result_entries);
+    return "*" + std::to_string(count) + "\r\n" + entries;
 }
 
 
-std::string format_xread_response(const std::vector<std::pair<std::string, std::vector<std::pair<std::string, StreamEntry>>>>& result) {
-    
-    bool has_any_entries = false;
-    for (const auto& [key, entries] : result) {
-        if (!entries.empty()) {
-            has_any_entries = true;
-            break;
-        }
-    }
-    
-    if (!has_any_entries) {
-        return "*-1\r\n";
-    }
-    
-    std::string resp_out = "*" + std::to_string(result.size()) + "\r\n";
-    for (const auto& [key, entries] : result) {
-        if (entries.empty()) continue; 
-        
-        resp_out += "*2\r\n";                  
-        resp_out += resp_bulk_string(key);
-        resp_out += "*" + std::to_string(entries.size()) + "\r\n"; 
-        
-        for (const auto& [entry_id, kvs] : entries) {
-            resp_out += "*2\r\n"; 
-            resp_out += resp_bulk_string(entry_id);
-
-            std::vector<std::string> kv_list;
-            for (const auto& [k, v] : kvs) {
-                kv_list.push_back(k);
-                kv_list.push_back(v);
-            }
-            resp_out += resp_array(kv_list);
-        }
-    }
-    
-    return resp_out;
-}
-
-std::string handle_XREAD(const char* resp, int client_fd) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() < 4) return "-ERR Invalid XREAD Command\r\n";
-    if (to_lower(parts[0]) != "xread") return "-ERR Invalid XREAD Command\r\n";
+std::string handle_XREAD(const CommandArgs& args, int client_fd) {
+    if (args.size() < 4) return "-ERR Invalid XREAD Command\r\n";
 
     
     bool block = false;
-    int64_t block_timeout_ms = 0;
+    TimePoint block_until;
     size_t block_pos = 1;
     
-    if (to_lower(parts[1]) == "block" && parts.size() >= 5) {
+    if (equals_ignore_case(args[1], "block") && args.size() >= 5) {
         block = true;
-        try {
-            block_timeout_ms = std::stoll(parts[2]);
-            if (block_timeout_ms < 0) return "-ERR Invalid block timeout\r\n";
-        } catch (...) {
-            return "-ERR Invalid block timeout\r\n";
-        }
+        long long timeout = 0;
+        if (!parse_int64(args[2], timeout) || timeout < 0) return "-ERR Invalid block timeout\r\n";
+        if (!block_deadline(timeout, block_until)) return "-ERR timeout is out of range\r\n";
         block_pos = 3;
     }
 
-    auto it_streams = std::find(parts.begin() + block_pos, parts.end(), "streams");
-    if (it_streams == parts.end()) return "-ERR Missing STREAMS keyword\r\n";
+    auto it_streams = std::find_if(args.begin() + block_pos, args.end(), [](std::string_view arg) {
+        return equals_ignore_case(arg, "streams");
+    });
+    if (it_streams == args.end()) return "-ERR Missing STREAMS keyword\r\n";
 
-    size_t streams_pos = std::distance(parts.begin(), it_streams);
-    size_t total_args_after_streams = parts.size() - (streams_pos + 1);
+    size_t streams_pos = std::distance(args.begin(), it_streams);
+    size_t total_args_after_streams = args.size() - (streams_pos + 1);
     if (total_args_after_streams % 2 != 0) return "-ERR Mismatched keys and IDs count\r\n";
 
     size_t num_streams = total_args_after_streams / 2;
-    std::vector<std::string> keys(parts.begin() + streams_pos + 1, parts.begin() + streams_pos + 1 + num_streams);
-    std::vector<std::string> ids(parts.begin() + streams_pos + 1 + num_streams, parts.end());
+    std::vector<std::string> keys(args.begin() + streams_pos + 1, args.begin() + streams_pos + 1 + num_streams);
+    const std::string_view* ids = args.data() + streams_pos + 1 + num_streams;
+
+    std::string streams_reply;
+    size_t streams_with_data = 0;
+    std::vector<StreamID> read_up_to(num_streams);     // "$" resolved
+
+    // Every stream's shard is held from the read through blocking registration, so an
+    // XADD to any of them lands either before the read or after the client is waiting.
+    ShardMask mask = 0;
+    for (const auto& key : keys) mask |= shard_bit(key);
+    ShardLock lock(mask, LockMode::Read);
+
+    for (size_t i = 0; i < num_streams; ++i) {
+        const std::string& key = keys[i];
+        StreamID after;
+        if (!parse_range_id(ids[i], after)) {
+            return "-ERR Invalid stream ID format\r\n";
+        }
+        bool from_newest = ids[i] == "$";
+        read_up_to[i] = from_newest ? StreamID{} : after;
+
+        Shard& shard = shard_for(key);
+        RedisObject* obj = lookup_key_read(shard, key);
+        if (!obj) continue;
+        if (obj->type != OBJ_STREAM) return WRONGTYPE_ERR;
+        if (from_newest) {
+            read_up_to[i] = obj->stream().last_id();
+            continue;
+        }
 
-    std::vector<std::pair<std::string, std::vector<std::pair<std::string, StreamEntry>>>> result;
-    bool has_data = false;
+        std::string reply = xread_stream_reply(key, obj->stream(), after);
+        if (!reply.empty()) {
+            streams_reply += reply;
+            ++streams_with_data;
+        }
+    }
 
-    {
-        std::lock_guard lock(streams_mutex);
-        for (size_t i = 0; i < num_streams; ++i) {
-            auto& key = keys[i];
-            auto& id = ids[i];
-            uint64_t last_ms, last_seq;
-            if (!parse_range_id(id, last_ms, last_seq)) {
-                return "-ERR Invalid stream ID format\r\n";
-            }
+    if (streams_with_data > 0) {
+        return "*" + std::to_string(streams_with_data) + "\r\n" + streams_reply;
+    }
 
-            auto sit = streams.find(key);
-            if (sit == streams.end()) {
-                result.emplace_back(key, std::vector<std::pair<std::string, StreamEntry>>{});
-                continue;
-            }
+    if (block && may_block) {
+        std::lock_guard<std::mutex> lk(blocked_mutex);
+        if (!block_stream_client(client_fd, connection_id(client_fd), keys, read_up_to, block_until)) return "*-1\r\n";
+        return "";
+    }
+    return "*-1\r\n";
+}
 
-            const Stream& stream = sit->second;
-            std::vector<std::pair<std::string, StreamEntry>> entries;
+std::string handle_SAVE(const CommandArgs& args, int) {
+    if (args.size() != 1) return "-ERR wrong number of arguments for 'save' command\r\n";
+    if (rdb_stats.bgsave_in_progress) return "-ERR Background save already in progress\r\n";
 
-            if (last_ms == UINT64_MAX - 1 && last_seq == UINT64_MAX - 1) {
-                result.emplace_back(key, std::vector<std::pair<std::string, StreamEntry>>{});
-                continue;
-            }
+    if (rdb_save(rdb_filename)) {
+        return "+OK\r\n";
+    } else {
+        return "-ERR Failed to save RDB file\r\n";
+    }
+}
 
-            for (const auto& [entry_id, entry_kv] : stream) {
-                uint64_t entry_ms, entry_seq;
-                if (!parse_range_id(entry_id, entry_ms, entry_seq)) continue;
+std::string handle_BGSAVE(const CommandArgs& args, int) {
+    if (args.size() != 1) return "-ERR wrong number of arguments for 'bgsave' command\r\n";
 
-                if ((entry_ms > last_ms) || (entry_ms == last_ms && entry_seq > last_seq)) {
-                    entries.push_back({entry_id, entry_kv});
-                }
-            }
+    switch (rdb_bgsave(rdb_filename)) {
+    case BgsaveStatus::Started:
+        std::cout << "Background saving started by BGSAVE" << std::endl;
+        return "+Background saving started\r\n";
+    case BgsaveStatus::InProgress:
+        return "-ERR Background save already in progress\r\n";
+    case BgsaveStatus::ForkFailed:
+        break;
+    }
+    return "-ERR Background save failed to start\r\n";
+}
 
-            if (!entries.empty()) {
-                has_data = true;
-            }
-            result.emplace_back(key, std::move(entries));
+std::string handle_BGREWRITEAOF(const CommandArgs& args, int) {
+    if (args.size() != 1) return "-ERR wrong number of arguments for 'bgrewriteaof' command\r\n";
+
+    switch (aof_rewrite_background()) {
+    case BgsaveStatus::Started:
+        std::cout << "Background append only file rewriting started" << std::endl;
+        return "+Background append only file rewriting started\r\n";
+    case BgsaveStatus::InProgress:
+        return "-ERR Background append only file rewriting already in progress\r\n";
+    case BgsaveStatus::ForkFailed:
+        break;
+    }
+    return "-ERR Can't execute an AOF background rewriting\r\n";
+}
+
+std::string handle_PING(const CommandArgs& args, int) {
+    if (args.size() > 2) return "-ERR wrong number of arguments for 'ping' command\r\n";
+    if (args.size() == 2) return resp_bulk_string(args[1]);
+    return "+PONG\r\n";
+}
+
+std::string handle_ECHO(const CommandArgs& args, int) {
+    if (args.size() != 2) return "-ERR wrong number of arguments for 'echo'\r\n";
+    return resp_bulk_string(args[1]);
+}
+
+std::string handle_DISCARD(const CommandArgs&, int client_fd) {
+    TransactionState& transaction = client_transaction(client_fd);
+    if (!transaction.in_transaction) return "-ERR DISCARD without MULTI\r\n";
+    transaction = {};
+    return "+OK\r\n";
+}
+
+// Single source of truth for command names, handlers and metadata. dispatch() and EXEC
+// both resolve commands here, COMMAND reports from it and INFO commandstats reads the
+// per-command counters.
+static RedisCommand command_table[] = {
+    {"ping",    handle_PING,    -1, CMD_FAST,                             0, 0, 0, {}},
+    {"echo",    handle_ECHO,     2, CMD_FAST,                             0, 0, 0, {}},
+    {"set",     handle_set,     -3, CMD_WRITE,                            1, 1, 1, {}},
+    {"get",     handle_get,      2, CMD_READONLY | CMD_FAST,              1, 1, 1, {}},
+    {"incr",    handle_INCR,     2, CMD_WRITE | CMD_FAST,                 1, 1, 1, {}},
+    {"del",     handle_DEL,     -2, CMD_WRITE,                            1, -1, 1, {}},
+    {"multi",   handle_MULTI,    1, CMD_NO_MULTI | CMD_FAST,              0, 0, 0, {}},
+    {"exec",    handle_EXEC,     1, CMD_NO_MULTI,                         0, 0, 0, {}},
+    {"discard", handle_DISCARD,  1, CMD_NO_MULTI | CMD_FAST,              0, 0, 0, {}},
+    {"rpush",   handle_RPUSH,   -3, CMD_WRITE | CMD_FAST,                 1, 1, 1, {}},
+    {"lpush",   handle_LPUSH,   -3, CMD_WRITE | CMD_FAST,                 1, 1, 1, {}},
+    {"lpop",    handle_LPOP,    -2, CMD_WRITE | CMD_FAST,                 1, 1, 1, {}},
+    {"rpop",    handle_RPOP,    -2, CMD_WRITE | CMD_FAST,                 1, 1, 1, {}},
+    {"lrange",  handle_LRANGE,   4, CMD_READONLY,                         1, 1, 1, {}},
+    {"llen",    handle_LLEN,     2, CMD_READONLY | CMD_FAST,              1, 1, 1, {}},
+    {"blpop",   handle_BLPOP,   -3, CMD_WRITE | CMD_BLOCKING,             1, -2, 1, {}},
+    {"brpop",   handle_BRPOP,   -3, CMD_WRITE | CMD_BLOCKING,             1, -2, 1, {}},
+    {"type",    handle_TYPE,     2, CMD_READONLY | CMD_FAST,              1, 1, 1, {}},
+    {"xadd",    handle_XADD,    -5, CMD_WRITE | CMD_FAST,                 1, 1, 1, {}},
+    {"xtrim",   handle_XTRIM,   -4, CMD_WRITE,                            1, 1, 1, {}},
+    {"xrange",  handle_XRANGE,  -4, CMD_READONLY,                         1, 1, 1, {}},
+    {"xread",   handle_XREAD,   -4, CMD_READONLY | CMD_BLOCKING | CMD_MOVABLE_KEYS, 0, 0, 0, {}},
+    {"save",    handle_SAVE,     1, CMD_ADMIN | CMD_NO_MULTI,             0, 0, 0, {}},
+    {"bgsave",  handle_BGSAVE,   1, CMD_ADMIN | CMD_NO_MULTI,             0, 0, 0, {}},
+    {"bgrewriteaof", handle_BGREWRITEAOF, 1, CMD_ADMIN | CMD_NO_MULTI,    0, 0, 0, {}},
+    {"command", handle_COMMAND, -1, 0,                                    0, 0, 0, {}},
+    {"info",    handle_INFO,    -1, 0,                                    0, 0, 0, {}},
+};
+
+static const size_t COMMAND_COUNT = sizeof(command_table) / sizeof(command_table[0]);
+static const size_t COMMAND_BUCKETS = 64;  // power of two, at least twice COMMAND_COUNT
+
+static uint32_t command_name_hash(std::string_view name) {
+    uint32_t h = 2166136261u;
+    for (char c : name) {
+        h ^= static_cast<uint8_t>(std::tolower(static_cast<unsigned char>(c)));
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Open-addressing index over command_table, built once. Lookups hash the name
+// case-insensitively in place, so resolving a command never allocates.
+struct CommandIndex {
+    const RedisCommand* buckets[COMMAND_BUCKETS] = {};
+
+    CommandIndex() {
+        static_assert(COMMAND_BUCKETS >= 2 * COMMAND_COUNT, "command index too small");
+        for (auto& cmd : command_table) {
+            size_t i = command_name_hash(cmd.name) & (COMMAND_BUCKETS - 1);
+            while (buckets[i]) i = (i + 1) & (COMMAND_BUCKETS - 1);
+            buckets[i] = &cmd;
         }
     }
+};
+
+const RedisCommand* lookup_command(std::string_view name) {
+    static const CommandIndex index;
+    size_t i = command_name_hash(name) & (COMMAND_BUCKETS - 1);
+    while (const RedisCommand* cmd = index.buckets[i]) {
+        if (equals_ignore_case(cmd->name, name)) return cmd;
+        i = (i + 1) & (COMMAND_BUCKETS - 1);
+    }
+    return nullptr;
+}
 
-    if (has_data) {
-        return format_xread_response(result);
+// XREAD's keys are the first half of the arguments after STREAMS.
+static size_t xread_streams_pos(const CommandArgs& args) {
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (equals_ignore_case(args[i], "streams")) return i;
     }
+    return args.size();
+}
 
-    if (block) {
-        TimePoint expiry;
-        
-        if (block_timeout_ms == 0) {
-            expiry = TimePoint::max();
-        } else {
-            expiry = Clock::now() + std::chrono::milliseconds(block_timeout_ms);
+// Shards holding the keys a command touches, from the table's key positions.
+static ShardMask command_shard_mask(const RedisCommand& cmd, const CommandArgs& args) {
+    ShardMask mask = 0;
+    if (cmd.handler == handle_XREAD) {
+        size_t pos = xread_streams_pos(args);
+        size_t num_keys = (args.size() - std::min(pos + 1, args.size())) / 2;
+        for (size_t i = 0; i < num_keys; ++i) mask |= shard_bit(args[pos + 1 + i]);
+        return mask;
+    }
+    if (cmd.first_key <= 0) return mask;
+    int last = cmd.last_key < 0 ? static_cast<int>(args.size()) + cmd.last_key : cmd.last_key;
+    for (int i = cmd.first_key; i <= last && i < static_cast<int>(args.size()); i += cmd.key_step) {
+        mask |= shard_bit(args[i]);
+    }
+    return mask;
+}
+
+static bool arity_ok(const RedisCommand& cmd, size_t argc) {
+    return cmd.arity >= 0 ? argc == static_cast<size_t>(cmd.arity) : argc >= static_cast<size_t>(-cmd.arity);
+}
+
+static std::string call_command(const RedisCommand& cmd, const CommandArgs& args, int client_fd) {
+    auto start = Clock::now();
+    std::string reply = cmd.handler(args, client_fd);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+
+    auto& stats = cmd.stats;
+    stats.calls.fetch_add(1, std::memory_order_relaxed);
+    stats.usec.fetch_add(static_cast<uint64_t>(elapsed), std::memory_order_relaxed);
+    if (!reply.empty() && reply[0] == '-') stats.failed_calls.fetch_add(1, std::memory_order_relaxed);
+    return reply;
+}
+
+static std::string command_info(const RedisCommand& cmd) {
+    static const std::pair<uint32_t, const char*> flag_names[] = {
+        {CMD_WRITE, "write"}, {CMD_READONLY, "readonly"}, {CMD_BLOCKING, "blocking"},
+        {CMD_NO_MULTI, "no-multi"}, {CMD_ADMIN, "admin"}, {CMD_FAST, "fast"},
+        {CMD_MOVABLE_KEYS, "movablekeys"},
+    };
+    std::string flags;
+    size_t flag_count = 0;
+    for (const auto& [bit, name] : flag_names) {
+        if (cmd.flags & bit) {
+            flags += "+" + std::string(name) + "\r\n";
+            flag_count++;
         }
-        
-        {
-            std::scoped_lock lk(blocked_mutex, streams_mutex);
-            for (size_t i = 0; i < num_streams; ++i) {
-                const std::string& key = keys[i];
-                const std::string& last_id = ids[i];
-                
-                std::string actual_last_id = last_id;
-                if (last_id == "$") {
-                    auto sit = streams.find(key);
-                    if (sit != streams.end() && !sit->second.empty()) {
-                        actual_last_id = sit->second.back().first;
-                    } else {
-                        actual_last_id = "0-0";
-                    }
-                }
-                
-                blocked_stream_clients[key].push_back({client_fd, actual_last_id, expiry});
-            }
-            blocked_stream_fds.insert(client_fd);
+    }
+
+    std::string out = "*6\r\n";
+    out += resp_bulk_string(cmd.name);
+    out += ":" + std::to_string(cmd.arity) + "\r\n";
+    out += "*" + std::to_string(flag_count) + "\r\n" + flags;
+    out += ":" + std::to_string(cmd.first_key) + "\r\n";
+    out += ":" + std::to_string(cmd.last_key) + "\r\n";
+    out += ":" + std::to_string(cmd.key_step) + "\r\n";
+    return out;
+}
+
+std::string handle_COMMAND(const CommandArgs& args, int) {
+    if (args.size() == 1) {
+        std::string out = "*" + std::to_string(COMMAND_COUNT) + "\r\n";
+        for (const auto& cmd : command_table) out += command_info(cmd);
+        return out;
+    }
+    if (equals_ignore_case(args[1], "count") && args.size() == 2) {
+        return ":" + std::to_string(COMMAND_COUNT) + "\r\n";
+    }
+    if (equals_ignore_case(args[1], "info")) {
+        std::string out = "*" + std::to_string(args.size() - 2) + "\r\n";
+        for (size_t i = 2; i < args.size(); ++i) {
+            const RedisCommand* cmd = lookup_command(args[i]);
+            out += cmd ? command_info(*cmd) : "*-1\r\n";
         }
+        return out;
+    }
+    return "-ERR unknown subcommand or wrong number of arguments for 'command'\r\n";
+}
 
-        return "";
+static std::string info_commandstats() {
+    std::string out = "# Commandstats\r\n";
+    for (const auto& cmd : command_table) {
+        uint64_t calls = cmd.stats.calls.load(std::memory_order_relaxed);
+        uint64_t rejected = cmd.stats.rejected_calls.load(std::memory_order_relaxed);
+        if (calls == 0 && rejected == 0) continue;
+        uint64_t usec = cmd.stats.usec.load(std::memory_order_relaxed);
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f,rejected_calls=%llu,failed_calls=%llu\r\n",
+                 cmd.name, static_cast<unsigned long long>(calls), static_cast<unsigned long long>(usec),
+                 calls ? static_cast<double>(usec) / static_cast<double>(calls) : 0.0,
+                 static_cast<unsigned long long>(rejected),
+                 static_cast<unsigned long long>(cmd.stats.failed_calls.load(std::memory_order_relaxed)));
+        out += line;
     }
-    return "*-1\r\n";
+    return out;
 }
 
-std::string handle_SAVE(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 1) return "-ERR wrong number of arguments for 'save' command\r\n";
-    if (to_lower(parts[0]) != "save") return "-ERR Invalid SAVE Command\r\n";
-    
-    if (rdb_save(rdb_filename)) {
-        return "+OK\r\n";
-    } else {
-        return "-ERR Failed to save RDB file\r\n";
+static std::string info_persistence() {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "# Persistence\r\n"
+             "rdb_bgsave_in_progress:%d\r\n"
+             "rdb_last_save_time:%lld\r\n"
+             "rdb_last_bgsave_status:%s\r\n"
+             "rdb_last_bgsave_time_sec:%lld\r\n"
+             "latest_fork_usec:%llu\r\n"
+             "aof_enabled:%d\r\n"
+             "aof_rewrite_in_progress:%d\r\n"
+             "aof_last_bgrewrite_status:%s\r\n"
+             "aof_last_write_status:%s\r\n"
+             "aof_current_size:%llu\r\n"
+             "aof_base_size:%llu\r\n"
+             "aof_fsyncs:%llu\r\n",
+             rdb_stats.bgsave_in_progress.load() ? 1 : 0,
+             static_cast<long long>(rdb_stats.last_save_time.load(std::memory_order_relaxed)),
+             rdb_stats.last_bgsave_ok.load(std::memory_order_relaxed) ? "ok" : "err",
+             static_cast<long long>(rdb_stats.last_bgsave_sec.load(std::memory_order_relaxed)),
+             static_cast<unsigned long long>(rdb_stats.last_fork_usec.load(std::memory_order_relaxed)),
+             aof_enabled ? 1 : 0,
+             aof_stats.rewrite_in_progress.load() ? 1 : 0,
+             aof_stats.last_rewrite_ok.load(std::memory_order_relaxed) ? "ok" : "err",
+             aof_stats.last_write_ok.load(std::memory_order_relaxed) ? "ok" : "err",
+             static_cast<unsigned long long>(aof_stats.current_size.load(std::memory_order_relaxed)),
+             static_cast<unsigned long long>(aof_stats.base_size.load(std::memory_order_relaxed)),
+             static_cast<unsigned long long>(aof_stats.fsyncs.load(std::memory_order_relaxed)));
+    return buf;
+}
+
+static std::string info_stats() {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "# Stats\r\n"
+             "expired_keys:%llu\r\n"
+             "expired_stale_perc:%.2f\r\n"
+             "expired_time_cap_reached_count:%llu\r\n"
+             "expire_cycles:%llu\r\n"
+             "expire_cycle_cpu_milliseconds:%llu\r\n"
+             "expire_cycle_last_expired:%llu\r\n"
+             "expire_cycle_last_usec:%llu\r\n",
+             static_cast<unsigned long long>(expire_stats.expired_keys.load(std::memory_order_relaxed)),
+             expire_stats.stale_perc.load(std::memory_order_relaxed),
+             static_cast<unsigned long long>(expire_stats.time_cap_reached.load(std::memory_order_relaxed)),
+             static_cast<unsigned long long>(expire_stats.cycles.load(std::memory_order_relaxed)),
+             static_cast<unsigned long long>(expire_stats.cycle_usec.load(std::memory_order_relaxed) / 1000),
+             static_cast<unsigned long long>(expire_stats.last_cycle_expired.load(std::memory_order_relaxed)),
+             static_cast<unsigned long long>(expire_stats.last_cycle_usec.load(std::memory_order_relaxed)));
+    return buf;
+}
+
+std::string handle_INFO(const CommandArgs& args, int) {
+    if (args.size() > 2) return "-ERR wrong number of arguments for 'info' command\r\n";
+    bool all = args.size() == 1 || equals_ignore_case(args[1], "all") || equals_ignore_case(args[1], "everything");
+
+    std::string body;
+    if (all || equals_ignore_case(args[1], "persistence")) body += info_persistence();
+    if (all || equals_ignore_case(args[1], "stats")) {
+        if (!body.empty()) body += "\r\n";
+        body += info_stats();
+    }
+    if (all || equals_ignore_case(args[1], "commandstats")) {
+        if (!body.empty()) body += "\r\n";
+        body += info_commandstats();
     }
+    return resp_bulk_string(body);
 }
 
-std::string handle_BGSAVE(const char* resp) {
-    auto parts = parse_resp_array(resp);
-    if (parts.size() != 1) return "-ERR wrong number of arguments for 'bgsave' command\r\n";
-    if (to_lower(parts[0]) != "bgsave") return "-ERR Invalid BGSAVE Command\r\n";
-    
-    // In a real implementation, you'd spawn a separate process for this
-    // For simplicity, we'll just do it in the current thread
-    std::thread([]() {
-        std::cout << "Background saving started by BGSAVE" << std::endl;
-        if (rdb_save(rdb_filename)) {
-            std::cout << "Background saving completed" << std::endl;
-        } else {
-            std::cerr << "Background saving failed" << std::endl;
+std::string dispatch(const CommandArgs& args, int fd) {
+    if (args.empty()) return "-ERR Protocol error\r\n";
+
+    const RedisCommand* cmd = lookup_command(args[0]);
+    if (!cmd) return "-ERR Invalid Unknown Command\r\n";
+    if (!arity_ok(*cmd, args.size())) {
+        cmd->stats.rejected_calls.fetch_add(1, std::memory_order_relaxed);
+        return "-ERR wrong number of arguments for '" + std::string(cmd->name) + "' command\r\n";
+    }
+
+    TransactionState& transaction = client_transaction(fd);
+    if (transaction.in_transaction) {
+        if (cmd->handler == handle_MULTI) {
+            return "-ERR MULTI calls can not be nested\r\n";
         }
-    }).detach();
-    
-    return "+Background saving started\r\n";
-}
\ No newline at end of file
+        if (cmd->handler != handle_EXEC && cmd->handler != handle_DISCARD) {
+            if (cmd->flags & CMD_NO_MULTI) {
+                cmd->stats.rejected_calls.fetch_add(1, std::memory_order_relaxed);
+                return "-ERR Command not allowed inside a transaction\r\n";
+            }
+            transaction.queued_commands.emplace_back(args.begin(), args.end());
+            return "+QUEUED\r\n";
+        }
+    }
+
+    may_block = cmd->flags & CMD_BLOCKING;
+    std::string reply = call_command(*cmd, args, fd);
+    may_block = false;
+    return reply;
+}
@@ -1,24 +1,92 @@
 #pragma once
 #include <string>
 #include <thread>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "parser.hpp"
 
+enum CommandFlags : uint32_t {
+    CMD_WRITE        = 1 << 0,
+    CMD_READONLY     = 1 << 1,
+    CMD_BLOCKING     = 1 << 2,
+    CMD_NO_MULTI     = 1 << 3,  // never queued by MULTI
+    CMD_ADMIN        = 1 << 4,
+    CMD_FAST         = 1 << 5,
+    CMD_MOVABLE_KEYS = 1 << 6,  // key positions depend on the arguments (XREAD)
+};
 
-std::string handle_set(const char* resp);
-std::string handle_get(const char* resp);
-std::string handle_RPUSH(const char* resp);
-std::string handle_LPUSH(const char* resp);
-std::string handle_LPOP(const char* resp);
-std::string handle_LRANGE(const char* resp);
-std::string handle_LLEN(const char* resp);
-std::string handle_BLPOP(const char* resp, int client_fd);
-std::string handle_TYPE(const char* resp);
-std::string handle_XADD(const char* resp);
-std::string handle_XRANGE(const char* resp);
-std::string handle_XREAD(const char* resp, int fd = -1);
-std::string handle_INCR(const char* resp);
-std::string handle_MULTI(const char* resp, int client_fd); 
-std::string handle_EXEC(const char* resp, int client_fd);
-std::string handle_SAVE(const char* resp);
-std::string handle_BGSAVE(const char* resp);
-
-bool send_response(int fd, const std::string& response);
+using CommandHandler = std::string (*)(const CommandArgs& args, int client_fd);
+
+struct CommandStats {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> usec{0};
+    std::atomic<uint64_t> rejected_calls{0};
+    std::atomic<uint64_t> failed_calls{0};
+};
+
+struct RedisCommand {
+    const char* name;
+    CommandHandler handler;
+    int arity;        // argument count including the name; -N means at least N
+    uint32_t flags;
+    int first_key;    // key positions as reported by COMMAND INFO; 0 when there are none
+    int last_key;
+    int key_step;
+    mutable CommandStats stats;  // updated on every call, even through const lookups
+};
+
+const RedisCommand* lookup_command(std::string_view name);
+
+std::string handle_set(const CommandArgs& args, int client_fd);
+std::string handle_get(const CommandArgs& args, int client_fd);
+std::string handle_RPUSH(const CommandArgs& args, int client_fd);
+std::string handle_LPUSH(const CommandArgs& args, int client_fd);
+std::string handle_LPOP(const CommandArgs& args, int client_fd);
+std::string handle_RPOP(const CommandArgs& args, int client_fd);
+std::string handle_LRANGE(const CommandArgs& args, int client_fd);
+std::string handle_LLEN(const CommandArgs& args, int client_fd);
+std::string handle_BLPOP(const CommandArgs& args, int client_fd);
+std::string handle_BRPOP(const CommandArgs& args, int client_fd);
+std::string handle_TYPE(const CommandArgs& args, int client_fd);
+std::string handle_XADD(const CommandArgs& args, int client_fd);
+std::string handle_XTRIM(const CommandArgs& args, int client_fd);
+std::string handle_XRANGE(const CommandArgs& args, int client_fd);
+std::string handle_XREAD(const CommandArgs& args, int client_fd);
+std::string handle_INCR(const CommandArgs& args, int client_fd);
+std::string handle_DEL(const CommandArgs& args, int client_fd);
+std::string handle_MULTI(const CommandArgs& args, int client_fd); 
+std::string handle_EXEC(const CommandArgs& args, int client_fd);
+std::string handle_SAVE(const CommandArgs& args, int client_fd);
+std::string handle_BGSAVE(const CommandArgs& args, int client_fd);
+std::string handle_BGREWRITEAOF(const CommandArgs& args, int client_fd);
+std::string handle_PING(const CommandArgs& args, int client_fd);
+std::string handle_ECHO(const CommandArgs& args, int client_fd);
+std::string handle_DISCARD(const CommandArgs& args, int client_fd);
+std::string handle_COMMAND(const CommandArgs& args, int client_fd);
+std::string handle_INFO(const CommandArgs& args, int client_fd);
+
+// A client's MULTI state. It lives on the client's connection and only its own reactor
+// touches it, so checking it costs no lock.
+struct TransactionState {
+    bool in_transaction = false;
+    // Owned copies of each queued command's arguments; the query buffer is reused.
+    std::vector<std::vector<std::string>> queued_commands;
+};
+
+std::string dispatch(const CommandArgs& args, int fd);
+// The transaction state of the client connected on fd. Only valid on that client's own
+// reactor, e.g. in its command handlers.
+TransactionState& client_transaction(int fd);
+// The id of the client connected on fd. Only valid on that client's own reactor, e.g. in
+// its command handlers.
+uint64_t connection_id(int fd);
+// Queues a reply that is not the return value of the client's current command, such as
+// the element that serves a blocked BLPOP. Safe to call from any thread. Returns false,
+// and the reply is dropped, unless the connection with this id is still open on fd.
+bool send_response(int fd, uint64_t connection_id, std::string response);
+void timeout_blocked_client(int fd);
+// Serves the clients blocked on keys that commands run by this thread have pushed to.
+// Each reactor calls it once per loop iteration.
+void handle_clients_blocked_on_keys();
+bool has_ready_keys();
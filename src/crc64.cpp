@@ -0,0 +1,126 @@
+#include "crc64.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CRC64_HAVE_CLMUL 1
+#endif
+
+// The polynomial, in the usual order (bit i is the coefficient of x^i) and bit-reflected.
+static constexpr uint64_t CRC64_JONES = 0xad93d23594c935a9ULL;
+static constexpr uint64_t CRC64_JONES_REFLECTED = 0x95ac9329ac4bc9b5ULL;
+
+// table[0] is the usual byte-at-a-time table. table[k][b] is the CRC of byte b followed
+// by k zero bytes, which lets eight bytes be folded in with eight independent lookups
+// instead of a chain of eight dependent ones (slice-by-8).
+struct Crc64Tables {
+    uint64_t table[8][256];
+
+    Crc64Tables() {
+        for (uint64_t b = 0; b < 256; ++b) {
+            uint64_t crc = b;
+            for (int i = 0; i < 8; ++i) crc = crc & 1 ? (crc >> 1) ^ CRC64_JONES_REFLECTED : crc >> 1;
+            table[0][b] = crc;
+        }
+        for (size_t b = 0; b < 256; ++b) {
+            for (size_t k = 1; k < 8; ++k) {
+                uint64_t prev = table[k - 1][b];
+                table[k][b] = table[0][prev & 0xff] ^ (prev >> 8);
+            }
+        }
+    }
+};
+
+static const Crc64Tables tables;
+
+static uint64_t crc64_slice8(uint64_t crc, const unsigned char* p, size_t len) {
+    const auto& t = tables.table;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        crc ^= word;
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^ t[5][(crc >> 16) & 0xff] ^ t[4][(crc >> 24) & 0xff] ^
+              t[3][(crc >> 32) & 0xff] ^ t[2][(crc >> 40) & 0xff] ^ t[1][(crc >> 48) & 0xff] ^ t[0][crc >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC64_HAVE_CLMUL
+
+// x^n mod P, bit-reflected.
+static constexpr uint64_t xpow_mod(unsigned n) {
+    uint64_t r = 1;
+    for (unsigned i = 0; i < n; ++i) r = (r << 1) ^ (r >> 63 ? CRC64_JONES : 0);
+    uint64_t reflected = 0;
+    for (int i = 0; i < 64; ++i) reflected |= ((r >> i) & 1) << (63 - i);
+    return reflected;
+}
+
+// Folding: the data is read as a polynomial sixteen bytes at a time. Moving a 128-bit
+// remainder d bits further along multiplies its two halves by x^(d+64) and x^d mod P;
+// a carry-less multiply of reflected operands adds one more x, hence the -1. Four
+// independent remainders, 64 bytes apart, keep the multiplier busy.
+static constexpr uint64_t K_512_LO = xpow_mod(512 + 63), K_512_HI = xpow_mod(512 - 1);
+static constexpr uint64_t K_128_LO = xpow_mod(128 + 63), K_128_HI = xpow_mod(128 - 1);
+
+__attribute__((target("pclmul,sse2"))) static inline __m128i fold(__m128i x, __m128i k, __m128i next) {
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+// The 16 bytes of the final remainder stand for the same value mod P as all the data
+// folded into them, so the table CRC of those bytes is the CRC of the data.
+__attribute__((target("pclmul,sse2"))) static uint64_t crc64_clmul(uint64_t crc, const unsigned char* p, size_t len) {
+    auto load = [](const unsigned char* q) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(q)); };
+    // A starting CRC is the same as xoring it into the first eight bytes.
+    __m128i x0 = _mm_xor_si128(load(p), _mm_cvtsi64_si128(static_cast<long long>(crc)));
+    __m128i x1 = load(p + 16), x2 = load(p + 32), x3 = load(p + 48);
+    p += 64;
+    len -= 64;
+
+    __m128i k512 = _mm_set_epi64x(static_cast<long long>(K_512_HI), static_cast<long long>(K_512_LO));
+    while (len >= 64) {
+        x0 = fold(x0, k512, load(p));
+        x1 = fold(x1, k512, load(p + 16));
+        x2 = fold(x2, k512, load(p + 32));
+        x3 = fold(x3, k512, load(p + 48));
+        p += 64;
+        len -= 64;
+    }
+    __m128i k128 = _mm_set_epi64x(static_cast<long long>(K_128_HI), static_cast<long long>(K_128_LO));
+    __m128i x = fold(x0, k128, x1);
+    x = fold(x, k128, x2);
+    x = fold(x, k128, x3);
+    while (len >= 16) {
+        x = fold(x, k128, load(p));
+        p += 16;
+        len -= 16;
+    }
+    unsigned char rest[16];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(rest), x);
+    return crc64_slice8(crc64_slice8(0, rest, sizeof(rest)), p, len);
+}
+
+// Initialized before main(), when the CPU model has to be set up by hand.
+static const bool have_clmul = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul");
+}();
+
+#endif
+
+uint64_t crc64(uint64_t crc, const void* data, size_t len) {
+    const auto* p = static_cast<const unsigned char*>(data);
+#ifdef CRC64_HAVE_CLMUL
+    if (len >= 128 && have_clmul) return crc64_clmul(crc, p, len);
+#endif
+    return crc64_slice8(crc, p, len);
+}
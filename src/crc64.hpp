@@ -0,0 +1,9 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// CRC-64 with Redis's parameters (Jones polynomial, reflected, no final xor), the checksum
+// at the end of an RDB file. Start from 0 and feed the data in pieces of any size:
+// crc64(crc64(0, a, n), b, m) is the CRC of a followed by b. Uses carry-less multiplies
+// where the CPU has them (several GB/s), and slice-by-8 tables otherwise.
+uint64_t crc64(uint64_t crc, const void* data, size_t len);
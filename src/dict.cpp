@@ -0,0 +1,255 @@
+#include "dict.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Control byte values. A full slot holds the sign bit plus the low seven bits of its key's
+// hash, so the sign bit alone tells a full slot from a free one. Empty is zero, so a new
+// table comes zeroed from calloc and large ones are faulted in by the kernel as the
+// entries move in rather than cleared up front.
+static constexpr int8_t CTRL_EMPTY = 0;
+static constexpr int8_t CTRL_DELETED = 1;
+
+// A table never gets fuller than 7/8, counting tombstones, so every probe finds an empty slot.
+static constexpr size_t max_load(size_t capacity) { return capacity - capacity / 8; }
+
+static inline int8_t hash_tag(size_t hash) { return static_cast<int8_t>(0x80 | (hash & 0x7F)); }
+
+// Bitmask of the slots in a group whose control byte equals b.
+static inline uint32_t match_byte(const int8_t* ctrl, int8_t b) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128(reinterpret_cast<const __m128i*>(ctrl));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(b))));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < Dict::GROUP_WIDTH; ++i) {
+        if (ctrl[i] == b) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Bitmask of the full slots in a group.
+static inline uint32_t match_full(const int8_t* ctrl) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128(reinterpret_cast<const __m128i*>(ctrl));
+    return static_cast<uint32_t>(_mm_movemask_epi8(group));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < Dict::GROUP_WIDTH; ++i) {
+        if (ctrl[i] < 0) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static inline uint32_t match_free(const int8_t* ctrl) {
+    return ~match_full(ctrl) & ((1u << Dict::GROUP_WIDTH) - 1);
+}
+
+// The key's bytes start right after key_len; keys longer than key_start grow the
+// allocation past the struct.
+static constexpr size_t DICT_ENTRY_HEADER = sizeof(DictEntry) - sizeof(DictEntry::key_start);
+static_assert(DICT_ENTRY_HEADER == sizeof(RedisObject) + sizeof(uint32_t), "DictEntry has no padding before key_start");
+
+DictEntry* DictEntry::create(std::string_view key, RedisObject&& value) {
+    void* mem = ::operator new(std::max(sizeof(DictEntry), DICT_ENTRY_HEADER + key.size()));
+    auto* entry = new (mem) DictEntry(std::move(value));
+    entry->key_len = static_cast<uint32_t>(key.size());
+    memcpy(static_cast<char*>(mem) + DICT_ENTRY_HEADER, key.data(), key.size());
+    return entry;
+}
+
+void DictEntry::destroy(DictEntry* entry) {
+    entry->~DictEntry();
+    ::operator delete(entry);
+}
+
+Dict::~Dict() {
+    clear();
+}
+
+size_t Dict::hash_key(std::string_view key) {
+    return std::hash<std::string_view>{}(key);
+}
+
+void Dict::allocate(Table& t, size_t group_count) {
+    t.groups = static_cast<Group*>(calloc(group_count, sizeof(Group)));
+    if (!t.groups) throw std::bad_alloc();
+    t.group_count = group_count;
+    t.used = 0;
+    t.growth_left = max_load(t.capacity());
+}
+
+// Groups are probed quadratically from the one the hash selects; a group with an empty
+// slot ends the probe, since an insert would have stopped there.
+size_t Dict::find_pos(const Table& t, std::string_view key, size_t hash) {
+    if (t.group_count == 0) return SIZE_MAX;
+    size_t mask = t.group_count - 1;
+    size_t g = (hash >> 7) & mask;
+    int8_t tag = hash_tag(hash);
+    for (size_t step = 1;; ++step) {
+        const Group& group = t.groups[g];
+        for (uint32_t m = match_byte(group.ctrl, tag); m; m &= m - 1) {
+            unsigned i = __builtin_ctz(m);
+            if (group.slots[i]->key() == key) return g * GROUP_WIDTH + i;
+        }
+        if (match_byte(group.ctrl, CTRL_EMPTY)) return SIZE_MAX;
+        g = (g + step) & mask;
+    }
+}
+
+void Dict::insert_entry(Table& t, DictEntry* entry, size_t hash) {
+    size_t mask = t.group_count - 1;
+    size_t g = (hash >> 7) & mask;
+    for (size_t step = 1;; ++step) {
+        Group& group = t.groups[g];
+        uint32_t m = match_free(group.ctrl);
+        if (m) {
+            unsigned i = __builtin_ctz(m);
+            if (group.ctrl[i] == CTRL_EMPTY) --t.growth_left;
+            group.ctrl[i] = hash_tag(hash);
+            group.slots[i] = entry;
+            ++t.used;
+            return;
+        }
+        g = (g + step) & mask;
+    }
+}
+
+// A slot can go back to empty when its group still has an empty slot: no probe has ever
+// passed through that group, so no other key depends on this one being occupied.
+void Dict::erase_at(Table& t, size_t pos) {
+    Group& group = t.groups[pos / GROUP_WIDTH];
+    size_t i = pos % GROUP_WIDTH;
+    DictEntry::destroy(group.slots[i]);
+    group.slots[i] = nullptr;
+    if (match_byte(group.ctrl, CTRL_EMPTY)) {
+        group.ctrl[i] = CTRL_EMPTY;
+        ++t.growth_left;
+    } else {
+        group.ctrl[i] = CTRL_DELETED;
+    }
+    --t.used;
+}
+
+DictEntry* Dict::find(std::string_view key) const {
+    if (size() == 0) return nullptr;
+    size_t hash = hash_key(key);
+    for (const Table& t : ht) {
+        size_t pos = find_pos(t, key, hash);
+        if (pos != SIZE_MAX) return t.slot(pos);
+    }
+    return nullptr;
+}
+
+std::pair<DictEntry*, bool> Dict::try_emplace(std::string_view key, RedisObject&& value) {
+    if (is_rehashing()) rehash_steps(1);
+    size_t hash = hash_key(key);
+    for (const Table& t : ht) {
+        size_t pos = find_pos(t, key, hash);
+        if (pos != SIZE_MAX) return {t.slot(pos), false};
+    }
+    prepare_insert();
+    DictEntry* entry = DictEntry::create(key, std::move(value));
+    insert_entry(is_rehashing() ? ht[1] : ht[0], entry, hash);
+    return {entry, true};
+}
+
+bool Dict::erase(std::string_view key) {
+    if (size() == 0) return false;
+    if (is_rehashing()) rehash_steps(1);
+    size_t hash = hash_key(key);
+    for (Table& t : ht) {
+        size_t pos = find_pos(t, key, hash);
+        if (pos != SIZE_MAX) {
+            erase_at(t, pos);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Dict::clear() {
+    for (Table& t : ht) {
+        for (size_t pos = 0; pos < t.capacity(); ++pos) {
+            if (t.ctrl(pos) < 0) DictEntry::destroy(t.slot(pos));
+        }
+        free(t.groups);
+        t = Table();
+    }
+    rehash_group = NOT_REHASHING;
+}
+
+// Makes room for one more entry in the table inserts go to. A full table is replaced by
+// one twice the size, or by one of the same size when tombstones rather than live
+// entries filled it. Should the new table fill up before the move is over, the move is
+// finished at once.
+void Dict::prepare_insert() {
+    if (is_rehashing()) {
+        if (ht[1].growth_left > 0) return;
+        rehash_steps(SIZE_MAX);
+    }
+    Table& t = ht[0];
+    if (t.group_count == 0) {
+        allocate(t, 1);
+        return;
+    }
+    if (t.growth_left > 0) return;
+    start_resize(t.used * 2 >= max_load(t.capacity()) ? t.group_count * 2 : t.group_count);
+}
+
+void Dict::start_resize(size_t group_count) {
+    allocate(ht[1], group_count);
+    rehash_group = 0;
+}
+
+void Dict::rehash_steps(size_t groups) {
+    if (!is_rehashing()) return;
+    Table& from = ht[0];
+    for (; groups > 0 && rehash_group < from.group_count; --groups, ++rehash_group) {
+        Group& group = from.groups[rehash_group];
+        for (uint32_t m = match_full(group.ctrl); m; m &= m - 1) {
+            unsigned i = __builtin_ctz(m);
+            DictEntry* entry = group.slots[i];
+            insert_entry(ht[1], entry, hash_key(entry->key()));
+            group.ctrl[i] = CTRL_DELETED;
+            group.slots[i] = nullptr;
+            --from.used;
+        }
+    }
+    if (rehash_group < from.group_count) return;
+    free(from.groups);
+    ht[0] = ht[1];
+    ht[1] = Table();
+    rehash_group = NOT_REHASHING;
+}
+
+void Dict::reserve(size_t n) {
+    size_t group_count = 1;
+    while (max_load(group_count * GROUP_WIDTH) < n) group_count *= 2;
+    if (is_rehashing()) rehash_steps(SIZE_MAX);
+    if (group_count <= ht[0].group_count) return;
+    if (ht[0].group_count == 0) {
+        allocate(ht[0], group_count);
+    } else {
+        start_resize(group_count);
+    }
+}
+
+// Shrinks to the smallest table that holds the live entries at half the maximum load, once
+// fewer than one slot in eight is in use.
+void Dict::resize_if_needed() {
+    const Table& t = ht[0];
+    if (is_rehashing() || t.group_count <= 1 || t.used >= t.capacity() / 8) return;
+    size_t group_count = 1;
+    while (max_load(group_count * GROUP_WIDTH) < t.used * 2) group_count *= 2;
+    if (group_count < t.group_count) start_resize(group_count);
+}
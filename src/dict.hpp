@@ -0,0 +1,136 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include "object.hpp"
+
+// A key and its value in one allocation: the key's bytes start at key_start and run on
+// past the end of the struct.
+struct DictEntry {
+    RedisObject value;
+    uint32_t key_len;
+    char key_start[4];
+
+    std::string_view key() const { return std::string_view(key_start, key_len); }
+
+    static DictEntry* create(std::string_view key, RedisObject&& value);
+    static void destroy(DictEntry* entry);
+
+private:
+    explicit DictEntry(RedisObject&& value) : value(std::move(value)) {}
+    ~DictEntry() = default;
+};
+
+// Open-addressing hash table for the keyspace, laid out Swiss-table style: slots are
+// grouped sixteen at a time next to one control byte each (empty, deleted, or seven bits
+// of the key's hash), and a lookup compares a whole group's control bytes with one SIMD
+// compare before touching any entry.
+//
+// Growing never rehashes the table at once. A second table is allocated and entries move
+// over a group at a time on every insert and erase, and from the expiry cron, as Redis
+// does with its two-table dict. Lookups check both tables meanwhile. Entries are
+// allocated individually, so a DictEntry* and the key's bytes stay valid until that key
+// is erased.
+//
+// find() and iteration never modify the table and may run concurrently under a shared
+// lock; everything else needs exclusive access.
+class Dict {
+public:
+    static constexpr size_t GROUP_WIDTH = 16;
+
+    template <bool Const>
+    class Iterator {
+    public:
+        using Reference = std::conditional_t<Const, const DictEntry&, DictEntry&>;
+        using DictRef = std::conditional_t<Const, const Dict*, Dict*>;
+
+        Iterator(DictRef dict, size_t table, size_t pos) : dict(dict), table(table), pos(pos) { skip_free(); }
+        Reference operator*() const { return *dict->ht[table].slot(pos); }
+        auto operator->() const { return &**this; }
+        Iterator& operator++() { ++pos; skip_free(); return *this; }
+        bool operator==(const Iterator& other) const { return table == other.table && pos == other.pos; }
+        bool operator!=(const Iterator& other) const { return !(*this == other); }
+
+    private:
+        friend class Dict;
+        void skip_free() {
+            for (; table < 2; ++table, pos = 0) {
+                const Table& t = dict->ht[table];
+                for (; pos < t.capacity(); ++pos) {
+                    if (t.ctrl(pos) < 0) return;
+                }
+            }
+            pos = 0;
+        }
+
+        DictRef dict;
+        size_t table;
+        size_t pos;
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    Dict() = default;
+    ~Dict();
+    Dict(const Dict&) = delete;
+    Dict& operator=(const Dict&) = delete;
+
+    size_t size() const { return ht[0].used + ht[1].used; }
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return ht[0].capacity() + ht[1].capacity(); }
+    bool is_rehashing() const { return rehash_group != NOT_REHASHING; }
+
+    DictEntry* find(std::string_view key) const;
+    // Inserts key with value unless the key exists; value is only moved from on insert.
+    std::pair<DictEntry*, bool> try_emplace(std::string_view key, RedisObject&& value);
+    bool erase(std::string_view key);
+    void clear();
+    // Sizes the table for n entries, so inserting that many never has to grow it.
+    void reserve(size_t n);
+
+    // Moves up to `groups` groups of the old table into the new one.
+    void rehash_steps(size_t groups);
+    // Starts shrinking a table that is mostly empty after deletions.
+    void resize_if_needed();
+
+    iterator begin() { return iterator(this, 0, 0); }
+    iterator end() { return iterator(this, 2, 0); }
+    const_iterator begin() const { return const_iterator(this, 0, 0); }
+    const_iterator end() const { return const_iterator(this, 2, 0); }
+
+private:
+    static constexpr size_t NOT_REHASHING = SIZE_MAX;
+
+    // Allocated with calloc: glibc's 16-byte alignment suits the SSE2 group loads.
+    struct alignas(16) Group {
+        int8_t ctrl[GROUP_WIDTH];
+        DictEntry* slots[GROUP_WIDTH];
+    };
+
+    struct Table {
+        Group* groups = nullptr;
+        size_t group_count = 0;         // zero or a power of two
+        size_t used = 0;
+        size_t growth_left = 0;         // inserts into empty slots left before the table is too full
+
+        size_t capacity() const { return group_count * GROUP_WIDTH; }
+        int8_t ctrl(size_t pos) const { return groups[pos / GROUP_WIDTH].ctrl[pos % GROUP_WIDTH]; }
+        DictEntry* slot(size_t pos) const { return groups[pos / GROUP_WIDTH].slots[pos % GROUP_WIDTH]; }
+    };
+
+    static size_t hash_key(std::string_view key);
+    static void allocate(Table& t, size_t group_count);
+    static size_t find_pos(const Table& t, std::string_view key, size_t hash);
+    static void insert_entry(Table& t, DictEntry* entry, size_t hash);
+    static void erase_at(Table& t, size_t pos);
+
+    void prepare_insert();
+    void start_resize(size_t group_count);
+
+    Table ht[2];
+    size_t rehash_group = NOT_REHASHING;    // next group of ht[0] to move into ht[1]
+};
@@ -0,0 +1,681 @@
+#include "event_loop.hpp"
+#include "aof.hpp"
+#include "commands.hpp"
+#include "storage.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+EventLoopBackend event_loop_backend = EventLoopBackend::Epoll;
+int io_threads = 0;
+
+static const size_t QUERY_READ_CHUNK = 16 * 1024;
+static const size_t QUERY_BUFFER_LIMIT = 1024UL * 1024 * 1024;
+static const size_t REPLY_CHUNK_BYTES = 16 * 1024;
+static const int MAX_WRITE_IOV = 64;
+
+OutputBufferLimits client_output_buffer_limits = { 256UL * 1024 * 1024, 64UL * 1024 * 1024, 60 };
+
+static std::vector<std::unique_ptr<Reactor>> reactors;
+static thread_local Reactor* current_reactor = nullptr;
+
+// Which reactor owns each fd, so replies produced on other threads can be routed to it.
+static std::unique_ptr<std::atomic<Reactor*>[]> fd_owners;
+static size_t fd_owner_count = 0;
+// The id of the connection on each fd, read by its own reactor only.
+static std::unique_ptr<uint64_t[]> fd_connection_ids;
+static std::atomic<uint64_t> next_connection_id{1};
+
+void OutputBuffer::append(std::string_view reply) {
+    if (reply.empty()) return;
+    if (reply.size() >= REPLY_CHUNK_BYTES) {
+        chunks.emplace_back(reply);
+    } else {
+        if (chunks.empty() || chunks.back().size() + reply.size() > REPLY_CHUNK_BYTES) {
+            chunks.emplace_back();
+            chunks.back().reserve(REPLY_CHUNK_BYTES);
+        }
+        chunks.back().append(reply);
+    }
+    bytes += reply.size();
+}
+
+void OutputBuffer::append(std::string&& reply) {
+    if (reply.size() < REPLY_CHUNK_BYTES) {
+        append(std::string_view(reply));
+        return;
+    }
+    bytes += reply.size();
+    chunks.push_back(std::move(reply));
+}
+
+int OutputBuffer::fill_iov(iovec* iov, int max_iov) const {
+    int count = 0;
+    size_t offset = sent;
+    for (auto it = chunks.begin(); it != chunks.end() && count < max_iov; ++it) {
+        if (it->size() > offset) {
+            iov[count].iov_base = const_cast<char*>(it->data() + offset);
+            iov[count].iov_len = it->size() - offset;
+            count++;
+        }
+        offset = 0;
+    }
+    return count;
+}
+
+// Drops n written bytes. The last small chunk is kept once drained so a steady
+// request/reply client reuses the same allocation.
+void OutputBuffer::consume(size_t n) {
+    bytes -= n;
+    while (n > 0) {
+        size_t left = chunks.front().size() - sent;
+        if (n < left) {
+            sent += n;
+            return;
+        }
+        n -= left;
+        sent = 0;
+        if (chunks.size() == 1 && chunks.front().capacity() <= REPLY_CHUNK_BYTES) {
+            chunks.front().clear();
+        } else {
+            chunks.pop_front();
+        }
+    }
+}
+
+uint64_t connection_id(int fd) {
+    return fd_connection_ids[fd];
+}
+
+TransactionState& client_transaction(int fd) {
+    return current_reactor->find_connection(fd)->transaction;
+}
+
+// Replies from the reactor that owns fd are buffered directly; any other thread posts
+// them to the owner's mailbox. Returns false when fd is not a connected client.
+bool send_response(int fd, uint64_t connection_id, std::string response) {
+    if (fd < 0 || static_cast<size_t>(fd) >= fd_owner_count) return false;
+    Reactor* owner = fd_owners[fd].load(std::memory_order_acquire);
+    if (!owner) return false;
+
+    if (owner == current_reactor) {
+        Connection* conn = owner->find_connection(fd);
+        if (!conn || conn->id != connection_id) return false;
+        owner->queue_reply(*conn, std::move(response));
+    } else {
+        owner->post_reply(fd, connection_id, std::move(response));
+    }
+    return true;
+}
+
+bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+int create_listener(int port, bool reuse_port) {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        std::cerr << "Failed to create server socket\n";
+        return -1;
+    }
+
+    int reuse = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+        std::cerr << "setsockopt failed\n";
+        close(server_fd);
+        return -1;
+    }
+#ifdef SO_REUSEPORT
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        std::cerr << "setsockopt(SO_REUSEPORT) failed\n";
+        close(server_fd);
+        return -1;
+    }
+#endif
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(server_fd, (sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
+        std::cerr << "Failed to bind to port " << port << "\n";
+        close(server_fd);
+        return -1;
+    }
+    if (listen(server_fd, 511) != 0) {
+        std::cerr << "listen failed\n";
+        close(server_fd);
+        return -1;
+    }
+    if (!set_nonblocking(server_fd)) {
+        std::cerr << "Failed to make server socket non-blocking\n";
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+Reactor::Reactor(int index, int listen_fd) : index(index), listen_fd(listen_fd) {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+Reactor::~Reactor() {
+    if (wake_fd >= 0) close(wake_fd);
+}
+
+Connection* Reactor::add_connection(int fd) {
+    if (static_cast<size_t>(fd) >= connections.size()) {
+        connections.resize(static_cast<size_t>(fd) * 2 + 1);
+    }
+    uint64_t id = next_connection_id.fetch_add(1, std::memory_order_relaxed);
+    connections[fd] = std::make_unique<Connection>(fd, id);
+    fd_connection_ids[fd] = id;
+    fd_owners[fd].store(this, std::memory_order_release);
+    return connections[fd].get();
+}
+
+Connection* Reactor::find_connection(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= connections.size()) return nullptr;
+    return connections[fd].get();
+}
+
+TimerId Reactor::add_timer(TimerWheel::Clock::time_point when, TimerWheel::Callback callback) {
+    return timers.add(when, std::move(callback));
+}
+
+void Reactor::close_connection(int fd) {
+    std::cout << "Client disconnected: FD " << fd << std::endl;
+    timers.cancel(connections[fd]->block_timer);
+    remove_blocked_client_fd(fd);
+    fd_owners[fd].store(nullptr, std::memory_order_release);
+    unwatch(fd);
+    close(fd);
+    connections[fd].reset();
+}
+
+// Client sockets are registered once for both directions. With edge triggering
+// EPOLLOUT only fires after a write has hit EAGAIN, so leaving it armed costs nothing
+// and saves an epoll_ctl per blocked write.
+bool Reactor::watch(int fd) {
+    if (event_loop_backend == EventLoopBackend::Epoll) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+    if (static_cast<size_t>(fd) >= poll_index.size()) {
+        poll_index.resize(static_cast<size_t>(fd) * 2 + 1, -1);
+    }
+    poll_index[fd] = static_cast<int>(poll_fds.size());
+    poll_fds.push_back({ fd, POLLIN, 0 });
+    return true;
+}
+
+void Reactor::unwatch(int fd) {
+    if (event_loop_backend != EventLoopBackend::Poll) return;
+    if (static_cast<size_t>(fd) >= poll_index.size() || poll_index[fd] < 0) return;
+    size_t i = static_cast<size_t>(poll_index[fd]);
+    poll_index[poll_fds.back().fd] = static_cast<int>(i);
+    poll_fds[i] = poll_fds.back();
+    poll_fds.pop_back();
+    poll_index[fd] = -1;
+}
+
+void Reactor::set_write_interest(Connection& conn, bool on) {
+    if (conn.want_write == on) return;
+    conn.want_write = on;
+    if (event_loop_backend == EventLoopBackend::Poll && poll_index[conn.fd] >= 0) {
+        poll_fds[poll_index[conn.fd]].events = on ? (POLLIN | POLLOUT) : POLLIN;
+    }
+}
+
+// Accepts every pending connection; the listener is non-blocking so this stops at EAGAIN.
+void Reactor::accept_clients() {
+    while (true) {
+        sockaddr_in client_addr{};
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept(listen_fd, (sockaddr*)&client_addr, &client_len);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "accept failed: " << strerror(errno) << "\n";
+            }
+            return;
+        }
+        if (static_cast<size_t>(client_fd) >= fd_owner_count || !set_nonblocking(client_fd)) {
+            close(client_fd);
+            continue;
+        }
+        int nodelay = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        std::cout << "New client connected: FD " << client_fd << " (reactor " << index << ")" << std::endl;
+        add_connection(client_fd);
+        if (!watch(client_fd)) close_connection(client_fd);
+    }
+}
+
+// Drains the socket until EAGAIN, as edge-triggered readiness requires, appending to the
+// connection's query buffer and running every complete command after each read. Input
+// from a blocked client is buffered but not executed until it is unblocked. Returns
+// false once the connection has been closed.
+bool Reactor::read_from_client(Connection& conn) {
+    int fd = conn.fd;
+    while (true) {
+        // Make room for the rest of a large bulk string in one go instead of doubling.
+        size_t want = std::max(QUERY_READ_CHUNK, conn.parser.pending_bulk_bytes(conn.query_len));
+        if (conn.querybuf.size() - conn.query_len < want) {
+            conn.querybuf.resize(conn.query_len + want);
+        }
+
+        ssize_t n = recv(fd, conn.querybuf.data() + conn.query_len, conn.querybuf.size() - conn.query_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n <= 0) {
+            close_connection(fd);
+            return false;
+        }
+        conn.query_len += static_cast<size_t>(n);
+        if (conn.query_len > QUERY_BUFFER_LIMIT) {
+            std::cerr << "Closing client FD " << fd << ": query buffer limit reached\n";
+            close_connection(fd);
+            return false;
+        }
+        if (!process_input(conn)) return false;
+    }
+}
+
+// Writes as much pending output as the socket takes, up to MAX_WRITE_IOV chunks per
+// writev. Returns false once the connection has been closed.
+bool Reactor::write_to_client(Connection& conn) {
+    // Every reply leaves through here, so none goes out before the commands it reports on
+    // are in the AOF.
+    aof_flush();
+    int fd = conn.fd;
+    while (!conn.reply.empty()) {
+        iovec iov[MAX_WRITE_IOV];
+        int count = conn.reply.fill_iov(iov, MAX_WRITE_IOV);
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_write_interest(conn, true);
+            return true;
+        }
+        if (n < 0) {
+            close_connection(fd);
+            return false;
+        }
+        conn.reply.consume(static_cast<size_t>(n));
+    }
+    set_write_interest(conn, false);
+    conn.soft_limit_since = {};
+    return true;
+}
+
+static bool output_limit_reached(Connection& conn) {
+    const OutputBufferLimits& limits = client_output_buffer_limits;
+    size_t pending = conn.reply.pending();
+    if (limits.hard_bytes && pending > limits.hard_bytes) return true;
+    if (!limits.soft_bytes || pending <= limits.soft_bytes) {
+        conn.soft_limit_since = {};
+        return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (conn.soft_limit_since == std::chrono::steady_clock::time_point{}) {
+        conn.soft_limit_since = now;
+        return false;
+    }
+    return now - conn.soft_limit_since >= std::chrono::seconds(limits.soft_seconds);
+}
+
+// Buffers a reply for conn and schedules the connection for the next flush. A client
+// that has fallen too far behind is marked for closing instead of growing without bound.
+void Reactor::queue_reply(Connection& conn, std::string&& reply) {
+    if (conn.close_asap) return;
+    conn.reply.append(std::move(reply));
+    if (!conn.pending_write) {
+        conn.pending_write = true;
+        pending_writes.push_back(conn.fd);
+    }
+    if (output_limit_reached(conn)) {
+        std::cerr << "Closing client FD " << conn.fd << ": output buffer limit reached ("
+                  << conn.reply.pending() << " bytes pending)\n";
+        conn.close_asap = true;
+    }
+}
+
+// Thread-safe: used for replies produced outside this reactor, e.g. a BLPOP served by a
+// push on another I/O thread.
+void Reactor::post_reply(int fd, uint64_t connection_id, std::string&& reply) {
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lk(mailbox_mutex);
+        was_empty = mailbox.empty();
+        mailbox.push_back({fd, connection_id, std::move(reply)});
+    }
+    if (was_empty) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void Reactor::drain_mailbox() {
+    {
+        std::lock_guard<std::mutex> lk(mailbox_mutex);
+        if (mailbox.empty()) return;
+        mailbox.swap(mailbox_drained);
+    }
+    for (MailboxEntry& entry : mailbox_drained) {
+        Connection* conn = find_connection(entry.fd);
+        if (conn && conn->id == entry.connection_id) queue_reply(*conn, std::move(entry.reply));
+    }
+    mailbox_drained.clear();
+}
+
+void Reactor::handle_pending_writes() {
+    for (int fd : pending_writes) {
+        Connection* conn = find_connection(fd);
+        if (!conn || !conn->pending_write) continue;
+        conn->pending_write = false;
+        if (conn->close_asap) {
+            close_connection(fd);
+            continue;
+        }
+        write_to_client(*conn);
+    }
+    pending_writes.clear();
+}
+
+// Runs once per loop iteration, right before waiting for events: fires due timers,
+// serves clients blocked on keys pushed to during the iteration, resumes unblocked
+// clients, takes in replies from other threads and flushes every client with output.
+// Replies to the iteration's commands are flushed before the blocked clients are served,
+// so a producer never waits on its consumers.
+//
+// Whoever unblocks a client posts its reply and unblocks it in one critical section
+// under blocked_mutex. Draining the mailbox before collecting resumable clients means
+// every client resumed here was unblocked by a post that has already been drained, so
+// nothing is missed; draining once more after collecting them takes in the replies of
+// clients unblocked in between, so a reply always precedes the replies to the commands
+// pipelined behind its blocking one. A post that misses the second drain was made to an
+// empty mailbox and has signalled wake_fd.
+void Reactor::before_sleep() {
+    timers.advance(TimerWheel::Clock::now());
+    if (has_ready_keys()) {
+        handle_pending_writes();
+        handle_clients_blocked_on_keys();
+    }
+    drain_mailbox();
+    std::vector<int> resumable = take_resumable_fds();
+    if (!resumable.empty()) drain_mailbox();
+    for (int fd : resumable) {
+        if (Connection* conn = find_connection(fd)) process_input(*conn);
+    }
+    handle_pending_writes();
+}
+
+// Runs every complete command in the query buffer, in order, and keeps a trailing
+// partial command for the next read. Stops early when a command blocks the client.
+bool Reactor::process_input(Connection& conn) {
+    int fd = conn.fd;
+    size_t pos = 0;
+    while (!conn.deferred && !conn.close_asap && pos < conn.query_len) {
+        const char* cmd = conn.querybuf.data() + pos;
+        ParseStatus st = conn.parser.parse(cmd, conn.query_len - pos);
+        if (st == ParseStatus::Incomplete) break;
+        if (st == ParseStatus::Error) {
+            queue_reply(conn, "-ERR Protocol error: " + conn.parser.error + "\r\n");
+            if (write_to_client(conn)) close_connection(fd);
+            return false;
+        }
+
+        conn.parser.fill_args(cmd, conn.args);
+        pos += conn.parser.command_length();
+        conn.parser.reset();
+        if (conn.args.empty()) continue;
+
+        std::string res = dispatch(conn.args, fd);
+        if (!res.empty()) {
+            queue_reply(conn, std::move(res));
+        } else if (is_client_blocked(fd)) {
+            conn.deferred = true;
+            deferred_fds.push_back(fd);
+            TimePoint deadline = blocked_client_deadline(fd);
+            if (deadline != TimePoint::max()) {
+                conn.block_timer = timers.add(deadline, [fd] { timeout_blocked_client(fd); });
+            }
+        }
+    }
+
+    if (pos > 0) {
+        memmove(conn.querybuf.data(), conn.querybuf.data() + pos, conn.query_len - pos);
+        conn.query_len -= pos;
+    }
+    return true;
+}
+
+// Collects the deferred connections whose BLPOP or XREAD has since been served or timed out.
+std::vector<int> Reactor::take_resumable_fds() {
+    std::vector<int> resumable;
+    if (deferred_fds.empty()) return resumable;
+
+    std::lock_guard<std::mutex> lk(blocked_mutex);
+    for (size_t i = 0; i < deferred_fds.size();) {
+        int fd = deferred_fds[i];
+        Connection* conn = find_connection(fd);
+        if (!conn || !client_is_blocked(fd)) {
+            if (conn) {
+                conn->deferred = false;
+                timers.cancel(conn->block_timer);
+                conn->block_timer = 0;
+                resumable.push_back(fd);
+            }
+            deferred_fds[i] = deferred_fds.back();
+            deferred_fds.pop_back();
+        } else {
+            ++i;
+        }
+    }
+    return resumable;
+}
+
+// Sleeps until the next timer is due. Blocked clients need no polling: whoever unblocks
+// one posts its reply, which wakes the reactor, and timeouts are timers of their own.
+int Reactor::loop_timeout_ms() const {
+    // A resumed client may have pushed to a key others are blocked on.
+    if (has_ready_keys()) return 0;
+    return timers.next_timeout_ms(TimerWheel::Clock::now());
+}
+
+int Reactor::run_epoll() {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        std::cerr << "epoll_create1 failed\n";
+        return 1;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+        std::cerr << "epoll_ctl failed for server socket\n";
+        close(epfd);
+        return 1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev) != 0) {
+        std::cerr << "epoll_ctl failed for wakeup eventfd\n";
+        close(epfd);
+        return 1;
+    }
+
+    std::vector<epoll_event> events(1024);
+    while (true) {
+        before_sleep();
+        int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), loop_timeout_ms());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "epoll_wait failed\n";
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                accept_clients();
+                continue;
+            }
+            if (fd == wake_fd) {
+                uint64_t count;
+                ssize_t ignored = read(wake_fd, &count, sizeof(count));
+                (void)ignored;
+                continue;
+            }
+
+            Connection* conn = find_connection(fd);
+            if (!conn) continue;
+            uint32_t what = events[i].events;
+            if ((what & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !read_from_client(*conn)) continue;
+            if ((what & EPOLLOUT) && conn->want_write) write_to_client(*conn);
+        }
+    }
+
+    close(epfd);
+    return 1;
+}
+
+int Reactor::run_poll() {
+    poll_fds.push_back({ listen_fd, POLLIN, 0 });
+    poll_fds.push_back({ wake_fd, POLLIN, 0 });
+    const size_t first_client = poll_fds.size();
+
+    while (true) {
+        before_sleep();
+        int rc = poll(poll_fds.data(), poll_fds.size(), loop_timeout_ms());
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Poll failed\n";
+            break;
+        }
+
+        if (poll_fds[1].revents & POLLIN) {
+            uint64_t count;
+            ssize_t ignored = read(wake_fd, &count, sizeof(count));
+            (void)ignored;
+        }
+        if (poll_fds[0].revents & POLLIN) {
+            accept_clients();
+        }
+
+        // Walk backwards so the swap-remove of a closed fd only moves an entry already visited.
+        for (size_t i = poll_fds.size(); i-- > first_client;) {
+            if (i >= poll_fds.size()) continue;
+            short what = poll_fds[i].revents;
+            if (!what) continue;
+            int fd = poll_fds[i].fd;
+            Connection* conn = find_connection(fd);
+            if (!conn) {
+                unwatch(fd);
+                continue;
+            }
+            if ((what & (POLLIN | POLLHUP | POLLERR)) && !read_from_client(*conn)) continue;
+            if ((what & POLLOUT) && conn->want_write) write_to_client(*conn);
+        }
+    }
+
+    for (size_t i = first_client; i < poll_fds.size(); ++i) {
+        close(poll_fds[i].fd);
+    }
+    return 1;
+}
+
+int Reactor::run() {
+    if (wake_fd < 0) {
+        std::cerr << "eventfd failed\n";
+        return 1;
+    }
+    current_reactor = this;
+    return event_loop_backend == EventLoopBackend::Epoll ? run_epoll() : run_poll();
+}
+
+// The server cron reschedules itself after every round, at whatever interval the round
+// asked for.
+static void schedule_expire_cron(Reactor& reactor, TimerWheel::Clock::time_point when) {
+    reactor.add_timer(when, [&reactor] {
+        auto next = TimerWheel::Clock::now() + expire_cron();
+        schedule_expire_cron(reactor, next);
+    });
+}
+
+// Starts io_threads reactors (one per core by default) and runs the first on the calling
+// thread. With SO_REUSEPORT every reactor gets its own listener and the kernel spreads
+// incoming connections across them; otherwise they all accept from one shared socket.
+int run_reactors(int port) {
+    int count = io_threads;
+    if (count <= 0) count = static_cast<int>(std::thread::hardware_concurrency());
+    if (count <= 0) count = 1;
+
+#ifdef SO_REUSEPORT
+    const bool reuse_port = true;
+#else
+    const bool reuse_port = false;
+#endif
+
+    // A client that disconnects mid-reply must surface as EPIPE, not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    rlimit nofile{};
+    fd_owner_count = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY) {
+        fd_owner_count = std::min<size_t>(nofile.rlim_cur, 1 << 20);
+    }
+    fd_owners.reset(new std::atomic<Reactor*>[fd_owner_count]);
+    fd_connection_ids.reset(new uint64_t[fd_owner_count]());
+    for (size_t i = 0; i < fd_owner_count; ++i) fd_owners[i].store(nullptr, std::memory_order_relaxed);
+
+    std::vector<int> listeners;
+    for (int i = 0; i < count; ++i) {
+        if (i > 0 && !reuse_port) {
+            listeners.push_back(listeners[0]);
+            continue;
+        }
+        int fd = create_listener(port, reuse_port);
+        if (fd < 0) {
+            for (int l : listeners) close(l);
+            return 1;
+        }
+        listeners.push_back(fd);
+    }
+
+    std::cout << "Starting " << count << " I/O thread(s) on port " << port << std::endl;
+
+    for (int i = 0; i < count; ++i) {
+        reactors.push_back(std::make_unique<Reactor>(i, listeners[i]));
+    }
+    schedule_expire_cron(*reactors[0], TimerWheel::Clock::now());
+    for (int i = 1; i < count; ++i) {
+        std::thread([r = reactors[i].get()]() { r->run(); }).detach();
+    }
+    return reactors[0]->run();
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <poll.h>
+#include "commands.hpp"
+#include "parser.hpp"
+#include "timer.hpp"
+
+struct iovec;
+
+enum class EventLoopBackend { Epoll, Poll };
+
+extern EventLoopBackend event_loop_backend;
+extern int io_threads;
+
+// Output buffer limits for normal clients: a client is disconnected as soon as its
+// pending replies exceed the hard limit, or once they have stayed above the soft limit
+// for soft_seconds. A limit of 0 disables it.
+struct OutputBufferLimits {
+    size_t hard_bytes;
+    size_t soft_bytes;
+    int soft_seconds;
+};
+
+extern OutputBufferLimits client_output_buffer_limits;
+
+// Replies waiting to be written to a client. Small replies are packed into 16KB chunks;
+// a reply at least that large becomes a chunk of its own, moved in without copying.
+class OutputBuffer {
+public:
+    void append(std::string_view reply);
+    void append(std::string&& reply);
+    size_t pending() const { return bytes; }
+    bool empty() const { return bytes == 0; }
+    int fill_iov(iovec* iov, int max_iov) const;
+    void consume(size_t n);
+
+private:
+    std::deque<std::string> chunks;
+    size_t sent = 0;            // bytes of chunks.front() already written
+    size_t bytes = 0;           // bytes not yet written, across all chunks
+};
+
+struct Connection {
+    int fd;
+    uint64_t id;                // unique for the server's lifetime, unlike fd
+    bool deferred;              // input processing paused while the client is blocked
+    bool pending_write;         // listed in the reactor's pending_writes
+    bool want_write;            // waiting for the socket to become writable
+    bool close_asap;            // output limit exceeded; closed before the next wait
+    std::vector<char> querybuf;
+    size_t query_len;           // bytes of querybuf holding unprocessed input
+    RespParser parser;
+    CommandArgs args;           // arguments of the command being executed
+    OutputBuffer reply;
+    std::chrono::steady_clock::time_point soft_limit_since;
+    TimerId block_timer;        // fires when a blocking command times out
+    TransactionState transaction;
+
+    Connection(int fd, uint64_t id)
+        : fd(fd), id(id), deferred(false), pending_write(false), want_write(false), close_asap(false), query_len(0),
+          block_timer(0) {}
+};
+
+// One event loop per I/O thread. Each reactor owns its listener (or shares one when
+// SO_REUSEPORT is unavailable), its connection table and everything read from or
+// written to those connections; commands run on the reactor that received them.
+//
+// Replies are never written from inside a command: they are appended to the client's
+// output buffer and every client with pending output is flushed with writev right before
+// the reactor waits again, so all replies to one pipelined read leave in a single
+// syscall. Other threads hand replies over through the reactor's mailbox.
+//
+// Blocking timeouts and the server cron run off the reactor's timer wheel, which also
+// bounds how long the loop sleeps; an idle reactor with no timers sleeps until woken.
+class Reactor {
+public:
+    Reactor(int index, int listen_fd);
+    ~Reactor();
+
+    int run();
+    void queue_reply(Connection& conn, std::string&& reply);
+    // The reply is dropped if the connection with this id has closed meanwhile, even when
+    // a new one has been given the same fd.
+    void post_reply(int fd, uint64_t connection_id, std::string&& reply);
+    Connection* find_connection(int fd);
+    // Only from the reactor's own thread, or before it starts running.
+    TimerId add_timer(TimerWheel::Clock::time_point when, TimerWheel::Callback callback);
+
+private:
+    Connection* add_connection(int fd);
+    void close_connection(int fd);
+    bool watch(int fd);
+    void unwatch(int fd);
+    void set_write_interest(Connection& conn, bool on);
+    void accept_clients();
+    bool read_from_client(Connection& conn);
+    bool write_to_client(Connection& conn);
+    bool process_input(Connection& conn);
+    void drain_mailbox();
+    void handle_pending_writes();
+    void before_sleep();
+    std::vector<int> take_resumable_fds();
+    int loop_timeout_ms() const;
+    int run_epoll();
+    int run_poll();
+
+    int index;
+    int listen_fd;
+    int wake_fd;                // eventfd signalled when the mailbox becomes non-empty
+    int epfd = -1;
+    // Connection table indexed by fd, so an event costs one array access instead of a scan.
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::vector<int> deferred_fds;
+    std::vector<int> pending_writes;
+    TimerWheel timers;
+    // poll() backend state: the watched set and each fd's slot in it.
+    std::vector<pollfd> poll_fds;
+    std::vector<int> poll_index;
+
+    struct MailboxEntry {
+        int fd;
+        uint64_t connection_id;
+        std::string reply;
+    };
+    std::mutex mailbox_mutex;
+    std::vector<MailboxEntry> mailbox;
+    std::vector<MailboxEntry> mailbox_drained;
+};
+
+bool set_nonblocking(int fd);
+int create_listener(int port, bool reuse_port);
+int run_reactors(int port);
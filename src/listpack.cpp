@@ -0,0 +1,216 @@
+#include "listpack.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+static constexpr size_t LP_HEADER_SIZE = 8;
+
+static uint32_t read_u32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void write_u32(unsigned char* p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static size_t varint_size(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+// Seven bits per byte, lowest first; the top bit marks that another byte follows.
+static size_t encode_varint(unsigned char* p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = static_cast<unsigned char>(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = static_cast<unsigned char>(v);
+    return n;
+}
+
+static uint64_t decode_varint(const unsigned char* p, size_t& n) {
+    uint64_t v = 0;
+    int shift = 0;
+    n = 0;
+    while (true) {
+        unsigned char b = p[n++];
+        v |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if (!(b & 0x80)) return v;
+        shift += 7;
+    }
+}
+
+// The back length mirrors a varint: its last byte holds the lowest seven bits, and the
+// top bit marks that another byte precedes it.
+static void encode_backlen(unsigned char* p, uint64_t v) {
+    size_t n = varint_size(v);
+    for (size_t i = n; i-- > 0;) {
+        p[i] = static_cast<unsigned char>((v & 0x7F) | (i > 0 ? 0x80 : 0));
+        v >>= 7;
+    }
+}
+
+static uint64_t decode_backlen(const unsigned char* last) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (true) {
+        v |= static_cast<uint64_t>(*last & 0x7F) << shift;
+        if (!(*last & 0x80)) return v;
+        --last;
+        shift += 7;
+    }
+}
+
+static const unsigned char* lp_end(const unsigned char* lp) {
+    return lp + read_u32(lp);
+}
+
+// Size of the entry at p, back length included.
+static size_t entry_size_at(const unsigned char* p) {
+    size_t header;
+    uint64_t len = decode_varint(p, header);
+    return header + len + varint_size(header + len);
+}
+
+static void set_header(unsigned char* lp, size_t bytes, size_t length) {
+    write_u32(lp, static_cast<uint32_t>(bytes));
+    write_u32(lp + 4, static_cast<uint32_t>(length));
+}
+
+static unsigned char* lp_realloc(unsigned char* lp, size_t bytes) {
+    auto* grown = static_cast<unsigned char*>(realloc(lp, bytes));
+    if (!grown) throw std::bad_alloc();
+    return grown;
+}
+
+unsigned char* lp_new() {
+    auto* lp = static_cast<unsigned char*>(malloc(LP_HEADER_SIZE));
+    if (!lp) throw std::bad_alloc();
+    set_header(lp, LP_HEADER_SIZE, 0);
+    return lp;
+}
+
+unsigned char* lp_dup(const unsigned char* lp) {
+    auto* copy = static_cast<unsigned char*>(malloc(lp_bytes(lp)));
+    if (!copy) throw std::bad_alloc();
+    memcpy(copy, lp, lp_bytes(lp));
+    return copy;
+}
+
+void lp_free(unsigned char* lp) {
+    free(lp);
+}
+
+size_t lp_bytes(const unsigned char* lp) {
+    return read_u32(lp);
+}
+
+size_t lp_length(const unsigned char* lp) {
+    return read_u32(lp + 4);
+}
+
+size_t lp_entry_size(size_t value_len) {
+    size_t head = varint_size(value_len) + value_len;
+    return head + varint_size(head);
+}
+
+const unsigned char* lp_first(const unsigned char* lp) {
+    return lp_length(lp) == 0 ? nullptr : lp + LP_HEADER_SIZE;
+}
+
+const unsigned char* lp_next(const unsigned char* lp, const unsigned char* p) {
+    p += entry_size_at(p);
+    return p == lp_end(lp) ? nullptr : p;
+}
+
+// Steps back over the entry that ends right before p, which may also be the end.
+const unsigned char* lp_prev(const unsigned char* lp, const unsigned char* p) {
+    if (p == lp + LP_HEADER_SIZE) return nullptr;
+    uint64_t head = decode_backlen(p - 1);
+    return p - varint_size(head) - head;
+}
+
+const unsigned char* lp_last(const unsigned char* lp) {
+    return lp_length(lp) == 0 ? nullptr : lp_prev(lp, lp_end(lp));
+}
+
+const unsigned char* lp_seek(const unsigned char* lp, long index) {
+    long length = static_cast<long>(lp_length(lp));
+    if (index < 0) index += length;
+    if (index < 0 || index >= length) return nullptr;
+    const unsigned char* p;
+    if (index < length / 2) {
+        p = lp_first(lp);
+        while (index-- > 0) p = lp_next(lp, p);
+    } else {
+        p = lp_last(lp);
+        for (long i = length - 1; i > index; --i) p = lp_prev(lp, p);
+    }
+    return p;
+}
+
+std::string_view lp_get(const unsigned char* p) {
+    size_t header;
+    uint64_t len = decode_varint(p, header);
+    return std::string_view(reinterpret_cast<const char*>(p + header), len);
+}
+
+unsigned char* lp_insert(unsigned char* lp, const unsigned char* p, std::string_view value) {
+    size_t old_bytes = lp_bytes(lp);
+    size_t offset = p ? static_cast<size_t>(p - lp) : old_bytes;
+    size_t size = lp_entry_size(value.size());
+    lp = lp_realloc(lp, old_bytes + size);
+    unsigned char* dst = lp + offset;
+    memmove(dst + size, dst, old_bytes - offset);
+    size_t header = encode_varint(dst, value.size());
+    memcpy(dst + header, value.data(), value.size());
+    encode_backlen(dst + header + value.size(), header + value.size());
+    set_header(lp, old_bytes + size, lp_length(lp) + 1);
+    return lp;
+}
+
+unsigned char* lp_append(unsigned char* lp, std::string_view value) {
+    return lp_insert(lp, nullptr, value);
+}
+
+unsigned char* lp_prepend(unsigned char* lp, std::string_view value) {
+    return lp_insert(lp, lp + LP_HEADER_SIZE, value);
+}
+
+unsigned char* lp_delete(unsigned char* lp, const unsigned char* p, size_t count) {
+    size_t old_bytes = lp_bytes(lp);
+    size_t offset = static_cast<size_t>(p - lp);
+    size_t removed = 0;
+    size_t deleted = 0;
+    for (; deleted < count && offset + removed < old_bytes; ++deleted) {
+        removed += entry_size_at(p + removed);
+    }
+    unsigned char* dst = lp + offset;
+    memmove(dst, dst + removed, old_bytes - offset - removed);
+    set_header(lp, old_bytes - removed, lp_length(lp) - deleted);
+    return lp_realloc(lp, old_bytes - removed);
+}
+
+unsigned char* lp_replace(unsigned char* lp, const unsigned char* p, std::string_view value) {
+    size_t old_bytes = lp_bytes(lp);
+    size_t offset = static_cast<size_t>(p - lp);
+    size_t old_size = entry_size_at(p);
+    size_t size = lp_entry_size(value.size());
+    if (size > old_size) lp = lp_realloc(lp, old_bytes - old_size + size);
+    unsigned char* dst = lp + offset;
+    if (size != old_size) memmove(dst + size, dst + old_size, old_bytes - offset - old_size);
+    size_t header = encode_varint(dst, value.size());
+    memcpy(dst + header, value.data(), value.size());
+    encode_backlen(dst + header + value.size(), header + value.size());
+    set_header(lp, old_bytes - old_size + size, lp_length(lp));
+    if (size < old_size) lp = lp_realloc(lp, old_bytes - old_size + size);
+    return lp;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// A listpack packs a sequence of strings into a single allocation, after Redis's format
+// of the same name: an 8-byte header (total bytes, element count) followed by the
+// entries. An entry is the length of its string as a varint, the string's bytes, and the
+// size of those two parts again as a varint written backwards, so the list can be walked
+// from either end. A short element costs its length plus two or three bytes.
+//
+// Functions that change a listpack may reallocate it and return the new pointer; any
+// entry pointer into the old one is invalid afterwards.
+
+unsigned char* lp_new();
+unsigned char* lp_dup(const unsigned char* lp);
+void lp_free(unsigned char* lp);
+
+size_t lp_bytes(const unsigned char* lp);
+size_t lp_length(const unsigned char* lp);
+// Bytes an element of the given size takes inside a listpack.
+size_t lp_entry_size(size_t value_len);
+
+// Entry pointers; nullptr past either end or for an empty listpack.
+const unsigned char* lp_first(const unsigned char* lp);
+const unsigned char* lp_last(const unsigned char* lp);
+const unsigned char* lp_next(const unsigned char* lp, const unsigned char* p);
+const unsigned char* lp_prev(const unsigned char* lp, const unsigned char* p);
+// The entry at index, counting from the end when negative.
+const unsigned char* lp_seek(const unsigned char* lp, long index);
+// Points into the listpack; valid until it is next changed.
+std::string_view lp_get(const unsigned char* p);
+
+// Inserts value before the entry p, or at the end when p is nullptr.
+unsigned char* lp_insert(unsigned char* lp, const unsigned char* p, std::string_view value);
+unsigned char* lp_append(unsigned char* lp, std::string_view value);
+unsigned char* lp_prepend(unsigned char* lp, std::string_view value);
+// Deletes count entries starting at p.
+unsigned char* lp_delete(unsigned char* lp, const unsigned char* p, size_t count = 1);
+// Replaces the string of the entry at p, moving what follows only if its size changes.
+unsigned char* lp_replace(unsigned char* lp, const unsigned char* p, std::string_view value);
@@ -0,0 +1,203 @@
+#include "object.hpp"
+#include "parser.hpp"
+
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <new>
+
+// Refreshed once a second by update_lru_clock() so touching a key never reads the clock.
+static std::atomic<uint32_t> cached_lru_clock{0};
+
+// Payload of an OBJ_ENCODING_RAW string: the length followed by the bytes, in one block.
+struct RawString {
+    size_t len;
+    char data[1];
+};
+
+bool parse_canonical_int(std::string_view s, long long& out) {
+    if (s.empty() || s.size() > IntBuffer().size()) return false;
+    size_t digits = s[0] == '-' ? 1 : 0;
+    if (digits == s.size() || (s[digits] == '0' && (s.size() > digits + 1 || digits == 1))) return false;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && end == s.data() + s.size();
+}
+
+static RawString* raw_string_new(std::string_view value) {
+    auto* raw = static_cast<RawString*>(::operator new(offsetof(RawString, data) + value.size()));
+    raw->len = value.size();
+    memcpy(raw->data, value.data(), value.size());
+    return raw;
+}
+
+RedisObject::RedisObject(ObjectType type, ObjectEncoding encoding, void* ptr)
+    : type(type), encoding(encoding), embedded_len(0), expires(false), lru(lru_clock()), ptr(ptr) {}
+
+RedisObject::RedisObject(RedisObject&& other) noexcept
+    : type(other.type), encoding(other.encoding), embedded_len(other.embedded_len), expires(other.expires),
+      lru(other.lru.load(std::memory_order_relaxed)) {
+    take_payload(other);
+}
+
+RedisObject& RedisObject::operator=(RedisObject&& other) noexcept {
+    if (this != &other) {
+        free_payload();
+        type = other.type;
+        encoding = other.encoding;
+        embedded_len = other.embedded_len;
+        expires = other.expires;
+        lru.store(other.lru.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        take_payload(other);
+    }
+    return *this;
+}
+
+RedisObject::~RedisObject() {
+    free_payload();
+}
+
+void RedisObject::take_payload(RedisObject& other) {
+    if (encoding == OBJ_ENCODING_EMBSTR || encoding == OBJ_ENCODING_INT) {
+        memcpy(embedded, other.embedded, sizeof(embedded));
+    } else {
+        ptr = other.ptr;
+        other.ptr = nullptr;
+    }
+}
+
+void RedisObject::free_payload() {
+    switch (encoding) {
+        case OBJ_ENCODING_EMBSTR:
+        case OBJ_ENCODING_INT: return;
+        case OBJ_ENCODING_RAW: ::operator delete(ptr); break;
+        case OBJ_ENCODING_QUICKLIST: delete static_cast<QuickList*>(ptr); break;
+        case OBJ_ENCODING_LISTPACK: lp_free(listpack()); break;
+        case OBJ_ENCODING_STREAM: delete static_cast<Stream*>(ptr); break;
+    }
+    ptr = nullptr;
+}
+
+std::string_view RedisObject::string_value(IntBuffer& buf) const {
+    if (encoding == OBJ_ENCODING_EMBSTR) return std::string_view(embedded, embedded_len);
+    if (encoding == OBJ_ENCODING_INT) {
+        char* end = std::to_chars(buf.data(), buf.data() + buf.size(), int_value).ptr;
+        return std::string_view(buf.data(), static_cast<size_t>(end - buf.data()));
+    }
+    const auto* raw = static_cast<const RawString*>(ptr);
+    return std::string_view(raw->data, raw->len);
+}
+
+bool RedisObject::get_int(long long& out) const {
+    if (encoding == OBJ_ENCODING_INT) {
+        out = int_value;
+        return true;
+    }
+    IntBuffer unused;
+    return parse_int64(string_value(unused), out);
+}
+
+// Replaces a string object's value, choosing the INT encoding for integers and otherwise
+// the embedded or raw one as the length requires. An overwrite of the same length reuses
+// the raw block.
+void RedisObject::set_string(std::string_view value) {
+    long long number;
+    if (parse_canonical_int(value, number)) {
+        set_int(number);
+        return;
+    }
+    if (value.size() <= OBJ_EMBSTR_MAX) {
+        free_payload();
+        encoding = OBJ_ENCODING_EMBSTR;
+        embedded_len = static_cast<uint8_t>(value.size());
+        memcpy(embedded, value.data(), value.size());
+        return;
+    }
+    if (encoding == OBJ_ENCODING_RAW && static_cast<RawString*>(ptr)->len == value.size()) {
+        memcpy(static_cast<RawString*>(ptr)->data, value.data(), value.size());
+        return;
+    }
+    free_payload();
+    encoding = OBJ_ENCODING_RAW;
+    ptr = raw_string_new(value);
+}
+
+void RedisObject::set_int(long long value) {
+    free_payload();
+    encoding = OBJ_ENCODING_INT;
+    int_value = value;
+}
+
+void RedisObject::touch() {
+    uint32_t now = lru_clock();
+    if (lru.load(std::memory_order_relaxed) != now) lru.store(now, std::memory_order_relaxed);
+}
+
+RedisObject create_string_object(std::string_view value) {
+    RedisObject obj(OBJ_STRING, OBJ_ENCODING_EMBSTR, nullptr);
+    obj.set_string(value);
+    return obj;
+}
+
+RedisObject create_int_object(long long value) {
+    RedisObject obj(OBJ_STRING, OBJ_ENCODING_INT, nullptr);
+    obj.int_value = value;
+    return obj;
+}
+
+RedisObject create_list_object() {
+    return RedisObject(OBJ_LIST, OBJ_ENCODING_LISTPACK, lp_new());
+}
+
+RedisObject create_stream_object() {
+    return RedisObject(OBJ_STREAM, OBJ_ENCODING_STREAM, new Stream());
+}
+
+size_t list_length(const RedisObject& list) {
+    if (list.encoding == OBJ_ENCODING_QUICKLIST) return list.quicklist().size();
+    return lp_length(list.listpack());
+}
+
+// The listpack becomes the first node of the quicklist as it is, without copying.
+void list_push(RedisObject& list, std::string_view value, ListEnd where) {
+    if (list.encoding == OBJ_ENCODING_LISTPACK) {
+        if (QuickList::listpack_has_room(list.listpack(), value.size())) {
+            list.ptr = where == ListEnd::Head ? lp_prepend(list.listpack(), value) : lp_append(list.listpack(), value);
+            return;
+        }
+        list.ptr = new QuickList(list.listpack());
+        list.encoding = OBJ_ENCODING_QUICKLIST;
+    }
+    if (where == ListEnd::Head) {
+        list.quicklist().push_front(value);
+    } else {
+        list.quicklist().push_back(value);
+    }
+}
+
+std::string list_pop(RedisObject& list, ListEnd where) {
+    if (list.encoding == OBJ_ENCODING_QUICKLIST) {
+        return where == ListEnd::Head ? list.quicklist().pop_front() : list.quicklist().pop_back();
+    }
+    const unsigned char* p = where == ListEnd::Head ? lp_first(list.listpack()) : lp_last(list.listpack());
+    std::string value(lp_get(p));
+    list.ptr = lp_delete(list.listpack(), p);
+    return value;
+}
+
+const char* object_type_name(ObjectType type) {
+    switch (type) {
+        case OBJ_STRING: return "string";
+        case OBJ_LIST: return "list";
+        case OBJ_STREAM: return "stream";
+    }
+    return "unknown";
+}
+
+uint32_t lru_clock() {
+    return cached_lru_clock.load(std::memory_order_relaxed);
+}
+
+void update_lru_clock() {
+    auto secs = std::chrono::duration_cast<std::chrono::seconds>(Clock::now().time_since_epoch()).count();
+    cached_lru_clock.store(static_cast<uint32_t>(secs) & LRU_CLOCK_MAX, std::memory_order_relaxed);
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "quicklist.hpp"
+#include "stream.hpp"
+
+using Clock = std::chrono::steady_clock;
+using TimePoint = std::chrono::time_point<Clock>;
+enum ObjectType : uint8_t {
+    OBJ_STRING = 0,
+    OBJ_LIST = 1,
+    OBJ_STREAM = 2,
+};
+
+enum ObjectEncoding : uint8_t {
+    OBJ_ENCODING_RAW = 0,       // string in a separate length-prefixed allocation
+    OBJ_ENCODING_EMBSTR = 1,    // string of up to OBJ_EMBSTR_MAX bytes stored in the object
+    OBJ_ENCODING_QUICKLIST = 2, // QuickList
+    OBJ_ENCODING_STREAM = 3,    // Stream
+    OBJ_ENCODING_INT = 4,       // string that is a canonical 64-bit integer, stored as one
+    OBJ_ENCODING_LISTPACK = 5,  // list small enough for a single listpack
+};
+
+constexpr size_t OBJ_EMBSTR_MAX = 16;
+
+// Room to print an INT-encoded value in decimal.
+using IntBuffer = std::array<char, 20>;
+
+// LRU clock resolution is one second and it wraps after 24 bits, as in Redis.
+constexpr uint32_t LRU_CLOCK_MAX = (1u << 24) - 1;
+
+// A keyspace value. One lookup of the key yields its type and payload. Integers and short
+// strings live inside the object; everything else is a payload pointer owned and freed
+// according to the encoding. A TTL is kept in the shard's expires table, and only keys
+// that have one pay for it.
+struct RedisObject {
+    ObjectType type;
+    ObjectEncoding encoding;
+    uint8_t embedded_len;       // length of an EMBSTR value
+    bool expires;               // the key has an entry in its shard's expires table
+    std::atomic<uint32_t> lru;  // LRU clock of the last access; written under read locks
+    union {
+        void* ptr;
+        long long int_value;
+        char embedded[OBJ_EMBSTR_MAX];
+    };
+
+    RedisObject(ObjectType type, ObjectEncoding encoding, void* ptr);
+    RedisObject(RedisObject&& other) noexcept;
+    RedisObject& operator=(RedisObject&& other) noexcept;
+    RedisObject(const RedisObject&) = delete;
+    RedisObject& operator=(const RedisObject&) = delete;
+    ~RedisObject();
+
+    // The string value; an INT-encoded one is printed into buf.
+    std::string_view string_value(IntBuffer& buf) const;
+    bool get_int(long long& out) const;
+    void set_string(std::string_view value);
+    void set_int(long long value);
+    QuickList& quicklist() const { return *static_cast<QuickList*>(ptr); }
+    unsigned char* listpack() const { return static_cast<unsigned char*>(ptr); }
+    Stream& stream() const { return *static_cast<Stream*>(ptr); }
+
+    void touch();
+
+private:
+    void free_payload();
+    void take_payload(RedisObject& other);
+};
+
+// Accepts only the form an integer prints as (no sign but '-', no leading zeros), so that
+// an INT-encoded value reads back byte for byte.
+bool parse_canonical_int(std::string_view s, long long& out);
+
+RedisObject create_string_object(std::string_view value);
+RedisObject create_int_object(long long value);
+RedisObject create_list_object();
+RedisObject create_stream_object();
+
+// A list starts out as a bare listpack and becomes a quicklist once a push would take it
+// past list_max_listpack_size. These work on either encoding.
+enum class ListEnd { Head, Tail };
+size_t list_length(const RedisObject& list);
+void list_push(RedisObject& list, std::string_view value, ListEnd where);
+// The list must not be empty.
+std::string list_pop(RedisObject& list, ListEnd where);
+
+// Calls fn with each of n elements starting at index start, which must lie in the list.
+template <typename Fn>
+void list_for_range(const RedisObject& list, size_t start, size_t n, Fn&& fn) {
+    if (list.encoding == OBJ_ENCODING_QUICKLIST) {
+        list.quicklist().for_range(start, n, fn);
+        return;
+    }
+    const unsigned char* lp = list.listpack();
+    for (const unsigned char* p = lp_seek(lp, static_cast<long>(start)); n > 0; --n, p = lp_next(lp, p)) {
+        fn(lp_get(p));
+    }
+}
+
+const char* object_type_name(ObjectType type);
+
+uint32_t lru_clock();
+void update_lru_clock();
@@ -1,71 +1,181 @@
 #include "parser.hpp"
 #include <cctype>
+#include <cstring>
+#include <cstdio>
+#include <charconv>
 
 std::string to_lower(std::string s) {
     for (auto &c : s) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
     return s;
 }
 
-std::string parse_bulk_string(const char* resp, size_t& pos) {
-    if (resp[pos] != '$') return "";
-    pos++;
-    long long length = 0;
-    bool neg = false;
-    if (resp[pos] == '-') { neg = true; pos++; }
-    while (resp[pos] >= '0' && resp[pos] <= '9') {
-        length = length * 10 + (resp[pos++] - '0');
+bool equals_ignore_case(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) {
+            return false;
+        }
     }
-    if (neg) length = -length;
+    return true;
+}
 
-    if (resp[pos] != '\r' || resp[pos + 1] != '\n') return "";
-    pos += 2;
+bool parse_int64(std::string_view s, long long& out) {
+    if (s.empty()) return false;
+    const char* first = s.data();
+    if (*first == '+' && s.size() > 1 && s[1] != '-') first++;
+    auto [ptr, ec] = std::from_chars(first, s.data() + s.size(), out);
+    return ec == std::errc() && ptr == s.data() + s.size();
+}
 
-    if (length == -1) return ""; 
+bool parse_double(std::string_view s, double& out) {
+    if (s.empty()) return false;
+    auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && ptr == s.data() + s.size();
+}
 
-    std::string result(&resp[pos], static_cast<size_t>(length));
-    pos += static_cast<size_t>(length);
+std::string resp_bulk_string(std::string_view s) {
+    char header[24];
+    int n = snprintf(header, sizeof(header), "$%zu\r\n", s.size());
+    std::string out;
+    out.reserve(static_cast<size_t>(n) + s.size() + 2);
+    out.append(header, static_cast<size_t>(n));
+    out.append(s.data(), s.size());
+    out.append("\r\n", 2);
+    return out;
+}
 
-    if (resp[pos] != '\r' || resp[pos + 1] != '\n') return "";
-    pos += 2;
-    return result;
+std::string resp_array(const std::vector<std::string>& elems) {
+    std::string out = "*" + std::to_string(elems.size()) + "\r\n";
+    for (const auto& e : elems) {
+        out += resp_bulk_string(e);
+    }
+    return out;
 }
 
-std::vector<std::string> parse_resp_array(const char* resp) {
-    size_t pos = 0;
-    if (resp[pos] != '*') return {};
-    pos++;
-    long long count = 0;
+
+static const long long RESP_MAX_MULTIBULK = 1024 * 1024;
+static const long long RESP_MAX_BULK = 512LL * 1024 * 1024;
+static const size_t RESP_MAX_INLINE = 64 * 1024;
+
+// Reads the integer of a "*<n>\r\n" / "$<n>\r\n" header starting at buf[pos].
+// Returns Incomplete until the whole line is buffered.
+static ParseStatus parse_header_int(const char* buf, size_t len, size_t pos, long long& value, size_t& next) {
+    const char* cr = static_cast<const char*>(memchr(buf + pos, '\r', len - pos));
+    if (!cr || static_cast<size_t>(cr - buf) + 1 >= len) {
+        return len - pos > 32 ? ParseStatus::Error : ParseStatus::Incomplete;
+    }
+    size_t end = static_cast<size_t>(cr - buf);
+    if (buf[end + 1] != '\n' || end == pos + 1) return ParseStatus::Error;
+
+    size_t p = pos + 1;
     bool neg = false;
-    if (resp[pos] == '-') { neg = true; pos++; }
-    while (resp[pos] >= '0' && resp[pos] <= '9') {
-        count = count * 10 + (resp[pos++] - '0');
+    if (buf[p] == '-') { neg = true; p++; }
+    if (p == end) return ParseStatus::Error;
+    long long v = 0;
+    for (; p < end; ++p) {
+        if (buf[p] < '0' || buf[p] > '9' || v > RESP_MAX_BULK) return ParseStatus::Error;
+        v = v * 10 + (buf[p] - '0');
     }
-    if (neg) count = -count;
+    value = neg ? -v : v;
+    next = end + 2;
+    return ParseStatus::Complete;
+}
 
-    if (resp[pos] != '\r' || resp[pos + 1] != '\n') return {};
-    pos += 2;
+ParseStatus RespParser::parse(const char* buf, size_t len) {
+    if (args_left < 0) {
+        if (len == 0) return ParseStatus::Incomplete;
 
-    if (count <= 0) return {};
+        if (buf[0] != '*') {
+            const char* nl = static_cast<const char*>(memchr(buf + scan, '\n', len - scan));
+            if (!nl) {
+                scan = len;
+                if (len > RESP_MAX_INLINE) {
+                    error = "too big inline request";
+                    return ParseStatus::Error;
+                }
+                return ParseStatus::Incomplete;
+            }
+            inline_command = true;
+            args_left = 0;
+            scan = static_cast<size_t>(nl - buf) + 1;
 
-    std::vector<std::string> parts;
-    parts.reserve(static_cast<size_t>(count));
-    for (long long i = 0; i < count; i++) {
-        std::string bulk = parse_bulk_string(resp, pos);
-        if (bulk.empty()) return {};
-        parts.push_back(bulk);
+            size_t end = scan - 1;
+            if (end > 0 && buf[end - 1] == '\r') end--;
+            for (size_t p = 0; p < end;) {
+                while (p < end && (buf[p] == ' ' || buf[p] == '\t')) p++;
+                size_t start = p;
+                while (p < end && buf[p] != ' ' && buf[p] != '\t') p++;
+                if (p > start) spans.push_back({start, p - start});
+            }
+            argc = spans.size();
+            return ParseStatus::Complete;
+        }
+
+        long long count = 0;
+        size_t next = 0;
+        ParseStatus st = parse_header_int(buf, len, 0, count, next);
+        if (st == ParseStatus::Incomplete) return st;
+        if (st == ParseStatus::Error || count > RESP_MAX_MULTIBULK) {
+            error = "invalid multibulk length";
+            return ParseStatus::Error;
+        }
+        scan = next;
+        args_left = count > 0 ? count : 0;
+        argc = static_cast<size_t>(args_left);
     }
-    return parts;
-}
 
+    while (args_left > 0) {
+        if (bulk_len < 0) {
+            if (scan >= len) return ParseStatus::Incomplete;
+            if (buf[scan] != '$') {
+                error = std::string("expected '$', got '") + buf[scan] + "'";
+                return ParseStatus::Error;
+            }
+            long long n = 0;
+            size_t next = 0;
+            ParseStatus st = parse_header_int(buf, len, scan, n, next);
+            if (st == ParseStatus::Incomplete) return st;
+            if (st == ParseStatus::Error || n < 0 || n > RESP_MAX_BULK) {
+                error = "invalid bulk length";
+                return ParseStatus::Error;
+            }
+            bulk_len = n;
+            scan = next;
+        }
 
-std::string resp_bulk_string(const std::string& s) {
-    return "$" + std::to_string(s.size()) + "\r\n" + s + "\r\n";
+        size_t need = static_cast<size_t>(bulk_len) + 2;
+        if (len - scan < need) return ParseStatus::Incomplete;
+        if (buf[scan + bulk_len] != '\r' || buf[scan + bulk_len + 1] != '\n') {
+            error = "bulk string not terminated by CRLF";
+            return ParseStatus::Error;
+        }
+        spans.push_back({scan, static_cast<size_t>(bulk_len)});
+        scan += need;
+        bulk_len = -1;
+        args_left--;
+    }
+    return ParseStatus::Complete;
 }
 
-std::string resp_array(const std::vector<std::string>& elems) {
-    std::string out = "*" + std::to_string(elems.size()) + "\r\n";
-    for (const auto& e : elems) {
-        out += resp_bulk_string(e);
+size_t RespParser::pending_bulk_bytes(size_t len) const {
+    if (bulk_len < 0) return 0;
+    size_t need = scan + static_cast<size_t>(bulk_len) + 2;
+    return need > len ? need - len : 0;
+}
+
+void RespParser::fill_args(const char* buf, CommandArgs& args) const {
+    args.clear();
+    for (const auto& [offset, len] : spans) {
+        args.push_back(std::string_view(buf + offset, len));
     }
-    return out;
+}
+
+void RespParser::reset() {
+    spans.clear();
+    scan = 0;
+    args_left = -1;
+    bulk_len = -1;
+    argc = 0;
+    inline_command = false;
+    error.clear();
 }
@@ -1,10 +1,76 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
+#include <cstddef>
 
-std::string parse_bulk_string(const char* resp, size_t& pos);
-std::vector<std::string> parse_resp_array(const char* resp);
-std::string resp_bulk_string(const std::string& s);
+// Vector that keeps its first N elements inline; only longer sequences touch the heap.
+template <typename T, size_t N>
+class SmallVector {
+public:
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* data() const { return count <= N ? inline_items : heap.data(); }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + count; }
+    const T& operator[](size_t i) const { return data()[i]; }
+    const T& back() const { return data()[count - 1]; }
+
+    void push_back(const T& v) {
+        if (count < N) {
+            inline_items[count++] = v;
+            return;
+        }
+        if (count == N) heap.assign(inline_items, inline_items + N);
+        heap.push_back(v);
+        count++;
+    }
+
+    void clear() {
+        count = 0;
+        heap.clear();
+    }
+
+private:
+    T inline_items[N];
+    std::vector<T> heap;
+    size_t count = 0;
+};
+
+// Arguments of one command. The views point into the connection's query buffer (or into
+// a queued MULTI command) and are only valid while the command runs.
+using CommandArgs = SmallVector<std::string_view, 8>;
+
+std::string resp_bulk_string(std::string_view s);
 std::string resp_array(const std::vector<std::string>& elems);
 
-std::string to_lower(std::string s);
\ No newline at end of file
+std::string to_lower(std::string s);
+bool equals_ignore_case(std::string_view a, std::string_view b);
+bool parse_int64(std::string_view s, long long& out);
+bool parse_double(std::string_view s, double& out);
+
+enum class ParseStatus { Complete, Incomplete, Error };
+
+// Incremental RESP request parser. Its state is kept between calls, so a command that
+// arrives over several reads is resumed where parsing stopped instead of being
+// re-scanned from its first byte. Offsets are relative to the start of the command,
+// which lets the caller compact its buffer between reads.
+struct RespParser {
+    size_t scan = 0;            // bytes of the current command already consumed
+    long long args_left = -1;   // bulk strings still expected; -1 until the header is read
+    long long bulk_len = -1;    // length of the bulk string being read; -1 until its header
+    size_t argc = 0;
+    bool inline_command = false;
+    std::string error;
+    // (offset, length) of each argument, relative to the start of the command.
+    SmallVector<std::pair<size_t, size_t>, 8> spans;
+
+    // Parses the command starting at buf; on Complete, command_length() bytes form it.
+    ParseStatus parse(const char* buf, size_t len);
+    size_t command_length() const { return scan; }
+    // Fills args with views of the parsed arguments; buf must be the buffer passed to parse().
+    void fill_args(const char* buf, CommandArgs& args) const;
+    // Bytes still missing before the bulk string being read is complete, or 0.
+    size_t pending_bulk_bytes(size_t len) const;
+    void reset();
+};
@@ -0,0 +1,98 @@
+#include "quicklist.hpp"
+
+int list_max_listpack_size = -2;
+
+// A positive fill only counts elements, so a listpack is also kept under this many bytes,
+// as in Redis; large elements would otherwise pile up in one ever-growing node.
+static const size_t SIZE_SAFETY_LIMIT = 8192;
+
+QuickList::QuickList(unsigned char* lp) {
+    Node* node = insert_node(nullptr);
+    lp_free(node->lp);
+    node->lp = lp;
+    count = lp_length(lp);
+}
+
+QuickList::~QuickList() {
+    while (head) remove_node(head);
+}
+
+// An empty listpack always has room, so an oversized element still finds a place.
+bool QuickList::listpack_has_room(const unsigned char* lp, size_t value_len) {
+    size_t length = lp_length(lp);
+    if (length == 0) return true;
+    size_t new_bytes = lp_bytes(lp) + lp_entry_size(value_len);
+    if (list_max_listpack_size > 0) {
+        return length < static_cast<size_t>(list_max_listpack_size) && new_bytes <= SIZE_SAFETY_LIMIT;
+    }
+    size_t max_bytes = size_t(4096) << (-list_max_listpack_size - 1);
+    return new_bytes <= max_bytes;
+}
+
+bool QuickList::has_room(const Node* node, std::string_view value) {
+    return node && listpack_has_room(node->lp, value.size());
+}
+
+// Links a new empty node in before `before`, or at the tail when it is nullptr.
+QuickList::Node* QuickList::insert_node(Node* before) {
+    Node* node = new Node();
+    node->lp = lp_new();
+    node->next = before;
+    node->prev = before ? before->prev : tail;
+    if (node->prev) {
+        node->prev->next = node;
+    } else {
+        head = node;
+    }
+    if (before) {
+        before->prev = node;
+    } else {
+        tail = node;
+    }
+    return node;
+}
+
+void QuickList::remove_node(Node* node) {
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        head = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    } else {
+        tail = node->prev;
+    }
+    lp_free(node->lp);
+    delete node;
+}
+
+void QuickList::push_front(std::string_view value) {
+    Node* node = has_room(head, value) ? head : insert_node(head);
+    node->lp = lp_prepend(node->lp, value);
+    ++count;
+}
+
+void QuickList::push_back(std::string_view value) {
+    Node* node = has_room(tail, value) ? tail : insert_node(nullptr);
+    node->lp = lp_append(node->lp, value);
+    ++count;
+}
+
+std::string QuickList::pop_front() {
+    const unsigned char* p = lp_first(head->lp);
+    std::string value(lp_get(p));
+    head->lp = lp_delete(head->lp, p);
+    if (lp_length(head->lp) == 0) remove_node(head);
+    --count;
+    return value;
+}
+
+std::string QuickList::pop_back() {
+    const unsigned char* p = lp_last(tail->lp);
+    std::string value(lp_get(p));
+    tail->lp = lp_delete(tail->lp, p);
+    if (lp_length(tail->lp) == 0) remove_node(tail);
+    --count;
+    return value;
+}
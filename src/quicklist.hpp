@@ -0,0 +1,101 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include "listpack.hpp"
+
+// Fill limit of a listpack holding list elements, with Redis's list-max-listpack-size
+// meaning: a positive value caps the element count, -1 to -5 cap the size at 4, 8, 16,
+// 32 or 64 KB. It bounds both a quicklist node and a list kept as a bare listpack.
+extern int list_max_listpack_size;
+
+// The list type for lists past the fill limit: a doubly linked list of listpacks, as
+// Redis's quicklist. Pushing and popping at either end only touches the end node, so both
+// are O(1) however long the list gets, and a node packs many short elements into one
+// allocation instead of one std::string each. An element too large for any node gets a
+// node of its own.
+class QuickList {
+private:
+    struct Node {
+        Node* prev = nullptr;
+        Node* next = nullptr;
+        unsigned char* lp = nullptr;
+    };
+
+public:
+    class const_iterator {
+    public:
+        const_iterator(const Node* node, const unsigned char* p) : node(node), p(p) {}
+        std::string_view operator*() const { return lp_get(p); }
+        const_iterator& operator++() {
+            p = lp_next(node->lp, p);
+            if (!p && (node = node->next)) p = lp_first(node->lp);
+            return *this;
+        }
+        bool operator==(const const_iterator& other) const { return p == other.p; }
+        bool operator!=(const const_iterator& other) const { return p != other.p; }
+
+    private:
+        const Node* node;
+        const unsigned char* p;
+    };
+
+    QuickList() = default;
+    // Takes over lp as the list's only node.
+    explicit QuickList(unsigned char* lp);
+    ~QuickList();
+    QuickList(const QuickList&) = delete;
+    QuickList& operator=(const QuickList&) = delete;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    void push_front(std::string_view value);
+    void push_back(std::string_view value);
+    // The list must not be empty.
+    std::string pop_front();
+    std::string pop_back();
+
+    // Calls fn with each of n elements starting at index start; the range must lie within
+    // the list. Whole nodes before start are skipped by their element count, walking in
+    // from whichever end is nearer.
+    template <typename Fn>
+    void for_range(size_t start, size_t n, Fn&& fn) const {
+        if (n == 0) return;
+        const Node* node;
+        size_t index;
+        if (start < count / 2) {
+            node = head;
+            index = start;
+            while (index >= lp_length(node->lp)) {
+                index -= lp_length(node->lp);
+                node = node->next;
+            }
+        } else {
+            node = tail;
+            size_t from_end = count - 1 - start;
+            while (from_end >= lp_length(node->lp)) {
+                from_end -= lp_length(node->lp);
+                node = node->prev;
+            }
+            index = lp_length(node->lp) - 1 - from_end;
+        }
+        const_iterator it(node, lp_seek(node->lp, static_cast<long>(index)));
+        for (; n > 0; --n, ++it) fn(*it);
+    }
+
+    const_iterator begin() const { return head ? const_iterator(head, lp_first(head->lp)) : end(); }
+    const_iterator end() const { return const_iterator(nullptr, nullptr); }
+
+    // Whether a value of value_len bytes still fits in lp under list_max_listpack_size.
+    static bool listpack_has_room(const unsigned char* lp, size_t value_len);
+
+private:
+    Node* insert_node(Node* before);
+    void remove_node(Node* node);
+    static bool has_room(const Node* node, std::string_view value);
+
+    Node* head = nullptr;
+    Node* tail = nullptr;
+    size_t count = 0;
+};
@@ -0,0 +1,237 @@
+#include "radix.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+RadixTree::~RadixTree() {
+    if (root) free_node(static_cast<Node*>(root), 0);
+}
+
+void RadixTree::free_node(Node* node, size_t offset) {
+    size_t child_offset = offset + node->prefix_len + 1;
+    if (child_offset < KEY_LEN) {
+        for (void* child : node->children) free_node(static_cast<Node*>(child), child_offset);
+    }
+    delete node;
+}
+
+void** RadixTree::insert(const unsigned char* key, void* value) {
+    void** link = &root;
+    size_t offset = 0;
+    while (true) {
+        auto* node = static_cast<Node*>(*link);
+        if (!node) {
+            // The rest of the key becomes one node's prefix and branch byte.
+            node = new Node();
+            node->prefix_len = static_cast<unsigned char>(KEY_LEN - 1 - offset);
+            memcpy(node->prefix, key + offset, node->prefix_len);
+            node->labels.push_back(key[KEY_LEN - 1]);
+            node->children.push_back(value);
+            *link = node;
+            ++count;
+            return &node->children.back();
+        }
+
+        size_t matched = 0;
+        while (matched < node->prefix_len && node->prefix[matched] == key[offset + matched]) ++matched;
+        if (matched < node->prefix_len) {
+            // Split the prefix where the key leaves it: a new node takes the shared part and
+            // branches to the old node, which keeps what follows the branch byte.
+            auto* upper = new Node();
+            upper->prefix_len = static_cast<unsigned char>(matched);
+            memcpy(upper->prefix, node->prefix, matched);
+            upper->labels.push_back(node->prefix[matched]);
+            upper->children.push_back(node);
+            node->prefix_len = static_cast<unsigned char>(node->prefix_len - matched - 1);
+            memmove(node->prefix, node->prefix + matched + 1, node->prefix_len);
+            *link = upper;
+            node = upper;
+        }
+
+        offset += node->prefix_len;
+        unsigned char label = key[offset];
+        auto it = std::lower_bound(node->labels.begin(), node->labels.end(), label);
+        size_t pos = static_cast<size_t>(it - node->labels.begin());
+        bool last = offset + 1 == KEY_LEN;
+        if (it == node->labels.end() || *it != label) {
+            node->labels.insert(it, label);
+            node->children.insert(node->children.begin() + static_cast<std::ptrdiff_t>(pos), nullptr);
+            if (last) ++count;
+        }
+        if (last) {
+            node->children[pos] = value;
+            return &node->children[pos];
+        }
+        link = &node->children[pos];
+        offset += 1;
+    }
+}
+
+void** RadixTree::find(const unsigned char* key) {
+    void** link = &root;
+    size_t offset = 0;
+    while (*link) {
+        auto* node = static_cast<Node*>(*link);
+        if (memcmp(node->prefix, key + offset, node->prefix_len) != 0) return nullptr;
+        offset += node->prefix_len;
+        auto it = std::lower_bound(node->labels.begin(), node->labels.end(), key[offset]);
+        if (it == node->labels.end() || *it != key[offset]) return nullptr;
+        link = &node->children[static_cast<size_t>(it - node->labels.begin())];
+        if (++offset == KEY_LEN) return link;
+    }
+    return nullptr;
+}
+
+// Nodes left without branches are removed on the way up, and a node left with a single
+// branch to another node is merged into it, so the tree stays as compact as after
+// inserting only the remaining keys.
+bool RadixTree::erase(const unsigned char* key) {
+    struct Step {
+        void** link;
+        Node* node;
+        size_t offset;
+        size_t pos;
+    };
+    Step path[KEY_LEN];
+    size_t steps = 0;
+    void** link = &root;
+    size_t offset = 0;
+    while (true) {
+        auto* node = static_cast<Node*>(*link);
+        if (!node || memcmp(node->prefix, key + offset, node->prefix_len) != 0) return false;
+        size_t branch = offset + node->prefix_len;
+        auto it = std::lower_bound(node->labels.begin(), node->labels.end(), key[branch]);
+        if (it == node->labels.end() || *it != key[branch]) return false;
+        size_t pos = static_cast<size_t>(it - node->labels.begin());
+        path[steps++] = {link, node, offset, pos};
+        offset = branch + 1;
+        if (offset == KEY_LEN) break;
+        link = &node->children[pos];
+    }
+    --count;
+
+    while (steps > 0) {
+        Step& step = path[--steps];
+        Node* node = step.node;
+        node->labels.erase(node->labels.begin() + static_cast<std::ptrdiff_t>(step.pos));
+        node->children.erase(node->children.begin() + static_cast<std::ptrdiff_t>(step.pos));
+        if (node->labels.empty()) {
+            delete node;
+            *step.link = nullptr;
+            continue;
+        }
+        // Only a node whose children are nodes can take in its single child.
+        if (node->labels.size() == 1 && step.offset + node->prefix_len + 1 < KEY_LEN) {
+            auto* child = static_cast<Node*>(node->children[0]);
+            unsigned char merged[KEY_LEN];
+            size_t len = node->prefix_len;
+            memcpy(merged, node->prefix, len);
+            merged[len++] = node->labels[0];
+            memcpy(merged + len, child->prefix, child->prefix_len);
+            len += child->prefix_len;
+            memcpy(child->prefix, merged, len);
+            child->prefix_len = static_cast<unsigned char>(len);
+            *step.link = child;
+            delete node;
+        }
+        break;
+    }
+    return true;
+}
+
+void RadixTree::Iterator::push(const Node* node, size_t offset, size_t pos) {
+    memcpy(key_buf + offset, node->prefix, node->prefix_len);
+    frames[depth++] = {node, offset, 0};
+    set_pos(frames[depth - 1], pos);
+}
+
+void RadixTree::Iterator::set_pos(Frame& frame, size_t pos) {
+    frame.pos = pos;
+    key_buf[frame.offset + frame.node->prefix_len] = frame.node->labels[pos];
+}
+
+// From the top frame down to a value, along the first or the last branch of each node.
+void RadixTree::Iterator::descend(bool last) {
+    while (true) {
+        const Frame& top = frames[depth - 1];
+        size_t offset = top.offset + top.node->prefix_len + 1;
+        if (offset == KEY_LEN) return;
+        auto* child = static_cast<const Node*>(top.node->children[top.pos]);
+        push(child, offset, last ? child->labels.size() - 1 : 0);
+    }
+}
+
+void RadixTree::Iterator::seek_first() {
+    depth = 0;
+    if (!tree->root) return;
+    push(static_cast<const Node*>(tree->root), 0, 0);
+    descend(false);
+}
+
+void RadixTree::Iterator::seek_last() {
+    depth = 0;
+    if (!tree->root) return;
+    auto* root = static_cast<const Node*>(tree->root);
+    push(root, 0, root->labels.size() - 1);
+    descend(true);
+}
+
+void RadixTree::Iterator::next() {
+    while (depth > 0) {
+        Frame& top = frames[depth - 1];
+        if (top.pos + 1 < top.node->labels.size()) {
+            set_pos(top, top.pos + 1);
+            descend(false);
+            return;
+        }
+        --depth;
+    }
+}
+
+void RadixTree::Iterator::prev() {
+    while (depth > 0) {
+        Frame& top = frames[depth - 1];
+        if (top.pos > 0) {
+            set_pos(top, top.pos - 1);
+            descend(true);
+            return;
+        }
+        --depth;
+    }
+}
+
+// Follows key down the tree. Where the tree leaves it, everything below a smaller prefix
+// or branch byte is below key, so the answer is its last key; below a greater one,
+// everything is above key, so the answer is the key before that subtree.
+void RadixTree::Iterator::seek_le(const unsigned char* key) {
+    depth = 0;
+    auto* node = static_cast<const Node*>(tree->root);
+    size_t offset = 0;
+    while (node) {
+        int cmp = memcmp(node->prefix, key + offset, node->prefix_len);
+        if (cmp < 0) {
+            push(node, offset, node->labels.size() - 1);
+            descend(true);
+            return;
+        }
+        if (cmp > 0) {
+            prev();
+            return;
+        }
+        unsigned char label = key[offset + node->prefix_len];
+        auto it = std::upper_bound(node->labels.begin(), node->labels.end(), label);
+        if (it == node->labels.begin()) {
+            prev();
+            return;
+        }
+        size_t pos = static_cast<size_t>(it - node->labels.begin()) - 1;
+        push(node, offset, pos);
+        if (node->labels[pos] < label) {
+            descend(true);
+            return;
+        }
+        offset += node->prefix_len + 1;
+        if (offset == KEY_LEN) return;
+        node = static_cast<const Node*>(node->children[pos]);
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// An ordered map from fixed-length byte keys to pointers, as a radix tree after Redis's
+// rax: each node holds a compressed run of key bytes shared by everything below it and
+// then branches on one byte, with its branch bytes kept sorted. Keys compare as unsigned
+// bytes, so big-endian integers iterate in numeric order. Lookups, inserts and erases
+// cost O(key length) whatever the number of keys.
+//
+// The tree does not own its values.
+class RadixTree {
+public:
+    static constexpr size_t KEY_LEN = 16;
+
+private:
+    struct Node {
+        unsigned char prefix_len = 0;
+        unsigned char prefix[KEY_LEN];
+        std::vector<unsigned char> labels;      // sorted branch bytes
+        std::vector<void*> children;            // child nodes, or values at the key's last byte
+    };
+
+public:
+    // Walks the keys in order. Positioning calls leave it invalid when there is no such
+    // key; it is also invalidated by any change to the tree.
+    class Iterator {
+    public:
+        explicit Iterator(const RadixTree& tree) : tree(&tree) {}
+
+        void seek_first();
+        void seek_last();
+        // The greatest key that is not above key.
+        void seek_le(const unsigned char* key);
+        void next();
+        void prev();
+
+        bool valid() const { return depth > 0; }
+        const unsigned char* key() const { return key_buf; }
+        void* value() const { return frames[depth - 1].node->children[frames[depth - 1].pos]; }
+
+    private:
+        struct Frame {
+            const Node* node;
+            size_t offset;                      // key byte where the node's prefix starts
+            size_t pos;                         // branch taken
+        };
+
+        void push(const Node* node, size_t offset, size_t pos);
+        void set_pos(Frame& frame, size_t pos);
+        void descend(bool last);
+
+        const RadixTree* tree;
+        Frame frames[KEY_LEN];
+        size_t depth = 0;
+        unsigned char key_buf[KEY_LEN];
+    };
+
+    RadixTree() = default;
+    ~RadixTree();
+    RadixTree(const RadixTree&) = delete;
+    RadixTree& operator=(const RadixTree&) = delete;
+
+    // Sets the value of key, adding it if needed. Returns the slot holding the value, which
+    // stays valid until the next insert or erase.
+    void** insert(const unsigned char* key, void* value);
+    // The slot holding key's value, or nullptr.
+    void** find(const unsigned char* key);
+    bool erase(const unsigned char* key);
+    size_t size() const { return count; }
+
+private:
+    static void free_node(Node* node, size_t offset);
+
+    void* root = nullptr;
+    size_t count = 0;
+};
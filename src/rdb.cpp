@@ -1,83 +1,255 @@
 #include "rdb.hpp"
+#include "crc64.hpp"
 #include "storage.hpp"
+#include "StreamHandler.hpp"
+#include <algorithm>
+#include <charconv>
 #include <iostream>
 #include <chrono>
 #include <ctime>
-#include <arpa/inet.h>
-#include <netinet/in.h>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-std::string rdb_encode_length(uint64_t len) {
-    std::string result;
+RdbWriter::RdbWriter(int fd) : fd(fd), buf(RDB_IO_BUFFER_SIZE) {}
+
+void RdbWriter::write(const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        if (used == buf.size()) flush();
+        size_t n = std::min(len, buf.size() - used);
+        memcpy(buf.data() + used, p, n);
+        used += n;
+        p += n;
+        len -= n;
+    }
+}
+
+// Encodes len in the 1, 2 or 5 bytes Redis uses and returns how many it took.
+static size_t rdb_encode_length(uint64_t len, unsigned char enc[5]) {
     if (len < (1 << 6)) {
         // 6-bit length
-        result.push_back(static_cast<char>(len & 0x3F));
-    } else if (len < (1 << 14)) {
+        enc[0] = static_cast<unsigned char>(len & 0x3F);
+        return 1;
+    }
+    if (len < (1 << 14)) {
         // 14-bit length
-        result.push_back(static_cast<char>(((len >> 8) & 0x3F) | 0x40));
-        result.push_back(static_cast<char>(len & 0xFF));
-    } else {
-        // 32-bit length
-        result.push_back(0x80);
-        result.push_back(static_cast<char>((len >> 24) & 0xFF));
-        result.push_back(static_cast<char>((len >> 16) & 0xFF));
-        result.push_back(static_cast<char>((len >> 8) & 0xFF));
-        result.push_back(static_cast<char>(len & 0xFF));
-    }
-    return result;
+        enc[0] = static_cast<unsigned char>(((len >> 8) & 0x3F) | 0x40);
+        enc[1] = static_cast<unsigned char>(len & 0xFF);
+        return 2;
+    }
+    // 32-bit length
+    enc[0] = 0x80;
+    enc[1] = static_cast<unsigned char>((len >> 24) & 0xFF);
+    enc[2] = static_cast<unsigned char>((len >> 16) & 0xFF);
+    enc[3] = static_cast<unsigned char>((len >> 8) & 0xFF);
+    enc[4] = static_cast<unsigned char>(len & 0xFF);
+    return 5;
 }
 
-bool rdb_save_string(std::ofstream& file, const std::string& str) {
-    std::string len_enc = rdb_encode_length(str.size());
-    file.write(len_enc.c_str(), len_enc.size());
-    file.write(str.c_str(), str.size());
-    return file.good();
+static void store_le64(unsigned char* out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) out[i] = static_cast<unsigned char>(value >> (8 * i));
 }
 
-bool rdb_load_string(std::ifstream& file, std::string& str) {
-    uint64_t len = rdb_load_length(file);
-    if (file.fail()) return false;
-    
-    str.resize(len);
-    file.read(&str[0], len);
-    return file.good();
+static uint64_t load_le64(const unsigned char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    return value;
 }
 
-uint64_t rdb_load_length(std::ifstream& file) {
-    unsigned char byte;
-    file.read(reinterpret_cast<char*>(&byte), 1);
-    if (file.fail()) return 0;
-    
-    uint64_t len;
-    if ((byte & 0xC0) == 0) {
-        // 6-bit length
-        len = byte & 0x3F;
-    } else if ((byte & 0xC0) == 0x40) {
-        // 14-bit length
-        len = (byte & 0x3F) << 8;
-        file.read(reinterpret_cast<char*>(&byte), 1);
-        if (file.fail()) return 0;
-        len |= byte;
-    } else if (byte == 0x80) {
-        // 32-bit length
-        uint32_t len32;
-        file.read(reinterpret_cast<char*>(&len32), 4);
-        if (file.fail()) return 0;
-        // Convert from big-endian to host byte order
-        len = (static_cast<uint64_t>(ntohl(len32)));
-    } else {
-        file.setstate(std::ios::failbit);
-        return 0;
+void RdbWriter::write_length(uint64_t len) {
+    unsigned char enc[5];
+    write(enc, rdb_encode_length(len, enc));
+}
+
+// Bytes a signed little-endian integer needs to hold value: 1, 2, 4 or 8.
+static size_t rdb_int_width(long long value) {
+    if (value == static_cast<int8_t>(value)) return 1;
+    if (value == static_cast<int16_t>(value)) return 2;
+    if (value == static_cast<int32_t>(value)) return 4;
+    return 8;
+}
+
+void RdbWriter::write_string(std::string_view str) {
+    long long value;
+    size_t width;
+    if (str.size() <= 11 && parse_canonical_int(str, value) && (width = rdb_int_width(value)) <= 4) {
+        unsigned char enc[9];
+        enc[0] = 0xC0 | (width == 1 ? RDB_ENC_INT8 : width == 2 ? RDB_ENC_INT16 : RDB_ENC_INT32);
+        store_le64(enc + 1, static_cast<uint64_t>(value));
+        write(enc, 1 + width);
+        return;
     }
-    return len;
+    write_length(str.size());
+    write(str.data(), str.size());
 }
 
-bool rdb_save(const std::string& filename) {
-    std::ofstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Failed to open RDB file for writing: " << filename << std::endl;
-        return false;
+// The CRC is taken over each full buffer just before it is written, while it is still in
+// cache, rather than field by field.
+bool RdbWriter::flush() {
+    crc = crc64(crc, buf.data(), used);
+    written += used;
+    const char* p = buf.data();
+    size_t left = used;
+    while (left > 0 && !failed) {
+        ssize_t n = ::write(fd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            failed = true;
+            break;
+        }
+        p += n;
+        left -= static_cast<size_t>(n);
     }
-    
+    used = 0;
+    return !failed;
+}
+
+uint64_t RdbWriter::checksum() {
+    return crc64(crc, buf.data(), used);
+}
+
+RdbStats rdb_stats;
+
+static const char RDB_CHUNK_INDEX_AUX[] = "chunk-index";
+
+// Where one shard's keys are in the file, and how many of them (and of their expiry times)
+// it holds, for the loader to size the shard's tables.
+struct RdbChunk {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t keys;
+    uint64_t expires;
+};
+
+constexpr size_t RDB_CHUNK_ENTRY_SIZE = 4 * 8;
+// A type byte and two one-byte lengths, for an empty key and value; key counts are checked
+// against it before tables are sized by them.
+constexpr size_t RDB_MIN_KEY_SIZE = 3;
+
+constexpr size_t RDB_LIST_RUN_MAX = 512;
+
+// Writes the list's elements in runs: integers go in runs as wide as their widest member,
+// so a list of small numbers costs about a byte per element, and anything else in runs
+// of strings.
+static void rdb_write_list(RdbWriter& file, const RedisObject& list) {
+    size_t list_size = list_length(list);
+    file.write_length(list_size);
+
+    uint8_t kind = 0;
+    std::vector<long long> ints;
+    std::vector<std::string_view> strings;
+    auto write_run = [&]() {
+        size_t count = kind ? ints.size() : strings.size();
+        if (count == 0) return;
+        file.put(kind);
+        file.write_length(count);
+        for (long long value : ints) {
+            unsigned char enc[8];
+            store_le64(enc, static_cast<uint64_t>(value));
+            file.write(enc, kind);
+        }
+        for (std::string_view element : strings) file.write_string(element);
+        ints.clear();
+        strings.clear();
+    };
+    list_for_range(list, 0, list_size, [&](std::string_view element) {
+        long long value;
+        uint8_t width = parse_canonical_int(element, value) ? static_cast<uint8_t>(rdb_int_width(value)) : 0;
+        // A narrower integer joins a run of wider ones rather than starting its own
+        bool fits = width ? kind >= width : kind == 0;
+        if (!fits || ints.size() + strings.size() == RDB_LIST_RUN_MAX) {
+            write_run();
+            kind = width;
+        }
+        if (width) {
+            ints.push_back(value);
+        } else {
+            strings.push_back(element);
+        }
+    });
+    write_run();
+}
+
+// Writes one key with its value and expiry; false if the key has expired and was skipped.
+static bool rdb_write_key(RdbWriter& file, const Shard& shard, const DictEntry& entry, TimePoint now,
+                          uint64_t now_unix_ms, bool& has_expiry) {
+    const RedisObject& value = entry.value;
+
+    // Skip expired keys, and write the expiry of the others as a Unix time, which means
+    // the same after a restart
+    TimePoint expiry = get_expiry(shard, entry);
+    has_expiry = expiry != TimePoint::min();
+    if (has_expiry) {
+        if (now >= expiry) return false;
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(expiry - now).count();
+        unsigned char expiry_ms[8];
+        store_le64(expiry_ms, now_unix_ms + static_cast<uint64_t>(left));
+        file.put(RDB_OPCODE_EXPIRETIME_MS);
+        file.write(expiry_ms, sizeof(expiry_ms));
+    }
+
+    if (value.type == OBJ_STRING) {
+        // Write value type (string)
+        file.put(RDB_STRING_ENCODING);
+
+        // Write key
+        file.write_string(entry.key());
+
+        // Write value
+        IntBuffer buf;
+        file.write_string(value.string_value(buf));
+    } else if (value.type == OBJ_LIST) {
+        // Write value type (list)
+        file.put(RDB_LIST_PACKED_ENCODING);
+
+        // Write key
+        file.write_string(entry.key());
+
+        // Write list size and elements
+        rdb_write_list(file, value);
+    } else {
+        const Stream& stream = value.stream();
+
+        // Write value type (stream)
+        file.put(RDB_STREAM_ENCODING_2);
+
+        // Write key
+        file.write_string(entry.key());
+
+        // Write stream size
+        file.write_length(stream.size());
+
+        // Write stream entries
+        for (StreamIterator it(stream, StreamID{}); it.valid(); it.next()) {
+            // Write entry ID
+            char id_text[STREAM_ID_MAX_LEN];
+            file.write_string(std::string_view(id_text, format_stream_id(it.id(), id_text)));
+
+            // Write entry field count
+            file.write_length(it.field_count());
+
+            // Write entry fields
+            it.for_each_field([&file](std::string_view field, std::string_view value) {
+                file.write_string(field);
+                file.write_string(value);
+            });
+        }
+
+        // Write last ID
+        char last_id_text[STREAM_ID_MAX_LEN];
+        file.write_string(std::string_view(last_id_text, format_stream_id(stream.last_id(), last_id_text)));
+    }
+    return true;
+}
+
+static bool rdb_write_dataset(RdbWriter& file) {
     // Write Redis RDB header "REDIS0001"
     const char header[] = "REDIS0001";
     file.write(header, 9);
@@ -86,300 +258,642 @@ bool rdb_save(const std::string& filename) {
     std::string aux_key = "redis-ver";
     std::string aux_val = "6.0.0";
     file.put(RDB_OPCODE_AUX);
-    rdb_save_string(file, aux_key);
-    rdb_save_string(file, aux_val);
+    file.write_string(aux_key);
+    file.write_string(aux_val);
     
     // Write current time as AUX field
     aux_key = "redis-bits";
     aux_val = std::to_string(64); // 64-bit system
     file.put(RDB_OPCODE_AUX);
-    rdb_save_string(file, aux_key);
-    rdb_save_string(file, aux_val);
+    file.write_string(aux_key);
+    file.write_string(aux_val);
     
-    // Write SELECTDB opcode
+    // Write SELECTDB opcode (we only use DB 0)
     file.put(RDB_OPCODE_SELECTDB);
-    
-    // Write database size (we only use DB 0)
-    {
-        std::lock_guard<std::mutex> lock(storage_mutex);
-        uint64_t db_size = redis_storage.size() + lists.size() + streams.size();
-        std::string db_size_enc = rdb_encode_length(db_size);
-        file.write(db_size_enc.c_str(), db_size_enc.size());
-    }
-    
-    // Save strings
+    file.write_length(0);
+
+    // Write database and expires sizes
     {
-        std::lock_guard<std::mutex> lock(storage_mutex);
-        for (const auto& [key, value] : redis_storage) {
-            // Skip expired keys
-            if (value.expiry != TimePoint::min() && 
-                Clock::now() >= value.expiry) {
-                continue;
-            }
-            
-            // Write value type (string)
-            file.put(RDB_STRING_ENCODING);
-            
-            // Write key
-            rdb_save_string(file, key);
-            
-            // Write expiry if needed
-            if (value.expiry != TimePoint::min()) {
-                file.put(RDB_OPCODE_EXPIRETIME_MS);
-                auto expiry_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    value.expiry.time_since_epoch()).count();
-                file.write(reinterpret_cast<const char*>(&expiry_ms), sizeof(expiry_ms));
-            }
-            
-            // Write value
-            rdb_save_string(file, value.value);
+        uint64_t db_size = 0, expires_size = 0;
+        for (const Shard& shard : shards) {
+            db_size += shard.keys.size();
+            expires_size += shard.expires.size();
         }
+        file.put(RDB_OPCODE_RESIZEDB);
+        file.write_length(db_size);
+        file.write_length(expires_size);
     }
-    
-    // Save lists
-    {
-        std::lock_guard<std::mutex> lock(storage_mutex);
-        for (const auto& [key, list] : lists) {
-            // Write value type (list)
-            file.put(RDB_LIST_ENCODING);
-            
-            // Write key
-            rdb_save_string(file, key);
-            
-            // Write list size
-            std::string list_size_enc = rdb_encode_length(list.size());
-            file.write(list_size_enc.c_str(), list_size_enc.size());
-            
-            // Write list elements
-            for (const auto& element : list) {
-                rdb_save_string(file, element);
-            }
+
+    // Save each shard's keys together, as one chunk
+    RdbChunk chunks[SHARD_COUNT];
+    TimePoint now = Clock::now();
+    uint64_t now_unix_ms = current_unix_time_ms();
+    for (size_t i = 0; i < SHARD_COUNT; ++i) {
+        const Shard& shard = shards[i];
+        RdbChunk& chunk = chunks[i];
+        chunk = RdbChunk{file.offset(), 0, 0, 0};
+        for (const DictEntry& entry : shard.keys) {
+            bool has_expiry;
+            if (!rdb_write_key(file, shard, entry, now, now_unix_ms, has_expiry)) continue;
+            ++chunk.keys;
+            chunk.expires += has_expiry;
         }
+        chunk.length = file.offset() - chunk.offset;
     }
-    
-    // Save streams
-    {
-        std::lock_guard<std::mutex> lock(streams_mutex);
-        for (const auto& [key, stream] : streams) {
-            // Write value type (stream)
-            file.put(RDB_STREAM_ENCODING);
-            
-            // Write key
-            rdb_save_string(file, key);
-            
-            // Write stream size
-            std::string stream_size_enc = rdb_encode_length(stream.size());
-            file.write(stream_size_enc.c_str(), stream_size_enc.size());
-            
-            // Write stream entries
-            for (const auto& [entry_id, entry_data] : stream) {
-                // Write entry ID
-                rdb_save_string(file, entry_id);
-                
-                // Write entry field count
-                std::string field_count_enc = rdb_encode_length(entry_data.size());
-                file.write(field_count_enc.c_str(), field_count_enc.size());
-                
-                // Write entry fields
-                for (const auto& [field, value] : entry_data) {
-                    rdb_save_string(file, field);
-                    rdb_save_string(file, value);
-                }
-            }
-        }
+
+    // Write the chunk index. It ends with the offset it starts at, just before the EOF
+    // opcode, so the loader finds it from the end of the file.
+    file.put(RDB_OPCODE_AUX);
+    file.write_string(RDB_CHUNK_INDEX_AUX);
+    file.write_length(SHARD_COUNT * RDB_CHUNK_ENTRY_SIZE + 8);
+    uint64_t index_offset = file.offset();
+    for (const RdbChunk& chunk : chunks) {
+        unsigned char entry[RDB_CHUNK_ENTRY_SIZE];
+        store_le64(entry, chunk.offset);
+        store_le64(entry + 8, chunk.length);
+        store_le64(entry + 16, chunk.keys);
+        store_le64(entry + 24, chunk.expires);
+        file.write(entry, sizeof(entry));
     }
-    
+    unsigned char index_offset_bytes[8];
+    store_le64(index_offset_bytes, index_offset);
+    file.write(index_offset_bytes, sizeof(index_offset_bytes));
+
     // Write EOF opcode
     file.put(RDB_OPCODE_EOF);
-    
-    // Write CRC64 checksum (simplified - in a real implementation, you'd calculate this)
-    uint64_t crc = 0; // Placeholder for CRC
-    file.write(reinterpret_cast<const char*>(&crc), sizeof(crc));
-    
-    file.close();
-    return file.good();
+
+    // The CRC64 of everything before it, little-endian
+    unsigned char crc_bytes[8];
+    store_le64(crc_bytes, file.checksum());
+    file.write(crc_bytes, sizeof(crc_bytes));
+    return file.flush();
 }
 
-bool rdb_load(const std::string& filename) {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "No RDB file found: " << filename << std::endl;
+bool sync_parent_dir(const std::string& filename) {
+    size_t slash = filename.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return false;
+    bool ok = fsync(dir_fd) == 0;
+    close(dir_fd);
+    return ok;
+}
+
+// Writes the whole dataset to a temporary file and renames it over filename once it is
+// on disk; the caller keeps the dataset from changing meanwhile. The directory is synced
+// too, so the rename itself survives a crash.
+static bool rdb_write(const std::string& filename) {
+    std::string temp = filename + "." + std::to_string(getpid()) + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open RDB file for writing: " << temp << ": " << strerror(errno) << std::endl;
         return false;
     }
-    
-    // Read and verify header
-    char header[10];
-    file.read(header, 9);
-    header[9] = '\0';
-    if (std::string(header) != "REDIS0001") {
-        std::cerr << "Invalid RDB file format" << std::endl;
+    bool ok;
+    {
+        RdbWriter writer(fd);
+        ok = rdb_write_dataset(writer);
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(temp.c_str(), filename.c_str()) == 0;
+    if (!ok) {
+        std::cerr << "Failed to write RDB file " << filename << ": " << strerror(errno) << std::endl;
+        unlink(temp.c_str());
         return false;
     }
-    
-    // Clear existing data
+    sync_parent_dir(filename);
+    return true;
+}
+
+bool rdb_save(const std::string& filename) {
+    // Every shard is read-locked for the whole dump so the snapshot is consistent. Two
+    // SAVEs at once would share a temporary file.
+    static std::mutex save_mutex;
+    std::lock_guard<std::mutex> save_lock(save_mutex);
+    ShardLock lock(ALL_SHARDS, LockMode::Read);
+    bool ok = rdb_write(filename);
+    if (ok) rdb_stats.last_save_time.store(time(nullptr), std::memory_order_relaxed);
+    return ok;
+}
+
+// The child starts with the parent's memory as it is at fork(), shared copy-on-write, so
+// the shards only need to be still while the process is copied: writers wait for the page
+// tables, not for the dump. The child takes no locks, since whichever thread held one at
+// the fork does not exist in it.
+BgsaveStatus rdb_bgsave(const std::string& filename) {
+    if (rdb_stats.bgsave_in_progress.exchange(true)) return BgsaveStatus::InProgress;
+
+    pid_t pid;
     {
-        std::lock_guard<std::mutex> lock1(storage_mutex);
-        std::lock_guard<std::mutex> lock2(streams_mutex);
-        redis_storage.clear();
-        lists.clear();
-        streams.clear();
+        ShardLock lock(ALL_SHARDS, LockMode::Read);
+        auto fork_start = Clock::now();
+        pid = fork();
+        if (pid == 0) _exit(rdb_write(filename) ? 0 : 1);
+        rdb_stats.last_fork_usec.store(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                           Clock::now() - fork_start).count()),
+                                       std::memory_order_relaxed);
     }
-    
-    // Read file contents
-    while (file.good()) {
-        unsigned char opcode;
-        file.read(reinterpret_cast<char*>(&opcode), 1);
-        if (!file.good()) break;
-        
+    if (pid < 0) {
+        std::cerr << "Can't save in background: fork: " << strerror(errno) << std::endl;
+        rdb_stats.last_bgsave_ok.store(false, std::memory_order_relaxed);
+        rdb_stats.bgsave_in_progress.store(false);
+        return BgsaveStatus::ForkFailed;
+    }
+
+    std::thread([pid]() {
+        auto start = Clock::now();
+        int status = 0;
+        bool ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (ok) {
+            std::cout << "Background saving completed" << std::endl;
+            rdb_stats.last_save_time.store(time(nullptr), std::memory_order_relaxed);
+        } else {
+            std::cerr << "Background saving failed" << std::endl;
+        }
+        rdb_stats.last_bgsave_ok.store(ok, std::memory_order_relaxed);
+        rdb_stats.last_bgsave_sec.store(
+            std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - start).count(),
+            std::memory_order_relaxed);
+        rdb_stats.bgsave_in_progress.store(false);
+    }).detach();
+    return BgsaveStatus::Started;
+}
+
+// Reads from part of the mapped file. Values are views into the mapping; every read is
+// checked against the end, so a corrupt length cannot run past it.
+struct RdbCursor {
+    const unsigned char* p;
+    const unsigned char* end;
+    const char* error = nullptr;
+    bool eof = false;           // the EOF opcode has been read
+
+    bool fail(const char* what) {
+        error = what;
+        return false;
+    }
+
+    bool get(uint8_t& byte) {
+        if (p == end) return false;
+        byte = *p++;
+        return true;
+    }
+
+    bool skip(size_t n) {
+        if (static_cast<size_t>(end - p) < n) return false;
+        p += n;
+        return true;
+    }
+
+    bool read_length(uint64_t& len) {
+        uint8_t byte;
+        if (!get(byte)) return false;
+
+        if ((byte & 0xC0) == 0) {
+            // 6-bit length
+            len = byte & 0x3F;
+        } else if ((byte & 0xC0) == 0x40) {
+            // 14-bit length
+            if (p == end) return false;
+            len = (static_cast<uint64_t>(byte & 0x3F) << 8) | *p++;
+        } else if (byte == 0x80) {
+            // 32-bit length, big-endian
+            if (end - p < 4) return false;
+            len = (static_cast<uint64_t>(p[0]) << 24) | (static_cast<uint64_t>(p[1]) << 16) |
+                  (static_cast<uint64_t>(p[2]) << 8) | p[3];
+            p += 4;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Reads little-endian integers of width bytes, sign-extended.
+    bool read_int(long long& value, size_t width) {
+        if (static_cast<size_t>(end - p) < width) return false;
+        uint64_t bits = 0;
+        for (size_t i = 0; i < width; ++i) bits |= static_cast<uint64_t>(p[i]) << (8 * i);
+        p += width;
+        size_t shift = 64 - 8 * width;
+        value = static_cast<long long>(bits << shift) >> shift;
+        return true;
+    }
+
+    bool at_int_string() const { return p != end && (*p & 0xC0) == 0xC0; }
+
+    // Reads an integer-encoded string, once at_int_string() has said the next one is.
+    bool read_int_string(long long& value) {
+        uint8_t type = *p++ & 0x3F;
+        return type <= RDB_ENC_INT32 && read_int(value, size_t(1) << type);
+    }
+
+    // An integer-encoded string is printed into buf.
+    bool read_string(std::string_view& str, IntBuffer& buf) {
+        if (at_int_string()) {
+            long long value;
+            if (!read_int_string(value)) return false;
+            str = format_int(value, buf);
+            return true;
+        }
+        uint64_t len;
+        if (!read_length(len) || static_cast<uint64_t>(end - p) < len) return false;
+        str = std::string_view(reinterpret_cast<const char*>(p), len);
+        p += len;
+        return true;
+    }
+
+    static std::string_view format_int(long long value, IntBuffer& buf) {
+        char* last = std::to_chars(buf.data(), buf.data() + buf.size(), value).ptr;
+        return std::string_view(buf.data(), static_cast<size_t>(last - buf.data()));
+    }
+};
+
+// Where parsed keys go. The caller holds the write locks of the shards they may land in.
+struct RdbLoadTarget {
+    // A chunk's shard: keys that hash to another one, as in a file from a build that
+    // shards differently, are kept in strays and inserted once every chunk is loaded.
+    Shard* owner = nullptr;
+    // Set once the shards' tables have been sized from the chunk index, when RESIZEDB's
+    // even split would only get in the way.
+    bool presized = false;
+    // When the load started, to turn the Unix expiry times in the file into TimePoints.
+    TimePoint now;
+    uint64_t now_unix_ms = 0;
+
+    struct Stray {
+        std::string key;
+        RedisObject value;
+        TimePoint expiry;
+    };
+    std::vector<Stray> strays;
+};
+
+// Parses records until the end of in, or up to and including the EOF opcode.
+static bool rdb_parse(RdbCursor& in, RdbLoadTarget& target) {
+    // The expiry read for the next key, if any
+    TimePoint expiry = TimePoint::min();
+    bool expired = false;
+    auto insert = [&](std::string_view key, RedisObject&& obj) {
+        TimePoint when = expiry;
+        bool skip = expired;
+        expiry = TimePoint::min();
+        expired = false;
+        if (skip) return;
+        Shard& shard = shard_for(key);
+        if (target.owner && &shard != target.owner) {
+            target.strays.push_back({std::string(key), std::move(obj), when});
+            return;
+        }
+        set_key(shard, key, std::move(obj));
+        if (when != TimePoint::min()) set_expiry(shard, key, when);
+    };
+
+    IntBuffer key_buf, value_buf;
+    std::vector<IntBuffer> field_bufs;
+    std::vector<std::string_view> fields_and_values;
+    while (in.p != in.end) {
+        uint8_t opcode = *in.p++;
         switch (opcode) {
             case RDB_OPCODE_AUX: {
                 // Skip AUX fields
-                std::string aux_key, aux_val;
-                if (!rdb_load_string(file, aux_key) || !rdb_load_string(file, aux_val)) {
-                    std::cerr << "Failed to read AUX field" << std::endl;
-                    return false;
+                std::string_view aux_key, aux_val;
+                if (!in.read_string(aux_key, key_buf) || !in.read_string(aux_val, value_buf)) {
+                    return in.fail("Failed to read AUX field");
                 }
                 break;
             }
             
             case RDB_OPCODE_SELECTDB: {
                 // We only support DB 0, so just read and ignore the DB number
-                uint64_t db_num = rdb_load_length(file);
-                if (file.fail()) {
-                    std::cerr << "Failed to read DB number" << std::endl;
-                    return false;
-                }
+                uint64_t db_num;
+                if (!in.read_length(db_num)) return in.fail("Failed to read DB number");
                 break;
             }
             
             case RDB_OPCODE_RESIZEDB: {
-                // Read hash table and expiry hash table sizes (we ignore these)
-                uint64_t db_size = rdb_load_length(file);
-                uint64_t expiry_size = rdb_load_length(file);
-                if (file.fail()) {
-                    std::cerr << "Failed to read DB size info" << std::endl;
-                    return false;
+                uint64_t db_size, expiry_size;
+                if (!in.read_length(db_size) || !in.read_length(expiry_size)) return in.fail("Failed to read DB size info");
+                if (target.presized) break;
+                // Give every shard an even share, with room for the ones the hash favours
+                db_size = std::min<uint64_t>(db_size, static_cast<uint64_t>(in.end - in.p) / RDB_MIN_KEY_SIZE);
+                size_t keys = db_size / SHARD_COUNT, expires = std::min(expiry_size, db_size) / SHARD_COUNT;
+                for (Shard& shard : shards) {
+                    shard.keys.reserve(keys + keys / 8);
+                    shard.expires.reserve(expires + expires / 8);
                 }
                 break;
             }
             
             case RDB_OPCODE_EXPIRETIME_MS: {
-                // This should be followed by a value type, which we'll handle in the value reading code
-                // For now, we'll just note that the next value has an expiry
-                int64_t expiry_ms;
-                file.read(reinterpret_cast<char*>(&expiry_ms), sizeof(expiry_ms));
-                if (file.fail()) {
-                    std::cerr << "Failed to read expiry time" << std::endl;
-                    return false;
-                }
-                // We'll handle this in the value reading code
+                // The Unix time the next key expires at. A key that has expired since the
+                // save is read but not loaded; one too far off for the clock never expires.
+                long long at_ms;
+                if (!in.read_int(at_ms, 8)) return in.fail("Failed to read expiry time");
+                auto left = static_cast<long long>(static_cast<uint64_t>(at_ms) - target.now_unix_ms);
+                expired = left <= 0;
+                if (!expiry_after(target.now, left, expiry)) expiry = TimePoint::max();
                 break;
             }
             
-            case RDB_OPCODE_EOF: {
-                // End of file reached successfully
+            case RDB_OPCODE_EOF:
+                in.eof = true;
                 return true;
-            }
             
             case RDB_STRING_ENCODING: {
                 // Read string value
-                std::string key, value;
-                if (!rdb_load_string(file, key) || !rdb_load_string(file, value)) {
-                    std::cerr << "Failed to read string value" << std::endl;
-                    return false;
+                std::string_view key, value;
+                if (!in.read_string(key, key_buf)) return in.fail("Failed to read string value");
+                // Files saved before expiry times were made Unix times have one here, as
+                // a reading of the saving host's monotonic clock; the key keeps no TTL.
+                if (in.p != in.end && *in.p == RDB_OPCODE_EXPIRETIME_MS && !in.skip(1 + 8)) {
+                    return in.fail("Failed to read expiry time");
                 }
-                
-                {
-                    std::lock_guard<std::mutex> lock(storage_mutex);
-                    redis_storage[key] = {value, TimePoint::min()};
+                // An integer goes straight into an INT-encoded object
+                if (in.at_int_string()) {
+                    long long number;
+                    if (!in.read_int_string(number)) return in.fail("Failed to read string value");
+                    insert(key, create_int_object(number));
+                    break;
                 }
+                if (!in.read_string(value, value_buf)) return in.fail("Failed to read string value");
+                insert(key, create_string_object(value));
                 break;
             }
             
             case RDB_LIST_ENCODING: {
                 // Read list value
-                std::string key;
-                if (!rdb_load_string(file, key)) {
-                    std::cerr << "Failed to read list key" << std::endl;
-                    return false;
-                }
-                
-                uint64_t list_size = rdb_load_length(file);
-                if (file.fail()) {
-                    std::cerr << "Failed to read list size" << std::endl;
-                    return false;
-                }
+                std::string_view key;
+                uint64_t list_size;
+                if (!in.read_string(key, key_buf) || !in.read_length(list_size)) return in.fail("Failed to read list header");
                 
-                std::vector<std::string> list;
+                RedisObject obj = create_list_object();
                 for (uint64_t i = 0; i < list_size; i++) {
-                    std::string element;
-                    if (!rdb_load_string(file, element)) {
-                        std::cerr << "Failed to read list element" << std::endl;
-                        return false;
-                    }
-                    list.push_back(element);
+                    std::string_view element;
+                    if (!in.read_string(element, value_buf)) return in.fail("Failed to read list element");
+                    list_push(obj, element, ListEnd::Tail);
                 }
-                
-                {
-                    std::lock_guard<std::mutex> lock(storage_mutex);
-                    lists[key] = list;
+                insert(key, std::move(obj));
+                break;
+            }
+
+            case RDB_LIST_PACKED_ENCODING: {
+                // Read list value, run by run
+                std::string_view key;
+                uint64_t list_size;
+                if (!in.read_string(key, key_buf) || !in.read_length(list_size)) return in.fail("Failed to read list header");
+
+                RedisObject obj = create_list_object();
+                for (uint64_t left = list_size; left > 0;) {
+                    uint8_t kind;
+                    uint64_t count;
+                    if (!in.get(kind) || !in.read_length(count) || count == 0 || count > left ||
+                        (kind != 0 && kind != 1 && kind != 2 && kind != 4 && kind != 8)) {
+                        return in.fail("Failed to read list run");
+                    }
+                    left -= count;
+                    if (kind == 0) {
+                        for (uint64_t i = 0; i < count; i++) {
+                            std::string_view element;
+                            if (!in.read_string(element, value_buf)) return in.fail("Failed to read list element");
+                            list_push(obj, element, ListEnd::Tail);
+                        }
+                        continue;
+                    }
+                    if (count > static_cast<uint64_t>(in.end - in.p) / kind) return in.fail("Failed to read list element");
+                    for (uint64_t i = 0; i < count; i++) {
+                        long long value = 0;
+                        in.read_int(value, kind);
+                        list_push(obj, RdbCursor::format_int(value, value_buf), ListEnd::Tail);
+                    }
                 }
+                insert(key, std::move(obj));
                 break;
             }
             
-            case RDB_STREAM_ENCODING: {
+            case RDB_STREAM_ENCODING:
+            case RDB_STREAM_ENCODING_2: {
                 // Read stream value
-                std::string key;
-                if (!rdb_load_string(file, key)) {
-                    std::cerr << "Failed to read stream key" << std::endl;
-                    return false;
-                }
-                
-                uint64_t stream_size = rdb_load_length(file);
-                if (file.fail()) {
-                    std::cerr << "Failed to read stream size" << std::endl;
-                    return false;
-                }
+                std::string_view key;
+                uint64_t stream_size;
+                if (!in.read_string(key, key_buf) || !in.read_length(stream_size)) return in.fail("Failed to read stream header");
                 
-                Stream stream;
+                RedisObject obj = create_stream_object();
+                Stream& stream = obj.stream();
                 for (uint64_t i = 0; i < stream_size; i++) {
-                    std::string entry_id;
-                    if (!rdb_load_string(file, entry_id)) {
-                        std::cerr << "Failed to read stream entry ID" << std::endl;
-                        return false;
+                    std::string_view entry_id;
+                    StreamID id;
+                    if (!in.read_string(entry_id, value_buf) || !parse_stream_id(entry_id, id) ||
+                        (i > 0 && id <= stream.last_id())) {
+                        return in.fail("Failed to read stream entry ID");
                     }
                     
-                    uint64_t field_count = rdb_load_length(file);
-                    if (file.fail()) {
-                        std::cerr << "Failed to read stream field count" << std::endl;
-                        return false;
+                    uint64_t field_count;
+                    if (!in.read_length(field_count) || field_count > static_cast<uint64_t>(in.end - in.p)) {
+                        return in.fail("Failed to read stream field count");
                     }
                     
-                    StreamEntry entry;
-                    for (uint64_t j = 0; j < field_count; j++) {
-                        std::string field, value;
-                        if (!rdb_load_string(file, field) || !rdb_load_string(file, value)) {
-                            std::cerr << "Failed to read stream field" << std::endl;
-                            return false;
-                        }
-                        entry[field] = value;
+                    fields_and_values.resize(field_count * 2);
+                    if (field_bufs.size() < fields_and_values.size()) field_bufs.resize(fields_and_values.size());
+                    for (size_t f = 0; f < fields_and_values.size(); ++f) {
+                        if (!in.read_string(fields_and_values[f], field_bufs[f])) return in.fail("Failed to read stream field");
                     }
-                    
-                    stream.push_back({entry_id, entry});
+                    stream.append(id, fields_and_values.data(), fields_and_values.size());
                 }
-                
-                {
-                    std::lock_guard<std::mutex> lock(streams_mutex);
-                    streams[key] = stream;
+
+                if (opcode == RDB_STREAM_ENCODING_2) {
+                    std::string_view last_id_text;
+                    StreamID last_id;
+                    if (!in.read_string(last_id_text, value_buf) || !parse_stream_id(last_id_text, last_id) ||
+                        last_id < stream.last_id()) {
+                        return in.fail("Failed to read stream last ID");
+                    }
+                    stream.set_last_id(last_id);
                 }
+                insert(key, std::move(obj));
                 break;
             }
             
             default:
-                std::cerr << "Unknown RDB opcode: " << static_cast<int>(opcode) << std::endl;
-                return false;
+                return in.fail("Unknown RDB opcode");
         }
     }
-    
     return true;
-}
\ No newline at end of file
+}
+
+// Finds the chunk index at the end of the file. Returns no chunks if there is none, or if
+// it does not describe back-to-back chunks ending right where it starts.
+static std::vector<RdbChunk> rdb_find_chunks(const unsigned char* base, size_t size) {
+    // ... index entries, index offset, EOF opcode, CRC
+    if (size < 9 + 8 + 1 + 8) return {};
+    const unsigned char* index_end = base + size - 8 - 1 - 8;
+    uint64_t index_offset = load_le64(index_end);
+    if (index_offset > static_cast<uint64_t>(index_end - base) ||
+        (index_end - base - index_offset) % RDB_CHUNK_ENTRY_SIZE != 0) {
+        return {};
+    }
+
+    // The AUX opcode, key and value length come right before it
+    unsigned char prefix[1 + 5 + sizeof(RDB_CHUNK_INDEX_AUX) - 1 + 5];
+    size_t prefix_len = 0;
+    prefix[prefix_len++] = RDB_OPCODE_AUX;
+    prefix_len += rdb_encode_length(sizeof(RDB_CHUNK_INDEX_AUX) - 1, prefix + prefix_len);
+    memcpy(prefix + prefix_len, RDB_CHUNK_INDEX_AUX, sizeof(RDB_CHUNK_INDEX_AUX) - 1);
+    prefix_len += sizeof(RDB_CHUNK_INDEX_AUX) - 1;
+    prefix_len += rdb_encode_length(index_end + 8 - (base + index_offset), prefix + prefix_len);
+    if (index_offset < 9 + prefix_len || memcmp(base + index_offset - prefix_len, prefix, prefix_len) != 0) return {};
+
+    std::vector<RdbChunk> chunks;
+    uint64_t chunks_end = index_offset - prefix_len;
+    for (const unsigned char* p = base + index_offset; p != index_end; p += RDB_CHUNK_ENTRY_SIZE) {
+        RdbChunk chunk{load_le64(p), load_le64(p + 8), load_le64(p + 16), load_le64(p + 24)};
+        uint64_t start = chunks.empty() ? chunk.offset : chunks.back().offset + chunks.back().length;
+        if (chunk.offset != start || chunk.offset < 9 || chunk.length > chunks_end - chunk.offset ||
+            chunk.keys > chunk.length / RDB_MIN_KEY_SIZE || chunk.expires > chunk.keys) {
+            return {};
+        }
+        chunks.push_back(chunk);
+    }
+    if (chunks.empty() || chunks.back().offset + chunks.back().length != chunks_end) return {};
+    return chunks;
+}
+
+static void rdb_report(const RdbCursor& in, const unsigned char* base) {
+    std::cerr << (in.error ? in.error : "Unexpected end of RDB file") << " at offset " << (in.p - base) << std::endl;
+}
+
+// Loads one chunk per shard, on as many threads as there are cores. Each thread takes the
+// next chunk and fills that shard alone, so the shards are built side by side without
+// waiting on each other's locks.
+static bool rdb_load_chunks(const unsigned char* base, const std::vector<RdbChunk>& chunks, TimePoint now,
+                            uint64_t now_unix_ms) {
+    std::vector<RdbLoadTarget> targets(SHARD_COUNT);
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    auto worker = [&]() {
+        for (size_t i; !failed.load(std::memory_order_relaxed) && (i = next.fetch_add(1)) < SHARD_COUNT;) {
+            Shard& shard = shards[i];
+            ShardLock lock(shard, LockMode::Write);
+            shard.keys.reserve(chunks[i].keys);
+            shard.expires.reserve(chunks[i].expires);
+            RdbCursor in{base + chunks[i].offset, base + chunks[i].offset + chunks[i].length};
+            targets[i].owner = &shard;
+            targets[i].presized = true;
+            targets[i].now = now;
+            targets[i].now_unix_ms = now_unix_ms;
+            if (!rdb_parse(in, targets[i]) || in.eof) {
+                if (in.eof) in.error = "Unexpected EOF opcode";
+                rdb_report(in, base);
+                failed.store(true);
+            }
+        }
+    };
+
+    size_t thread_count = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, SHARD_COUNT);
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < thread_count; ++t) threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads) thread.join();
+    if (failed.load()) return false;
+
+    ShardLock lock(ALL_SHARDS, LockMode::Write);
+    for (RdbLoadTarget& target : targets) {
+        for (RdbLoadTarget::Stray& stray : target.strays) {
+            Shard& shard = shard_for(stray.key);
+            set_key(shard, stray.key, std::move(stray.value));
+            if (stray.expiry != TimePoint::min()) set_expiry(shard, stray.key, stray.expiry);
+        }
+    }
+    return true;
+}
+
+static void clear_dataset() {
+    ShardLock lock(ALL_SHARDS, LockMode::Write);
+    for (Shard& shard : shards) {
+        shard.expires.clear();
+        shard.keys.clear();
+    }
+}
+
+static bool rdb_read(const unsigned char* base, size_t size) {
+    // Read and verify header, and the EOF opcode and CRC that end the file
+    if (size < 9 + 1 + 8 || memcmp(base, "REDIS0001", 9) != 0) {
+        std::cerr << "Invalid RDB file format" << std::endl;
+        return false;
+    }
+    if (base[size - 9] != RDB_OPCODE_EOF) {
+        std::cerr << "Unexpected end of RDB file" << std::endl;
+        return false;
+    }
+
+    clear_dataset();
+
+    // The checksum is taken on a thread of its own while the keys are parsed
+    uint64_t crc = load_le64(base + size - 8);
+    bool crc_ok = true;
+    std::thread crc_thread;
+    if (crc != 0) {
+        crc_thread = std::thread([&]() { crc_ok = crc64(0, base, size - 8) == crc; });
+    }
+
+    bool ok;
+    TimePoint now = Clock::now();
+    uint64_t now_unix_ms = current_unix_time_ms();
+    std::vector<RdbChunk> chunks = rdb_find_chunks(base, size);
+    if (chunks.size() == SHARD_COUNT) {
+        // The header fields before the first chunk, then the chunks
+        {
+            RdbLoadTarget target;
+            target.presized = true;
+            target.now = now;
+            target.now_unix_ms = now_unix_ms;
+            RdbCursor in{base + 9, base + chunks[0].offset};
+            ShardLock lock(ALL_SHARDS, LockMode::Write);
+            ok = rdb_parse(in, target) && !in.eof;
+            if (!ok) rdb_report(in, base);
+        }
+        ok = ok && rdb_load_chunks(base, chunks, now, now_unix_ms);
+    } else {
+        RdbLoadTarget target;
+        target.now = now;
+        target.now_unix_ms = now_unix_ms;
+        RdbCursor in{base + 9, base + size - 8};
+        ShardLock lock(ALL_SHARDS, LockMode::Write);
+        ok = rdb_parse(in, target) && in.eof && in.p == in.end;
+        if (!ok) rdb_report(in, base);
+    }
+
+    if (crc_thread.joinable()) crc_thread.join();
+    if (ok && !crc_ok) {
+        std::cerr << "Wrong RDB checksum; the file is corrupt" << std::endl;
+        ok = false;
+    }
+    // Nothing from a file that failed to load is kept
+    if (!ok) clear_dataset();
+    return ok;
+}
+
+bool rdb_load(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "No RDB file found: " << filename << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        std::cerr << "Invalid RDB file format" << std::endl;
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "Failed to map RDB file " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    // Start reading the whole file in ahead of the parsers
+    madvise(map, size, MADV_WILLNEED);
+    bool ok = rdb_read(static_cast<const unsigned char*>(map), size);
+    munmap(map, size);
+    return ok;
+}
@@ -1,24 +1,95 @@
 // Add to storage.hpp or create a new rdb.hpp file
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
-#include <fstream>
 
 const uint8_t RDB_OPCODE_EOF = 0xFF;
 const uint8_t RDB_OPCODE_SELECTDB = 0xFE;
 const uint8_t RDB_OPCODE_RESIZEDB = 0xFB;
+// Comes before a key's type byte: the key expires at this Unix time in milliseconds,
+// 8 bytes little-endian.
 const uint8_t RDB_OPCODE_EXPIRETIME_MS = 0xFC;
 const uint8_t RDB_OPCODE_AUX = 0xFA;
 const uint8_t RDB_STRING_ENCODING = 0x00;
 const uint8_t RDB_LIST_ENCODING = 0x01;
 const uint8_t RDB_STREAM_ENCODING = 0x02;
+// A stream followed by its last ID, which trimming can leave above its newest entry.
+const uint8_t RDB_STREAM_ENCODING_2 = 0x03;
+// A list as runs of elements. A run is a kind byte, a count, and then for kind 0 that
+// many strings, or for kind 1, 2, 4 or 8 that many integers of that many bytes,
+// little-endian, which stand for the elements that print as them.
+const uint8_t RDB_LIST_PACKED_ENCODING = 0x04;
 
-std::string rdb_encode_length(uint64_t len);
-bool rdb_save_string(std::ofstream& file, const std::string& str);
-bool rdb_load_string(std::ifstream& file, std::string& str);
-uint64_t rdb_load_length(std::ifstream& file);
+// A string whose length byte is 0xC0 | one of these is an integer of 1, 2 or 4 bytes,
+// little-endian, written as its decimal digits.
+const uint8_t RDB_ENC_INT8 = 0;
+const uint8_t RDB_ENC_INT16 = 1;
+const uint8_t RDB_ENC_INT32 = 2;
+
+constexpr size_t RDB_IO_BUFFER_SIZE = 1 << 20;
+
+// Writes a file through a large user-space buffer, so a save costs one write() per
+// RDB_IO_BUFFER_SIZE bytes rather than one per field, and keeps the CRC64 of everything
+// written. A failed write is remembered and reported by flush().
+class RdbWriter {
+public:
+    explicit RdbWriter(int fd);
+    RdbWriter(const RdbWriter&) = delete;
+    RdbWriter& operator=(const RdbWriter&) = delete;
+
+    void write(const void* data, size_t len);
+    void put(uint8_t byte) { write(&byte, 1); }
+    void write_length(uint64_t len);
+    // A string that is a canonical integer in the int32 range is written as one.
+    void write_string(std::string_view str);
+    // Hands the buffer to the kernel; false if any write so far has failed.
+    bool flush();
+    // CRC64 of everything written so far.
+    uint64_t checksum();
+    // Bytes written so far, which is where the next write lands in the file.
+    uint64_t offset() const { return written + used; }
+
+private:
+    int fd;
+    std::vector<char> buf;
+    size_t used = 0;
+    uint64_t written = 0;
+    uint64_t crc = 0;
+    bool failed = false;
+};
+
+// Reported by INFO persistence.
+struct RdbStats {
+    std::atomic<bool> bgsave_in_progress{false};
+    std::atomic<bool> last_bgsave_ok{true};
+    std::atomic<int64_t> last_save_time{0};         // Unix seconds of the last successful save
+    std::atomic<int64_t> last_bgsave_sec{-1};
+    std::atomic<uint64_t> last_fork_usec{0};
+};
+
+extern RdbStats rdb_stats;
+
+enum class BgsaveStatus { Started, InProgress, ForkFailed };
+
+// Saves write a temporary file next to filename, sync it and rename it over filename, so
+// a crash leaves the previous snapshot in place. The file ends with the CRC64 of its
+// contents, which rdb_load() checks; a checksum of 0, as older files have, is not checked.
+// Saves in the foreground, with every shard read-locked throughout.
 bool rdb_save(const std::string& filename);
-bool rdb_load(const std::string& filename);
\ No newline at end of file
+// Saves from a forked child, which is waited for in the background.
+BgsaveStatus rdb_bgsave(const std::string& filename);
+// Maps the file and parses it in place. Each shard's keys are written together, and an
+// index of where each shard's chunk starts, kept in an AUX field just before the EOF
+// opcode, lets the chunks be loaded on several threads into hash tables sized up front;
+// files without the index are loaded on one thread. Keys whose expiry time passed while
+// the server was down are not loaded. On failure the dataset is left empty.
+bool rdb_load(const std::string& filename);
+// Syncs the directory holding filename, so a file just created or renamed there survives a
+// crash.
+bool sync_parent_dir(const std::string& filename);
\ No newline at end of file
@@ -1,85 +1,346 @@
 #include "storage.hpp"
+#include "aof.hpp"
+#include <algorithm>
 #include <thread>
+#include <functional>
 
-std::unordered_map<int, BlockedClientInfo> blocked_clients_info;
-std::unordered_map<std::string, ValueWithExpiry> redis_storage;
-std::unordered_map<std::string, std::vector<std::string>> lists;
-std::unordered_map<int, std::string> pending_responses;
-std::mutex pending_responses_mutex;
+Shard shards[SHARD_COUNT];
+
+// The expiry cron runs up to EXPIRE_CRON_HZ times a second. Each active expire cycle may use
+// ACTIVE_EXPIRE_CYCLE_TIME_PERC percent of its period, and up to
+// ACTIVE_EXPIRE_CYCLE_MAX_TIME_PERC while cycles keep running out of time. A shard is
+// sampled ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP keys at a time, and sampled again as long as
+// more than ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE percent of a sample had expired.
+static constexpr int EXPIRE_CRON_HZ = 10;
+static constexpr int ACTIVE_EXPIRE_CYCLE_TIME_PERC = 25;
+static constexpr int ACTIVE_EXPIRE_CYCLE_MAX_TIME_PERC = 75;
+static constexpr size_t ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP = 20;
+static constexpr size_t ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE = 10;
 
+// Groups of a resizing dictionary moved per shard on each expiry cron run.
+static constexpr size_t DICT_CRON_REHASH_GROUPS = 128;
 
-std::unordered_map<std::string, std::queue<int>> blocked_clients;
-std::unordered_map<int, std::string> client_blocked_on_list;
-std::unordered_set<int> blocked_fds;
+ExpireStats expire_stats;
 
-std::unordered_map<std::string, Stream> streams;
-std::mutex streams_mutex;
+// Shards locked by the current thread, so nested ShardLocks do not self-deadlock.
+static thread_local ShardMask held_shards = 0;
+
+std::unordered_map<int, std::string> pending_responses;
+std::mutex pending_responses_mutex;
 
-std::unordered_map<std::string, std::vector<StreamBlockedClient>> blocked_stream_clients;
-std::unordered_set<int> blocked_stream_fds;
 
-std::unordered_map<int, TransactionState> client_transactions;
-std::mutex transaction_mutex;
+std::unordered_map<std::string, WaiterQueue> list_waiters;
+std::unordered_map<std::string, StreamWaiterIndex> stream_waiters;
+std::unordered_map<int, std::unique_ptr<BlockedClient>> blocked_clients;
 
-std::mutex storage_mutex;
 std::mutex blocked_mutex;
 
-void cleanup_expired_keys() {
-    std::lock_guard<std::mutex> lock(storage_mutex);
-    auto now = Clock::now();
-    for (auto it = redis_storage.begin(); it != redis_storage.end();) {
-        if (it->second.expiry != TimePoint::min() && it->second.expiry <= now) {
-            it = redis_storage.erase(it);
+// The per-map hash also feeds off std::hash, so the shard takes the top bits of a
+// multiplicative mix rather than the low bits the maps bucket on.
+size_t shard_index(std::string_view key) {
+    uint64_t h = std::hash<std::string_view>{}(key);
+    return static_cast<size_t>((h * 0x9E3779B97F4A7C15ULL) >> (64 - SHARD_BITS));
+}
+
+ShardLock::ShardLock(ShardMask mask, LockMode mode) : acquired(mask & ~held_shards), mode(mode) {
+    for (ShardMask m = acquired; m; m &= m - 1) {
+        Shard& shard = shards[__builtin_ctzll(m)];
+        if (mode == LockMode::Write) {
+            shard.mutex.lock();
         } else {
-            ++it;
+            shard.mutex.lock_shared();
         }
     }
+    held_shards |= acquired;
 }
 
-void expiry_monitor() {
-    while (true) {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-        cleanup_expired_keys();
+void ShardLock::release() {
+    for (ShardMask m = acquired; m; m &= m - 1) {
+        Shard& shard = shards[__builtin_ctzll(m)];
+        if (mode == LockMode::Write) {
+            shard.mutex.unlock();
+        } else {
+            shard.mutex.unlock_shared();
+        }
     }
+    held_shards &= ~acquired;
+    acquired = 0;
 }
 
-void remove_blocked_client_fd(int fd) {
-    std::scoped_lock lk(blocked_mutex, storage_mutex);
-    auto it = client_blocked_on_list.find(fd);
-    if (it != client_blocked_on_list.end()) {
-        const std::string list = it->second;
-        
-        std::queue<int> rebuilt;
-        auto &q = blocked_clients[list];
-        while (!q.empty()) {
-            int cur = q.front(); q.pop();
-            if (cur != fd) rebuilt.push(cur);
+static bool key_expired(const Shard& shard, const DictEntry& entry, TimePoint now) {
+    if (!entry.value.expires || aof_loading) return false;
+    auto it = shard.expires.find(entry.key());
+    return it != shard.expires.end() && now >= it->second;
+}
+
+RedisObject* lookup_key_read(Shard& shard, std::string_view key) {
+    DictEntry* entry = shard.keys.find(key);
+    if (!entry || key_expired(shard, *entry, Clock::now())) return nullptr;
+    entry->value.touch();
+    return &entry->value;
+}
+
+RedisObject* lookup_key_write(Shard& shard, std::string_view key) {
+    DictEntry* entry = shard.keys.find(key);
+    if (!entry) return nullptr;
+    if (key_expired(shard, *entry, Clock::now())) {
+        // The AOF records an expiry as the DEL it causes.
+        aof_append({"DEL", key});
+        delete_key(shard, key);
+        expire_stats.expired_keys.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    entry->value.touch();
+    return &entry->value;
+}
+
+RedisObject& set_key(Shard& shard, std::string_view key, RedisObject&& value) {
+    auto [entry, inserted] = shard.keys.try_emplace(key, std::move(value));
+    if (!inserted) {
+        if (entry->value.expires) shard.expires.erase(entry->key());
+        entry->value = std::move(value);
+        entry->value.expires = false;
+    }
+    return entry->value;
+}
+
+bool delete_key(Shard& shard, std::string_view key) {
+    DictEntry* entry = shard.keys.find(key);
+    if (!entry) return false;
+    if (entry->value.expires) shard.expires.erase(entry->key());
+    return shard.keys.erase(key);
+}
+
+void set_expiry(Shard& shard, std::string_view key, TimePoint when) {
+    DictEntry* entry = shard.keys.find(key);
+    if (!entry) return;
+    shard.expires.insert_or_assign(entry->key(), when);
+    entry->value.expires = true;
+}
+
+void remove_expiry(Shard& shard, std::string_view key) {
+    DictEntry* entry = shard.keys.find(key);
+    if (!entry || !entry->value.expires) return;
+    shard.expires.erase(entry->key());
+    entry->value.expires = false;
+}
+
+bool expiry_after(TimePoint now, long long ms, TimePoint& when) {
+    if (ms > std::chrono::duration_cast<std::chrono::milliseconds>(TimePoint::max() - now).count()) return false;
+    when = now + std::chrono::milliseconds(ms);
+    return true;
+}
+
+TimePoint get_expiry(const Shard& shard, const DictEntry& entry) {
+    if (!entry.value.expires) return TimePoint::min();
+    auto it = shard.expires.find(entry.key());
+    return it == shard.expires.end() ? TimePoint::min() : it->second;
+}
+
+// Samples the shard's keys with a TTL, walking the expires table's buckets from the
+// shard's cursor, and deletes the ones that have expired.
+static void expire_sample(Shard& shard, TimePoint now, size_t& sampled, size_t& expired) {
+    auto& table = shard.expires;
+    std::string_view victims[ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP];
+    size_t buckets = table.bucket_count();
+    size_t max_buckets = std::min(buckets, ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP * 20);
+    for (size_t visited = 0; visited < max_buckets && sampled < ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP; ++visited) {
+        size_t bucket = shard.expire_cursor++ % buckets;
+        for (auto it = table.begin(bucket); it != table.end(bucket) && sampled < ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP; ++it) {
+            ++sampled;
+            if (now >= it->second) victims[expired++] = it->first;
         }
-        q.swap(rebuilt);
-        client_blocked_on_list.erase(fd);
     }
-    blocked_fds.erase(fd);
-}
-
-void remove_blocked_stream_client_fd(int fd) {
-    std::scoped_lock lk(blocked_mutex, streams_mutex);
-    
-    for (auto& [stream_key, clients] : blocked_stream_clients) {
-        for (auto it = clients.begin(); it != clients.end();) {
-            if (it->fd == fd) {
-                it = clients.erase(it);
-            } else {
-                ++it;
+    for (size_t i = 0; i < expired; ++i) {
+        aof_append({"DEL", victims[i]});
+        table.erase(victims[i]);
+        shard.keys.erase(victims[i]);
+    }
+}
+
+// Deletes expired keys without scanning the keyspace, as Redis's activeExpireCycle does.
+// Shards are visited in turn and each is sampled in short batches, each under its own
+// write lock, so commands interleave with the cycle instead of waiting for it. A shard
+// where many sampled keys had expired is sampled again straight away; the cycle stops
+// when its time budget runs out and the next one resumes at the following shard.
+// Returns whether any key with a TTL was seen.
+static bool active_expire_cycle() {
+    static size_t next_shard = 0;
+    static int time_perc = ACTIVE_EXPIRE_CYCLE_TIME_PERC;
+
+    auto start = Clock::now();
+    auto budget = std::chrono::microseconds(1000000 / EXPIRE_CRON_HZ * time_perc / 100);
+    size_t total_sampled = 0;
+    size_t total_expired = 0;
+    bool timelimit_exit = false;
+    bool has_ttls = false;
+
+    for (size_t n = 0; n < SHARD_COUNT && !timelimit_exit; ++n) {
+        Shard& shard = shards[next_shard];
+        next_shard = (next_shard + 1) % SHARD_COUNT;
+        for (size_t iteration = 1;; ++iteration) {
+            size_t sampled = 0;
+            size_t expired = 0;
+            {
+                std::lock_guard<std::shared_mutex> lock(shard.mutex);
+                if (shard.expires.empty()) break;
+                has_ttls = true;
+                expire_sample(shard, Clock::now(), sampled, expired);
+            }
+            total_sampled += sampled;
+            total_expired += expired;
+            if (iteration % 16 == 0 && Clock::now() - start > budget) {
+                timelimit_exit = true;
+                break;
             }
+            if (sampled == 0 || expired * 100 <= sampled * ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE) break;
         }
     }
-    
-    blocked_stream_fds.erase(fd);
+
+    // A cycle that ran out of time leaves expired keys behind, so the next one gets a
+    // bigger share of the period until a cycle finishes within its budget.
+    if (timelimit_exit) {
+        time_perc = std::min(time_perc * 2, ACTIVE_EXPIRE_CYCLE_MAX_TIME_PERC);
+        expire_stats.time_cap_reached.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        time_perc = ACTIVE_EXPIRE_CYCLE_TIME_PERC;
+    }
+
+    auto usec = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+    double stale = total_sampled ? static_cast<double>(total_expired) * 100 / total_sampled : 0;
+    double stale_avg = expire_stats.stale_perc.load(std::memory_order_relaxed);
+    expire_stats.stale_perc.store(stale * 0.05 + stale_avg * 0.95, std::memory_order_relaxed);
+    expire_stats.expired_keys.fetch_add(total_expired, std::memory_order_relaxed);
+    expire_stats.cycles.fetch_add(1, std::memory_order_relaxed);
+    expire_stats.cycle_usec.fetch_add(static_cast<uint64_t>(usec), std::memory_order_relaxed);
+    expire_stats.last_cycle_expired.store(total_expired, std::memory_order_relaxed);
+    expire_stats.last_cycle_usec.store(static_cast<uint64_t>(usec), std::memory_order_relaxed);
+    return has_ttls || timelimit_exit;
+}
+
+// Moves resizing dictionaries along, so a resize finishes even when a shard sees no writes.
+// Returns whether any dictionary is still resizing.
+// An expires table left mostly empty by a wave of expirations is shrunk as well, which
+// keeps the active expire cycle from sampling empty buckets; it is small by then.
+static bool incrementally_rehash() {
+    bool rehashing = false;
+    for (Shard& shard : shards) {
+        std::lock_guard<std::shared_mutex> lock(shard.mutex);
+        shard.keys.resize_if_needed();
+        shard.keys.rehash_steps(DICT_CRON_REHASH_GROUPS);
+        rehashing |= shard.keys.is_rehashing();
+        if (shard.expires.bucket_count() > 64 && shard.expires.size() * 8 < shard.expires.bucket_count()) {
+            shard.expires.rehash(0);
+        }
+    }
+    return rehashing;
 }
 
-void remove_client_transaction(int fd) {
-    std::lock_guard<std::mutex> lock(transaction_mutex);
-    client_transactions.erase(fd);
+// Runs EXPIRE_CRON_HZ times a second while some shard has keys with a TTL or a resizing
+// dictionary, and otherwise once a second, just to keep the LRU clock current.
+std::chrono::milliseconds expire_cron() {
+    update_lru_clock();
+    bool busy = active_expire_cycle();
+    busy |= incrementally_rehash();
+    return std::chrono::milliseconds(busy ? 1000 / EXPIRE_CRON_HZ : 1000);
+}
+
+void remove_blocked_client_fd(int fd) {
+    std::lock_guard<std::mutex> lk(blocked_mutex);
+    unblock_client(fd);
+}
+
+bool block_list_client(int fd, uint64_t connection_id, const std::vector<std::string>& keys, ListEnd where,
+                       TimePoint deadline) {
+    if (blocked_clients.count(fd)) return false;
+    auto client = std::make_unique<BlockedClient>();
+    client->fd = fd;
+    client->connection_id = connection_id;
+    client->where = where;
+    client->deadline = deadline;
+    client->waits.reserve(keys.size());
+    for (const std::string& key : keys) {
+        auto [it, inserted] = list_waiters.try_emplace(key);
+        bool duplicate = std::any_of(client->waits.begin(), client->waits.end(),
+                                     [&](const KeyWaiter& w) { return w.queue == &it->second; });
+        if (duplicate) continue;
+        client->waits.push_back({client.get(), &it->second, &it->first});
+    }
+    for (KeyWaiter& w : client->waits) {
+        w.prev = w.queue->tail;
+        if (w.queue->tail) {
+            w.queue->tail->next = &w;
+        } else {
+            w.queue->head = &w;
+        }
+        w.queue->tail = &w;
+    }
+    blocked_clients.emplace(fd, std::move(client));
+    return true;
+}
+
+BlockedClient* first_list_waiter(const std::string& key) {
+    auto it = list_waiters.find(key);
+    return it == list_waiters.end() ? nullptr : it->second.head->client;
+}
+
+bool block_stream_client(int fd, uint64_t connection_id, const std::vector<std::string>& keys,
+                         const std::vector<StreamID>& ids, TimePoint deadline) {
+    if (blocked_clients.count(fd)) return false;
+    auto client = std::make_unique<BlockedClient>();
+    client->fd = fd;
+    client->connection_id = connection_id;
+    client->deadline = deadline;
+    client->where = ListEnd::Head;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto [it, inserted] = stream_waiters.try_emplace(keys[i]);
+        bool duplicate = std::any_of(client->stream_waits.begin(), client->stream_waits.end(),
+                                     [&](const StreamWaiter& w) { return w.index == &it->second; });
+        if (duplicate) continue;
+        client->stream_waits.push_back({&it->second, &it->first, it->second.emplace(ids[i], client.get())});
+    }
+    blocked_clients.emplace(fd, std::move(client));
+    return true;
+}
+
+// A queue or index is dropped with its last waiter, so list_waiters and stream_waiters
+// only hold keys someone waits on.
+void unblock_client(int fd) {
+    auto it = blocked_clients.find(fd);
+    if (it == blocked_clients.end()) return;
+    for (KeyWaiter& w : it->second->waits) {
+        if (w.prev) {
+            w.prev->next = w.next;
+        } else {
+            w.queue->head = w.next;
+        }
+        if (w.next) {
+            w.next->prev = w.prev;
+        } else {
+            w.queue->tail = w.prev;
+        }
+        if (!w.queue->head) list_waiters.erase(list_waiters.find(*w.key));
+    }
+    for (StreamWaiter& w : it->second->stream_waits) {
+        w.index->erase(w.pos);
+        if (w.index->empty()) stream_waiters.erase(stream_waiters.find(*w.key));
+    }
+    blocked_clients.erase(it);
+}
+
+bool is_client_blocked(int fd) {
+    std::lock_guard<std::mutex> lk(blocked_mutex);
+    return client_is_blocked(fd);
+}
+
+bool client_is_blocked(int fd) {
+    return blocked_clients.count(fd) != 0;
+}
+
+TimePoint blocked_client_deadline(int fd) {
+    std::lock_guard<std::mutex> lk(blocked_mutex);
+    auto it = blocked_clients.find(fd);
+    return it == blocked_clients.end() ? TimePoint::max() : it->second->deadline;
 }
 
 std::string rdb_filename = "dump.rdb";
@@ -89,13 +350,8 @@ bool rdb_enabled = true;
 void rdb_background_saver() {
     while (true) {
         std::this_thread::sleep_for(std::chrono::seconds(rdb_save_interval));
-        if (rdb_enabled) {
+        if (rdb_enabled && rdb_bgsave(rdb_filename) == BgsaveStatus::Started) {
             std::cout << "Background saving started" << std::endl;
-            if (rdb_save(rdb_filename)) {
-                std::cout << "Background saving completed" << std::endl;
-            } else {
-                std::cerr << "Background saving failed" << std::endl;
-            }
         }
     }
-}
\ No newline at end of file
+}
@@ -2,76 +2,171 @@
 #include <string>
 #include <unordered_map>
 #include <vector>
-#include <queue>
-#include <unordered_set>
+#include <atomic>
 #include <mutex>
+#include <shared_mutex>
 #include <chrono>
-#include <queue>
+#include <map>
+#include <memory>
 #include <iostream>
+#include <cstdint>
+#include <string_view>
+#include "dict.hpp"
+#include "object.hpp"
 #include "rdb.hpp"
 
-using Clock = std::chrono::steady_clock;
-using TimePoint = std::chrono::time_point<Clock>;
-using StreamEntry = std::unordered_map<std::string, std::string>;
-using Stream = std::vector<std::pair<std::string, StreamEntry>>;
-
-extern std::unordered_map<std::string, Stream> streams;
-extern std::mutex streams_mutex;
-
-struct ValueWithExpiry {
-    std::string value;
-    TimePoint expiry;
+// The keyspace is split into SHARD_COUNT shards, each with its own map and reader-writer
+// lock; the key's hash picks the shard.
+constexpr size_t SHARD_BITS = 6;
+constexpr size_t SHARD_COUNT = size_t(1) << SHARD_BITS;
+
+struct Shard {
+    std::shared_mutex mutex;
+    Dict keys;
+    // TTLs of the keys that have one, keyed by a view of the key's bytes in `keys`.
+    std::unordered_map<std::string_view, TimePoint> expires;
+    size_t expire_cursor = 0;   // next expires bucket the active expire cycle samples
 };
 
-struct BlockedClientInfo {
-    int fd;
-    std::string list_name;
-    TimePoint expiry;
+extern Shard shards[SHARD_COUNT];
+
+using ShardMask = uint64_t;
+static_assert(SHARD_COUNT <= 64, "ShardMask holds one bit per shard");
+constexpr ShardMask ALL_SHARDS = SHARD_COUNT == 64 ? ~ShardMask(0) : (ShardMask(1) << SHARD_COUNT) - 1;
+
+size_t shard_index(std::string_view key);
+inline Shard& shard_for(std::string_view key) { return shards[shard_index(key)]; }
+inline ShardMask shard_bit(std::string_view key) { return ShardMask(1) << shard_index(key); }
+
+// Return the live object stored at key, or nullptr. A read leaves an expired key in place
+// for a writer or the expiry sweep to delete (it only holds a read lock); a write lookup
+// deletes it. Both refresh the object's LRU clock. Callers hold the shard's lock.
+RedisObject* lookup_key_read(Shard& shard, std::string_view key);
+RedisObject* lookup_key_write(Shard& shard, std::string_view key);
+// set_key replaces any previous value of key and drops its TTL.
+RedisObject& set_key(Shard& shard, std::string_view key, RedisObject&& value);
+bool delete_key(Shard& shard, std::string_view key);
+
+// TTLs of existing keys. get_expiry returns TimePoint::min() for a key without one.
+void set_expiry(Shard& shard, std::string_view key, TimePoint when);
+void remove_expiry(Shard& shard, std::string_view key);
+TimePoint get_expiry(const Shard& shard, const DictEntry& entry);
+// Sets when to now + ms, or returns false if that lies past TimePoint::max().
+bool expiry_after(TimePoint now, long long ms, TimePoint& when);
+
+enum class LockMode { Read, Write };
+
+// Locks a set of shards, always in ascending shard order so that any two multi-key
+// commands agree on the order. Shards the calling thread already holds are skipped: EXEC
+// write-locks every shard its queued commands touch and the commands then run under it.
+// Lock order: shard locks are taken before blocked_mutex.
+class ShardLock {
+public:
+    ShardLock(ShardMask mask, LockMode mode);
+    ShardLock(Shard& shard, LockMode mode) : ShardLock(ShardMask(1) << (&shard - shards), mode) {}
+    ~ShardLock() { release(); }
+    ShardLock(const ShardLock&) = delete;
+    ShardLock& operator=(const ShardLock&) = delete;
+
+    void release();
+
+private:
+    ShardMask acquired;
+    LockMode mode;
 };
 
-struct StreamBlockedClient {
-    int fd;
-    std::string last_id;
-    TimePoint expiry;
+struct BlockedClient;
+struct KeyWaiter;
+
+// Clients blocked on one key, oldest first.
+struct WaiterQueue {
+    KeyWaiter* head = nullptr;
+    KeyWaiter* tail = nullptr;
 };
 
-struct TransactionState {
-    bool in_transaction;
-    std::vector<std::string> queued_commands;
-    
-    TransactionState() : in_transaction(false) {}
-    TransactionState(bool in_tx, const std::vector<std::string>& cmds) 
-        : in_transaction(in_tx), queued_commands(cmds) {}
+// A blocked client's place in the wait queue of one key. Queues are intrusive doubly
+// linked lists, so a client leaves each of its queues in O(1) however many wait.
+struct KeyWaiter {
+    BlockedClient* client;
+    WaiterQueue* queue;
+    const std::string* key;     // the queue's key in list_waiters
+    KeyWaiter* prev = nullptr;
+    KeyWaiter* next = nullptr;
 };
 
-extern std::unordered_map<int, TransactionState> client_transactions;
-extern std::mutex transaction_mutex;
+// XREAD clients blocked on one stream, ordered by the ID each has read up to. The
+// clients a new entry serves are a prefix of the index, and clients that have read up to
+// the same ID sit next to each other.
+using StreamWaiterIndex = std::multimap<StreamID, BlockedClient*>;
 
-extern std::unordered_map<std::string, std::vector<StreamBlockedClient>> blocked_stream_clients;
-extern std::unordered_set<int> blocked_stream_fds;
+// A blocked client's place in the waiter index of one stream.
+struct StreamWaiter {
+    StreamWaiterIndex* index;
+    const std::string* key;     // the index's key in stream_waiters
+    StreamWaiterIndex::iterator pos;
+};
 
-extern std::unordered_map<int, BlockedClientInfo> blocked_clients_info;
-extern std::unordered_map<std::string, ValueWithExpiry> redis_storage;
-extern std::unordered_map<std::string, std::vector<std::string>> lists;
+// A client blocked in BLPOP, BRPOP or XREAD BLOCK. It waits on each of its keys at once;
+// the first key to get data serves it, and it leaves all its queues and indexes together.
+struct BlockedClient {
+    int fd;
+    uint64_t connection_id;                 // tells this client apart from a later one on fd
+    TimePoint deadline;
+    ListEnd where;                          // BLPOP/BRPOP: end of the list it pops from
+    std::vector<KeyWaiter> waits;           // BLPOP/BRPOP: one per distinct key; never resized once queued
+    std::vector<StreamWaiter> stream_waits; // XREAD: one per distinct stream
+};
 
 extern std::unordered_map<int, std::string> pending_responses;
 extern std::mutex pending_responses_mutex;
 
 
-extern std::unordered_map<std::string, std::queue<int>> blocked_clients; 
-extern std::unordered_map<int, std::string> client_blocked_on_list;      
-extern std::unordered_set<int> blocked_fds;
+extern std::unordered_map<std::string, WaiterQueue> list_waiters;
+extern std::unordered_map<std::string, StreamWaiterIndex> stream_waiters;
+extern std::unordered_map<int, std::unique_ptr<BlockedClient>> blocked_clients;
 
-extern std::mutex storage_mutex;
 extern std::mutex blocked_mutex;
 
-void cleanup_expired_keys();
-void expiry_monitor();
+// Active expiry counters, written by the expiry cron and read by INFO. expired_keys also
+// counts keys deleted lazily when a write finds them expired.
+struct ExpireStats {
+    std::atomic<uint64_t> expired_keys{0};
+    std::atomic<uint64_t> cycles{0};
+    std::atomic<uint64_t> cycle_usec{0};
+    std::atomic<uint64_t> time_cap_reached{0};      // cycles stopped by their time budget
+    std::atomic<uint64_t> last_cycle_expired{0};
+    std::atomic<uint64_t> last_cycle_usec{0};
+    std::atomic<double> stale_perc{0};              // running estimate of expired keys among sampled ones
+};
+
+extern ExpireStats expire_stats;
+
+// One round of key expiry and dictionary upkeep; returns the delay until the next round.
+// Driven by a timer on the first reactor.
+std::chrono::milliseconds expire_cron();
+
+// Queues fd behind the clients already waiting on each of keys. Needs blocked_mutex.
+// Both this and block_stream_client() refuse, returning false, a client that is already
+// blocked: its old entry is still linked into the queues of its keys.
+bool block_list_client(int fd, uint64_t connection_id, const std::vector<std::string>& keys, ListEnd where,
+                       TimePoint deadline);
+// The longest-waiting client blocked on key, or nullptr. Needs blocked_mutex.
+BlockedClient* first_list_waiter(const std::string& key);
+// Enters fd in the waiter index of each stream in keys, under the ID it has read up to
+// there. Needs blocked_mutex.
+bool block_stream_client(int fd, uint64_t connection_id, const std::vector<std::string>& keys,
+                         const std::vector<StreamID>& ids, TimePoint deadline);
 
 void remove_blocked_client_fd(int fd);
-void remove_blocked_stream_client_fd(int fd);
+// The same, for callers that already hold blocked_mutex.
+void unblock_client(int fd);
+bool is_client_blocked(int fd);
+// The same, for callers that already hold blocked_mutex.
+bool client_is_blocked(int fd);
+// When a blocked client's BLPOP or XREAD BLOCK times out; TimePoint::max() if it waits
+// indefinitely or is not blocked.
+TimePoint blocked_client_deadline(int fd);
 
-void remove_client_transaction(int fd);
 void rdb_background_saver();
 
 extern std::string rdb_filename;
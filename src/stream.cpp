@@ -0,0 +1,241 @@
+#include "stream.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+size_t stream_node_max_bytes = 4096;
+size_t stream_node_max_entries = 100;
+
+size_t format_stream_id(StreamID id, char* buf) {
+    char* p = std::to_chars(buf, buf + 20, id.ms).ptr;
+    *p++ = '-';
+    return static_cast<size_t>(std::to_chars(p, p + 20, id.seq).ptr - buf);
+}
+
+static bool parse_uint(const char* first, const char* last, uint64_t& value) {
+    auto [end, ec] = std::from_chars(first, last, value);
+    return ec == std::errc() && end == last;
+}
+
+bool parse_stream_id(std::string_view text, StreamID& id, uint64_t missing_seq) {
+    const char* first = text.data();
+    const char* last = first + text.size();
+    const char* dash = std::find(first, last, '-');
+    if (!parse_uint(first, dash, id.ms)) return false;
+    if (dash == last) {
+        id.seq = missing_seq;
+        return true;
+    }
+    return parse_uint(dash + 1, last, id.seq);
+}
+
+static unsigned char* lp_append_uint(unsigned char* lp, uint64_t value) {
+    char buf[20];
+    char* end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+    return lp_append(lp, std::string_view(buf, static_cast<size_t>(end - buf)));
+}
+
+static unsigned char* lp_replace_uint(unsigned char* lp, const unsigned char* p, uint64_t value) {
+    char buf[20];
+    char* end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+    return lp_replace(lp, p, std::string_view(buf, static_cast<size_t>(end - buf)));
+}
+
+static uint64_t lp_get_uint(const unsigned char* p) {
+    std::string_view s = lp_get(p);
+    uint64_t value = 0;
+    std::from_chars(s.data(), s.data() + s.size(), value);
+    return value;
+}
+
+static void encode_key(StreamID id, unsigned char* key) {
+    for (int i = 0; i < 8; ++i) {
+        key[i] = static_cast<unsigned char>(id.ms >> (56 - 8 * i));
+        key[8 + i] = static_cast<unsigned char>(id.seq >> (56 - 8 * i));
+    }
+}
+
+static StreamID decode_key(const unsigned char* key) {
+    StreamID id;
+    for (int i = 0; i < 8; ++i) {
+        id.ms = (id.ms << 8) | key[i];
+        id.seq = (id.seq << 8) | key[8 + i];
+    }
+    return id;
+}
+
+Stream::~Stream() {
+    RadixTree::Iterator it(blocks);
+    for (it.seek_first(); it.valid(); it.next()) lp_free(static_cast<unsigned char*>(it.value()));
+}
+
+void Stream::append(StreamID id, const std::string_view* fields_and_values, size_t count) {
+    size_t field_count = count / 2;
+    unsigned char* lp = tail ? static_cast<unsigned char*>(*tail) : nullptr;
+    if (lp && ((stream_node_max_entries && lp_get_uint(lp_first(lp)) >= stream_node_max_entries) ||
+               (stream_node_max_bytes && lp_bytes(lp) >= stream_node_max_bytes))) {
+        lp = nullptr;
+    }
+    if (!lp) {
+        lp = lp_append_uint(lp_new(), 0);
+        lp = lp_append_uint(lp, field_count);
+        for (size_t i = 0; i < count; i += 2) lp = lp_append(lp, fields_and_values[i]);
+        unsigned char key[RadixTree::KEY_LEN];
+        encode_key(id, key);
+        tail = blocks.insert(key, lp);
+        tail_master = id;
+    }
+
+    const unsigned char* master = lp_next(lp, lp_first(lp));
+    bool same_fields = lp_get_uint(master) == field_count;
+    for (size_t i = 0; same_fields && i < count; i += 2) {
+        master = lp_next(lp, master);
+        same_fields = lp_get(master) == fields_and_values[i];
+    }
+
+    lp = lp_append_uint(lp, id.ms - tail_master.ms);
+    lp = lp_append_uint(lp, id.seq);
+    lp = lp_append_uint(lp, same_fields ? 0 : field_count);
+    for (size_t i = same_fields ? 1 : 0; i < count; i += same_fields ? 2 : 1) {
+        lp = lp_append(lp, fields_and_values[i]);
+    }
+
+    lp = lp_replace_uint(lp, lp_first(lp), lp_get_uint(lp_first(lp)) + 1);
+    *tail = lp;
+    ++length;
+    last = id;
+}
+
+size_t Stream::trim_max_len(size_t max_len, bool approximate, size_t limit) {
+    if (length <= max_len) return 0;
+    return trim(TrimBy::MaxLen, max_len, StreamID{}, approximate, limit);
+}
+
+size_t Stream::trim_min_id(StreamID min_id, bool approximate, size_t limit) {
+    return trim(TrimBy::MinId, 0, min_id, approximate, limit);
+}
+
+// Only the first block is ever looked at. Whether all of it goes is known without reading
+// its entries: from its entry count for a length, and for an ID from where the next block
+// starts (or the stream's last ID, for the last block). That can miss a block whose
+// entries all fall in the gap below the next block's ID; an exact trim still removes them
+// one by one.
+size_t Stream::trim(TrimBy by, size_t max_len, StreamID min_id, bool approximate, size_t limit) {
+    size_t removed = 0;
+    RadixTree::Iterator it(blocks);
+    while (length > 0) {
+        it.seek_first();
+        unsigned char key[RadixTree::KEY_LEN];
+        memcpy(key, it.key(), sizeof(key));
+        auto* lp = static_cast<unsigned char*>(it.value());
+        size_t entries = lp_get_uint(lp_first(lp));
+
+        bool whole;
+        if (by == TrimBy::MaxLen) {
+            whole = length - entries >= max_len;
+        } else {
+            it.next();
+            whole = it.valid() ? decode_key(it.key()) <= min_id : last < min_id;
+        }
+        if (whole) {
+            if (limit && removed + entries > limit) break;
+            erase_block(key);
+            length -= entries;
+            removed += entries;
+            continue;
+        }
+        if (approximate) break;
+
+        StreamID master = decode_key(key);
+        const unsigned char* p = lp_next(lp, lp_first(lp));
+        size_t master_field_count = lp_get_uint(p);
+        p = lp_next(lp, p);
+        for (size_t i = 0; i < master_field_count; ++i) p = lp_next(lp, p);
+        const unsigned char* first = p;
+        size_t cut = 0;
+        size_t elements = 0;
+        while (cut < entries) {
+            const unsigned char* seq = lp_next(lp, p);
+            StreamID id{master.ms + lp_get_uint(p), lp_get_uint(seq)};
+            if (by == TrimBy::MaxLen ? length - cut <= max_len : id >= min_id) break;
+            size_t field_count = lp_get_uint(lp_next(lp, seq));
+            size_t n = 3 + (field_count == 0 ? master_field_count : field_count * 2);
+            for (size_t i = 0; i < n; ++i) p = lp_next(lp, p);
+            elements += n;
+            ++cut;
+        }
+        length -= cut;
+        removed += cut;
+        if (cut == entries) {
+            erase_block(key);
+            continue;
+        }
+        if (cut > 0) {
+            lp = lp_delete(lp, first, elements);
+            lp = lp_replace_uint(lp, lp_first(lp), entries - cut);
+            *blocks.find(key) = lp;
+        }
+        break;
+    }
+    return removed;
+}
+
+// Erasing can move the slots of other blocks, the last block's included.
+void Stream::erase_block(const unsigned char* key) {
+    lp_free(static_cast<unsigned char*>(*blocks.find(key)));
+    blocks.erase(key);
+    unsigned char tail_key[RadixTree::KEY_LEN];
+    encode_key(tail_master, tail_key);
+    tail = blocks.find(tail_key);
+}
+
+StreamIterator::StreamIterator(const Stream& stream, StreamID start) : block(stream.blocks) {
+    unsigned char key[RadixTree::KEY_LEN];
+    encode_key(start, key);
+    block.seek_le(key);
+    if (!block.valid()) block.seek_first();
+    enter_block();
+    while (entry && current < start) next();
+}
+
+void StreamIterator::enter_block() {
+    for (; block.valid(); block.next()) {
+        lp = static_cast<const unsigned char*>(block.value());
+        master = decode_key(block.key());
+        const unsigned char* p = lp_next(lp, lp_first(lp));
+        master_field_count = lp_get_uint(p);
+        master_fields = lp_next(lp, p);
+        p = master_fields;
+        for (size_t i = 0; i < master_field_count; ++i) p = lp_next(lp, p);
+        if (p) {
+            load_entry(p);
+            return;
+        }
+    }
+    entry = nullptr;
+}
+
+void StreamIterator::load_entry(const unsigned char* p) {
+    entry = p;
+    current.ms = master.ms + lp_get_uint(p);
+    p = lp_next(lp, p);
+    current.seq = lp_get_uint(p);
+    p = lp_next(lp, p);
+    size_t count = lp_get_uint(p);
+    same_fields = count == 0;
+    fields = same_fields ? master_field_count : count;
+    values = lp_next(lp, p);
+}
+
+void StreamIterator::next() {
+    const unsigned char* p = values;
+    size_t elements = same_fields ? fields : fields * 2;
+    for (size_t i = 0; i < elements; ++i) p = lp_next(lp, p);
+    if (p) {
+        load_entry(p);
+        return;
+    }
+    block.next();
+    enter_block();
+}
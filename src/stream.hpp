@@ -0,0 +1,133 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include "listpack.hpp"
+#include "radix.hpp"
+
+// Fill limits of a stream block, as Redis's stream-node-max-bytes and
+// stream-node-max-entries; a new block is started once either is reached. 0 disables a
+// limit.
+extern size_t stream_node_max_bytes;
+extern size_t stream_node_max_entries;
+
+struct StreamID {
+    uint64_t ms = 0;
+    uint64_t seq = 0;
+};
+
+inline bool operator==(StreamID a, StreamID b) { return a.ms == b.ms && a.seq == b.seq; }
+inline bool operator!=(StreamID a, StreamID b) { return !(a == b); }
+inline bool operator<(StreamID a, StreamID b) { return a.ms < b.ms || (a.ms == b.ms && a.seq < b.seq); }
+inline bool operator>(StreamID a, StreamID b) { return b < a; }
+inline bool operator<=(StreamID a, StreamID b) { return !(b < a); }
+inline bool operator>=(StreamID a, StreamID b) { return !(a < b); }
+
+// Longest ID text: two 20-digit numbers and the dash.
+constexpr size_t STREAM_ID_MAX_LEN = 41;
+
+// Writes id as "ms-seq" to buf, which must have room for STREAM_ID_MAX_LEN bytes, and
+// returns the length written.
+size_t format_stream_id(StreamID id, char* buf);
+// Parses "ms-seq", or "ms" alone taking missing_seq as the sequence number. Both parts are
+// plain decimal numbers that fit 64 bits.
+bool parse_stream_id(std::string_view text, StreamID& id, uint64_t missing_seq = 0);
+
+// A stream, stored as Redis stores one: entries are packed in order into listpack blocks,
+// and a radix tree maps the ID of each block's first entry, written big-endian, to the
+// block. Appending only touches the last block, and finding an ID descends the tree to
+// its block and scans at most one block's entries.
+//
+// A block starts with its entry count and the field names of its first entry (the master
+// fields). Each entry follows as its ID's distance from the block's master ID (ms
+// difference, then the sequence number), and then either a 0 and the values, when its
+// fields are the master fields in the same order, or its field count and its
+// field/value pairs. Numbers are stored as decimal strings.
+class Stream {
+public:
+    Stream() = default;
+    ~Stream();
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    // The ID of the newest entry ever added; 0-0 before the first.
+    StreamID last_id() const { return last; }
+    size_t block_count() const { return blocks.size(); }
+
+    // Adds an entry of count / 2 field/value pairs, given alternately. id must be above
+    // last_id().
+    void append(StreamID id, const std::string_view* fields_and_values, size_t count);
+    // Raises last_id(), as when restoring a stream whose newest entries were trimmed away.
+    void set_last_id(StreamID id) { if (id > last) last = id; }
+
+    // Remove the oldest entries: those beyond the newest max_len, or those below min_id.
+    // Exact trims also cut into the oldest remaining block. Approximate ones only drop
+    // whole blocks, stopping at the first block that holds an entry to keep or that would
+    // take the count removed past limit (0 for no limit), so each costs O(1) per block
+    // however many entries it holds. Both return the number of entries removed.
+    size_t trim_max_len(size_t max_len, bool approximate, size_t limit = 0);
+    size_t trim_min_id(StreamID min_id, bool approximate, size_t limit = 0);
+
+private:
+    friend class StreamIterator;
+
+    enum class TrimBy { MaxLen, MinId };
+
+    size_t trim(TrimBy by, size_t max_len, StreamID min_id, bool approximate, size_t limit);
+    void erase_block(const unsigned char* key);
+
+    RadixTree blocks;
+    void** tail = nullptr;      // slot of the last block in blocks
+    StreamID tail_master;
+    size_t length = 0;
+    StreamID last;
+};
+
+// Walks a stream's entries in ID order. Any change to the stream invalidates it.
+class StreamIterator {
+public:
+    // Positioned at the first entry whose ID is at least start.
+    StreamIterator(const Stream& stream, StreamID start);
+
+    bool valid() const { return entry != nullptr; }
+    StreamID id() const { return current; }
+    size_t field_count() const { return fields; }
+    void next();
+
+    // Calls fn(field, value) for each of the entry's fields in order.
+    template <typename Fn>
+    void for_each_field(Fn&& fn) const {
+        const unsigned char* master = master_fields;
+        const unsigned char* p = values;
+        for (size_t i = 0; i < fields; ++i) {
+            std::string_view field;
+            if (same_fields) {
+                field = lp_get(master);
+                master = lp_next(lp, master);
+            } else {
+                field = lp_get(p);
+                p = lp_next(lp, p);
+            }
+            std::string_view value = lp_get(p);
+            p = lp_next(lp, p);
+            fn(field, value);
+        }
+    }
+
+private:
+    void enter_block();
+    void load_entry(const unsigned char* p);
+
+    RadixTree::Iterator block;
+    const unsigned char* lp = nullptr;
+    const unsigned char* master_fields = nullptr;
+    size_t master_field_count = 0;
+    StreamID master;
+    const unsigned char* entry = nullptr;       // the current entry's first element
+    const unsigned char* values = nullptr;      // its first field, or first value with the master fields
+    StreamID current;
+    size_t fields = 0;
+    bool same_fields = false;
+};
@@ -0,0 +1,148 @@
+#include "timer.hpp"
+
+#include <algorithm>
+#include <climits>
+
+TimerWheel::TimerWheel() : origin(Clock::now()) {}
+
+// Deadlines round up to the next tick, so a timer never fires early.
+uint64_t TimerWheel::tick_at(Clock::time_point when) const {
+    if (when <= origin) return 0;
+    return static_cast<uint64_t>(std::chrono::ceil<std::chrono::milliseconds>(when - origin).count());
+}
+
+// The last tick that has fully elapsed at now.
+uint64_t TimerWheel::elapsed_ticks(Clock::time_point now) const {
+    if (now <= origin) return 0;
+    return static_cast<uint64_t>(std::chrono::floor<std::chrono::milliseconds>(now - origin).count());
+}
+
+TimerId TimerWheel::add(Clock::time_point when, Callback callback) {
+    Node* node;
+    if (!free_nodes.empty()) {
+        node = free_nodes.back();
+        free_nodes.pop_back();
+    } else {
+        nodes.emplace_back();
+        node = &nodes.back();
+        node->index = static_cast<uint32_t>(nodes.size() - 1);
+    }
+    node->tick = when == Clock::time_point::max() ? UINT64_MAX : tick_at(when);
+    node->callback = std::move(callback);
+    place(node, current + 1);
+    ++active;
+    return (static_cast<uint64_t>(node->index) + 1) << 32 | node->generation;
+}
+
+TimerWheel::Node* TimerWheel::find(TimerId id) {
+    uint64_t index = id >> 32;
+    if (index == 0 || index > nodes.size()) return nullptr;
+    Node* node = &nodes[index - 1];
+    if (!node->head || node->generation != static_cast<uint32_t>(id)) return nullptr;
+    return node;
+}
+
+void TimerWheel::cancel(TimerId id) {
+    if (Node* node = find(id)) {
+        unlink(node);
+        release(node);
+    }
+}
+
+// A timer goes into the finest level whose span covers its distance from the current
+// tick, in the slot its own tick selects at that level. A timer due before `earliest`
+// goes into earliest's slot: the next tick for a new timer, the current one for a timer
+// being cascaded, whose slot is about to run.
+void TimerWheel::place(Node* node, uint64_t earliest) {
+    uint64_t tick = std::max(node->tick, earliest);
+    uint64_t delta = tick - current;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) ++level;
+    if (delta >= (uint64_t(1) << (SLOT_BITS * LEVELS))) {
+        // Beyond the wheel's range: park in the top level's furthest slot and re-place
+        // from there when it cascades.
+        tick = current + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+    }
+    Node** head = &slots[level][(tick >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    node->head = head;
+    node->prev = nullptr;
+    node->next = *head;
+    if (*head) (*head)->prev = node;
+    *head = node;
+}
+
+void TimerWheel::unlink(Node* node) {
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        *node->head = node->next;
+    }
+    if (node->next) node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+    node->head = nullptr;
+}
+
+void TimerWheel::release(Node* node) {
+    node->callback = nullptr;
+    ++node->generation;
+    free_nodes.push_back(node);
+    --active;
+}
+
+// Moves the timers of the slot that level has just reached down to finer levels.
+void TimerWheel::cascade(int level) {
+    Node** head = &slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    Node* node = *head;
+    *head = nullptr;
+    while (node) {
+        Node* next = node->next;
+        place(node, current);
+        node = next;
+    }
+}
+
+void TimerWheel::advance(Clock::time_point now) {
+    uint64_t target = elapsed_ticks(now);
+    if (active == 0) {
+        current = std::max(current, target);
+        return;
+    }
+    while (current < target) {
+        ++current;
+        for (int level = LEVELS - 1; level > 0; --level) {
+            uint64_t below = current & ((uint64_t(1) << (SLOT_BITS * level)) - 1);
+            if (below == 0) cascade(level);
+        }
+        Node** head = &slots[0][current & (SLOTS - 1)];
+        while (Node* node = *head) {
+            unlink(node);
+            Callback callback = std::move(node->callback);
+            release(node);
+            callback();
+        }
+        if (active == 0) {
+            current = target;
+            return;
+        }
+    }
+}
+
+// The wheel must next turn either when a level-0 timer is due or when a coarser level
+// reaches a non-empty slot that has to be cascaded; the earliest of those bounds the sleep.
+int TimerWheel::next_timeout_ms(Clock::time_point now) const {
+    if (active == 0) return -1;
+    uint64_t due = UINT64_MAX;
+    for (int level = 0; level < LEVELS; ++level) {
+        int shift = SLOT_BITS * level;
+        uint64_t block = current >> shift;
+        for (uint64_t k = 1; k <= SLOTS; ++k) {
+            if (slots[level][(block + k) & (SLOTS - 1)]) {
+                due = std::min(due, (block + k) << shift);
+                break;
+            }
+        }
+    }
+    uint64_t now_tick = elapsed_ticks(now);
+    if (due <= now_tick) return 0;
+    return static_cast<int>(std::min<uint64_t>(due - now_tick, INT_MAX));
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+// Names a timer for cancellation; 0 never names one. A cancelled or fired timer's id
+// goes stale rather than being reused, so cancelling it late is harmless.
+using TimerId = uint64_t;
+
+// Hierarchical timing wheel with one-millisecond ticks: four levels of 256 slots cover
+// about 49 days, and a timer further out waits in the top level until it comes into
+// range. A timer sits in the level matching how far away it is and moves to finer
+// levels as the wheel turns, so adding and cancelling are O(1) and a tick only touches
+// timers that are due or are being cascaded.
+//
+// Not thread-safe: each reactor owns one and drives it from its event loop.
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    TimerId add(Clock::time_point when, Callback callback);
+    void cancel(TimerId id);
+    // Runs the callbacks of every timer due at `now`. Callbacks may add and cancel timers.
+    void advance(Clock::time_point now);
+    // Milliseconds the event loop may sleep before the wheel needs advancing, -1 if no
+    // timer is pending.
+    int next_timeout_ms(Clock::time_point now) const;
+    size_t size() const { return active; }
+
+private:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 8;
+    static constexpr size_t SLOTS = size_t(1) << SLOT_BITS;
+
+    struct Node {
+        Node* prev = nullptr;
+        Node* next = nullptr;
+        Node** head = nullptr;          // list the node is linked into, nullptr when free
+        uint64_t tick = 0;
+        uint32_t index = 0;             // position in nodes
+        uint32_t generation = 0;
+        Callback callback;
+    };
+
+    uint64_t tick_at(Clock::time_point when) const;
+    uint64_t elapsed_ticks(Clock::time_point now) const;
+    Node* find(TimerId id);
+    void place(Node* node, uint64_t earliest);
+    void unlink(Node* node);
+    void release(Node* node);
+    void cascade(int level);
+
+    Clock::time_point origin;
+    uint64_t current = 0;               // last tick processed
+    size_t active = 0;
+    std::deque<Node> nodes;             // a deque so nodes never move
+    std::vector<Node*> free_nodes;
+    Node* slots[LEVELS][SLOTS] = {};
+};